@@ -16,6 +16,7 @@
 #endif
 #include <libxml/threads.h>
 #include <libxml/uri.h>
+#include <libxml/xpathInternals.h>
 
 #include <bonobo/bonobo-dock-item.h>
 
@@ -23,6 +24,14 @@
 #include "utils.h"
 #include "xml.h"
 #include "entryedit.h"
+#include "save.h"
+#include "load.h"
+#include "watch.h"
+#include "versions.h"
+#include "stats.h"
+#include "edits.h"
+#include "xmlview.h"
+#include "xsltprof.h"
 
 /// GladeXML object of the application to access widgets
 extern GladeXML *my_glade_xml;
@@ -83,24 +92,31 @@ void dump_node(xmlNodePtr n)
 // file:/opt/gnome/share/gtk-doc/html/glib/glib-Threads.html
 // gtk-faq ff.
 // file:/home/micha/dict/t/gnome-things/gtk+-2.6.1/docs/faq/html/x482.html
-// XXX the only thing the user should be able to do
-// during evaluation of an XPath expression
-// should be pressing the stop-button
+// Several evaluations may run at the same time, and the user may keep
+// editing meanwhile: each evaluation pins the document (see versions.c)
 ///////////////////////////////////////////////////////////////
 
-int finish_gui_update_thread;
-
-/** Mutex to allow find_node_set_threaded() to be called only once
- * and make other calls return NULL
- */
-GMutex *find_nodeset_mutex = NULL;
+/// An XPath evaluation in a worker thread
+struct find_node_set_job
+{
+  const char *xpath;
+  xmlDocPtr doc;
+  /// created and freed by my_xmlXPathEvalExpression()
+  xmlXPathParserContextPtr pctxt;
+  xmlNodeSetPtr result;
+  const struct xpath_budget *budget;
+  /// limit of the budget that stopped the evaluation in the worker thread
+  enum xpath_budget_exceeded exceeded;
+  /// set under find_nodeset_pcontext_mutex when stopped from the GUI thread
+  gboolean interrupted;
+  gint finished;
+};
 
-/** Mutex to protect initial and final access to thread_xpath_pcontext
- * from the XPath evaluation thread and the Stop button thread.
+/// The find_node_set_job structures of all running evaluations
+/** Protected by find_nodeset_pcontext_mutex (see xml.c), which also guards
+ * the pctxt of the jobs against the Stop button callback.
  */
-GMutex *find_nodeset_pcontext_mutex = NULL;
-
-xmlXPathParserContextPtr thread_xpath_pcontext;
+static GSList *running_find_jobs;
 
 /** Inside this thread no GTK+ functions should be called - they are ignored
  * since we don't have the global GTK+ lock.
@@ -108,21 +124,15 @@ xmlXPathParserContextPtr thread_xpath_pcontext;
 static void *
 start_find_node_set_thread(void *private_data)
 {
-  const char *xpath = (const char *) private_data;
-  //g_printerr("  find_node_set_thread: Calling find_node_set(%s, ...)... ", xpath);
-
-  // creation and deletion of thread_xpath_pcontext in my_xmlXPathEvalExpression()
-  // are protected through a find_nodeset_pcontext_mutex
-  thread_xpath_pcontext = 0;
-
-  xmlNodeSetPtr result = find_node_set(xpath, teidoc, &thread_xpath_pcontext);
-  finish_gui_update_thread++;
- // g_printerr("  find_node_set_thread: ending\n");
-  return (void *) result;
+  struct find_node_set_job *job = private_data;
+  job->result = find_node_set_budget(job->xpath, job->doc, &job->pctxt,
+      job->budget, &job->exceeded);
+  g_atomic_int_set(&job->finished, 1);
+  return NULL;
 }
 
 
-/// Button callback that stops currently running XPath evaluation
+/// Button callback that stops all currently running XPath evaluations
 /** It works by setting an error code in the xmlXpathContext of the evaluation.
  *
  * This is how the XPath evaluation functions in FreeDict-Editor and libxml2 nest:
@@ -147,46 +157,151 @@ on_stop_find_nodeset_clicked           (GtkButton       *button,
                                         gpointer         user_data)
 {
   g_mutex_lock(find_nodeset_pcontext_mutex);
-  if(thread_xpath_pcontext)
+  GSList *l;
+  for(l = running_find_jobs; l; l = l->next)
   {
+    struct find_node_set_job *job = l->data;
+    if(!job->pctxt) continue;
     // it would be nice to modify libxml2 to create a new error code like
     // XPATH_EVALUATION_STOPPED_ERROR
-    thread_xpath_pcontext->error = XPATH_EXPR_ERROR;
+    job->pctxt->error = XPATH_EXPR_ERROR;
+    job->interrupted = TRUE;
     g_printerr("Success: Error code set.\n");
   }
   g_mutex_unlock(find_nodeset_pcontext_mutex);
 }
 
 
-xmlNodeSetPtr find_node_set_threaded(const char *xpath, const xmlDocPtr doc)
+/// Budget of the queries from the XPath template in the search dock
+/** Being typed while the user waits, a search should answer quickly or not
+ * at all.
+ */
+static const struct xpath_budget xpath_budget_search = { 5.0, 10000000, 10000 };
+
+/// Budget of each sanity check
+/** Sanity checks look at the whole dictionary and may legitimately find
+ * many entries, but one of them must not keep the editor busy for ages.
+ */
+static const struct xpath_budget xpath_budget_sanity = { 60.0, 200000000, 100000 };
+
+
+/// Short description of @a exceeded of @a budget for the user
+/** @return a static string, or NULL for XPATH_BUDGET_KEPT
+ */
+static const char *xpath_budget_describe(enum xpath_budget_exceeded exceeded,
+    const struct xpath_budget *budget)
+{
+  static char s[100];
+  switch(exceeded)
+  {
+    case XPATH_BUDGET_SECONDS:
+      g_snprintf(s, sizeof(s), _("took longer than %g seconds"),
+	  budget->seconds);
+      return s;
+    case XPATH_BUDGET_NODES:
+      g_snprintf(s, sizeof(s), _("visited more than %lu nodes"),
+	  budget->nodes);
+      return s;
+    case XPATH_BUDGET_RESULTS:
+      g_snprintf(s, sizeof(s), _("found more than %i nodes"),
+	  budget->results);
+      return s;
+    default:
+      return NULL;
+  }
+}
+
+
+/// Evaluate @a xpath in a worker thread, while the GUI stays responsive
+/**
+ * Entries that are edited during the evaluation are not freed until it is
+ * done.  If the document changed meanwhile, nodes that are not part of it
+ * anymore are dropped from the result.
+ *
+ * The evaluation is stopped when it exceeds a limit of @a budget, see
+ * find_node_set_budget().  The wall time is watched here, while the GUI
+ * events are processed.  A result cut off at budget->results is returned,
+ * but not cached.
+ *
+ * @arg exceeded set to the limit that stopped the evaluation, can be NULL
+ */
+xmlNodeSetPtr find_node_set_threaded(const char *xpath, const xmlDocPtr doc,
+    const struct xpath_budget *budget, enum xpath_budget_exceeded *exceeded)
 {
   g_debug("find_node_set_threaded()");
-  // return while an xpath match from another thread is being processed
-  if(!g_mutex_trylock(find_nodeset_mutex)) return NULL;
+
+  if(exceeded) *exceeded = XPATH_BUDGET_KEPT;
+
+  // unchanged document, or only entries changed the query looks into
+  xmlNodeSetPtr cached;
+  if(xpath_cache_find_node_set(xpath, doc, &cached)) return cached;
+  struct find_node_set_job job =
+    { xpath, doc, NULL, NULL, budget, XPATH_BUDGET_KEPT, FALSE, 0 };
+  guint version = doc_reader_pin();
+
+  g_mutex_lock(find_nodeset_pcontext_mutex);
+  running_find_jobs = g_slist_prepend(running_find_jobs, &job);
+  g_mutex_unlock(find_nodeset_pcontext_mutex);
 
   GtkWidget *stop =  glade_xml_get_widget(my_glade_xml, "stop_find_nodeset");
   gtk_widget_set_sensitive(stop, TRUE);
 
-  finish_gui_update_thread = 0;
-  GThread *thread = g_thread_create(start_find_node_set_thread, (gpointer) xpath, TRUE, NULL);
+  GThread *thread = g_thread_create(start_find_node_set_thread, &job, TRUE, NULL);
 
-  while(!finish_gui_update_thread)
+  // other evaluations started from here finish before this one returns
+  GTimer *timer = g_timer_new();
+  gboolean quit = FALSE, timed_out = FALSE;
+  while(!quit && !g_atomic_int_get(&job.finished))
   {
     while(gtk_events_pending())
     {
-      if(gtk_main_iteration()) finish_gui_update_thread++;
+      if(gtk_main_iteration()) quit = TRUE;
+    }
+    if(!timed_out && budget && budget->seconds &&
+	g_timer_elapsed(timer, NULL) > budget->seconds)
+    {
+      g_mutex_lock(find_nodeset_pcontext_mutex);
+      if(job.pctxt)
+      {
+	job.pctxt->error = XPATH_EXPR_ERROR;
+	job.interrupted = timed_out = TRUE;
+      }
+      g_mutex_unlock(find_nodeset_pcontext_mutex);
     }
-    //g_debug("next round... finish_gui_update_thread=%i",
-	//finish_gui_update_thread);
     g_thread_yield();
   }
+  g_timer_destroy(timer);
 
   g_debug(" joining find_node_set thread");
-  xmlNodeSetPtr result = g_thread_join(thread);
+  g_thread_join(thread);
+  xmlNodeSetPtr result = job.result;
 
-  gtk_widget_set_sensitive(stop, FALSE);
+  g_mutex_lock(find_nodeset_pcontext_mutex);
+  running_find_jobs = g_slist_remove(running_find_jobs, &job);
+  gboolean others = running_find_jobs != NULL;
+  g_mutex_unlock(find_nodeset_pcontext_mutex);
+  if(!others) gtk_widget_set_sensitive(stop, FALSE);
 
-  g_mutex_unlock(find_nodeset_mutex);
+  if(timed_out) job.exceeded = XPATH_BUDGET_SECONDS;
+  if(exceeded) *exceeded = job.exceeded;
+  if(result && job.interrupted)
+  {
+    // whatever came out of a stopped evaluation is incomplete
+    xmlXPathFreeNodeSet(result);
+    result = NULL;
+  }
+
+  gboolean complete = !job.interrupted && job.exceeded == XPATH_BUDGET_KEPT;
+  if(complete && !doc_changed_since(version))
+    xpath_cache_store(xpath, doc, result);
+  else if(result)
+  {
+    int i;
+    for(i = result->nodeNr - 1; i >= 0; i--)
+      if(!doc_node_is_live(result->nodeTab[i]))
+	xmlXPathNodeSetRemove(result, i);
+  }
+  doc_reader_unpin(version);
 
   g_debug("finished find_nodeset_threaded");
   return result;
@@ -209,7 +324,7 @@ void myload(const char *filename)
   //xmlLoadExtDtdDefaultValue = 1;
   //fprintf(stderr, "Load ext DTD was %i.\n", extd);
 
-  xmlDocPtr d = xmlParseFile(filename);
+  xmlDocPtr d = load_file_parallel(filename);
   if(!d)
   {
     mystatus(_("Failed to load %s!"), filename);
@@ -217,6 +332,7 @@ void myload(const char *filename)
   }
 
   setTeidoc(d);
+  watch_file(filename, d);
   g_debug("Finished loading.");
   on_select_entry_changed(NULL, NULL);
 }
@@ -389,8 +505,25 @@ on_app1_delete_event                   (GtkWidget       *widget,
 
   if(!sure) return TRUE;
 
+  // wait for a save started above or before
+  if(save_snapshot_running())
+  {
+    mystatus(_("Waiting for the file to be saved..."));
+    gchar *error = NULL;
+    if(!mysave_join(&error))
+    {
+      GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(app1),
+	  GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+	  GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+	  _("Saving failed: %s"), error);
+      gtk_dialog_run(GTK_DIALOG(dialog));
+      gtk_widget_destroy(dialog);
+      g_free(error);
+      return TRUE;
+    }
+  }
+
   // cleanup
-  if(find_nodeset_mutex) g_mutex_free(find_nodeset_mutex);
   if(find_nodeset_pcontext_mutex) g_mutex_free(find_nodeset_pcontext_mutex);
   gtk_main_quit();
   if(entry_stylesheet) xsltFreeStylesheet(entry_stylesheet);
@@ -630,12 +763,21 @@ gboolean on_select_timeout(gpointer data)
   }
   else gtk_list_store_clear(store);
 
-  xmlNodeSetPtr nodes = find_node_set_threaded(select, teidoc);
+  enum xpath_budget_exceeded exceeded;
+  xmlNodeSetPtr nodes = find_node_set_threaded(select, teidoc,
+      &xpath_budget_search, &exceeded);
 
-  if(!nodes || !nodes->nodeNr) mystatus(_("No matches."));
+  if(exceeded != XPATH_BUDGET_KEPT && (!nodes || !nodes->nodeNr))
+    mystatus(_("Search stopped: it %s."),
+	xpath_budget_describe(exceeded, &xpath_budget_search));
+  else if(!nodes || !nodes->nodeNr) mystatus(_("No matches."));
   else
   {
-    mystatus(_("%i matching nodes"), nodes->nodeNr);
+    // the first nodes of a result that was cut off are still shown
+    if(exceeded != XPATH_BUDGET_KEPT)
+      mystatus(_("Search stopped: it %s. Showing the first ones."),
+	  xpath_budget_describe(exceeded, &xpath_budget_search));
+    else mystatus(_("%i matching nodes"), nodes->nodeNr);
 
     GtkTreeIter i;
     xmlNodePtr *n;
@@ -643,7 +785,7 @@ gboolean on_select_timeout(gpointer data)
     for(n = nodes->nodeTab; *n && j<nodes->nodeNr && j<50; n++, j++)
     {
       char orthline[200];
-      entry_orths_to_string(*n, sizeof(orthline), orthline);
+      entry_orths_to_string_cached(*n, sizeof(orthline), orthline);
       gtk_list_store_append(store, &i);
       gtk_list_store_set(store, &i, 0, orthline, 1, *n, -1);
     }
@@ -679,8 +821,38 @@ on_select_entry_changed                (GtkEditable     *editable,
 }
 
 
+/// How many rows above and below an opened row are parsed ahead of time
+#define PREPARE_ADJACENT_ROWS 3
+
+/// Let form_prepare() parse the entries of the rows around @a path
+/** @arg column the column of @a model holding the xmlNodePtr of a row
+ */
+static void prepare_adjacent_rows(GtkTreeModel *model, GtkTreePath *path,
+    int column)
+{
+  xmlNodePtr entries[2*PREPARE_ADJACENT_ROWS+1];
+  int n = 0, i;
+
+  // siblings only, so in the sanity tree the rows of the same check
+  GtkTreePath *p = gtk_tree_path_copy(path);
+  for(i=0; i < PREPARE_ADJACENT_ROWS && gtk_tree_path_prev(p); i++);
+
+  GtkTreeIter iter;
+  gboolean valid = gtk_tree_model_get_iter(model, &iter, p);
+  while(valid && n < G_N_ELEMENTS(entries))
+  {
+    gtk_tree_model_get(model, &iter, column, &entries[n++], -1);
+    valid = gtk_tree_model_iter_next(model, &iter);
+  }
+  gtk_tree_path_free(p);
+
+  form_prepare(entries, n);
+}
+
+
 /// Treeview1 Row Double-Click Callback
 /** Opens the entry corresponding to the double-clicked in the entry editor.
+ * The entries of the rows around it are prepared for being opened next.
  */
 void
 on_treeview1_row_activated             (GtkTreeView     *treeview,
@@ -694,23 +866,37 @@ on_treeview1_row_activated             (GtkTreeView     *treeview,
   xmlNodePtr e;
   gtk_tree_model_get(GTK_TREE_MODEL(store), &iter, 1, &e, -1);
   set_edited_node(e);
+  prepare_adjacent_rows(GTK_TREE_MODEL(store), path, 1);
 }
 
 
 int sanity_treeview_remove_entry_pointers(xmlNodePtr n);
 
+/// Update what is kept here about teidoc, subscribed with doc_edit_subscribe()
+static void on_doc_edited(const struct doc_edit *edits, guint n,
+    gpointer user_data)
+{
+  gboolean local = FALSE;
+  guint i;
+  for(i = 0; i < n; i++)
+  {
+    const struct doc_edit *e = &edits[i];
+    xpath_cache_document_changed(e->old_node, e->new_node);
+    if(e->old_node) sanity_treeview_remove_entry_pointers(e->old_node);
+    local = local || e->local;
+  }
+  if(local && !file_modified)
+  { file_modified = TRUE; on_file_modified_changed(); }
+}
+
+
 void replace_edited_node(xmlNodePtr new_node)
 {
   g_return_if_fail(new_node);
   g_return_if_fail(edited_node);
 
   // replace old node element in teidoc
-  xmlReplaceNode(edited_node, new_node);
-
-  sanity_treeview_remove_entry_pointers(edited_node);
-  xmlFree(edited_node);
-  if(!file_modified)
-  { file_modified = TRUE; on_file_modified_changed(); }
+  doc_edit_replace(edited_node, new_node);
 
   set_edited_node(new_node);
   g_assert(edited_node == new_node);
@@ -730,6 +916,19 @@ gboolean save_textview1()
   GtkTextBuffer* b = gtk_text_view_get_buffer(textview1);
   if(!gtk_text_buffer_get_modified(b)) return TRUE;
 
+  // in a large node, parse only the changed children
+  switch(xmlview_apply_region())
+  {
+    case XMLVIEW_APPLY_DONE:
+      on_select_entry_changed(NULL, NULL);
+      mystatus(_("Edit accepted."));
+      return TRUE;
+    case XMLVIEW_APPLY_FAILED:
+      return FALSE;
+    default:
+      break;
+  }
+
   // fetch edited XML text
   GtkTextIter start, end;
   gtk_text_buffer_get_start_iter(b,  &start);
@@ -788,6 +987,44 @@ on_save_button_clicked                 (GtkButton       *button,
 #include <sys/time.h>
 #include <time.h>
 
+/// Parse the entry template, when the first entry is created
+static void entry_template_load(void)
+{
+  static gboolean tried;
+  if(entry_template_doc || tried) return;
+  tried = TRUE;
+
+  const char *fname1 = PACKAGE_DATA_DIR "/" PACKAGE "/entry-template.xml";
+  const char *fname2 = "data/entry-template.xml";
+  const char *fname3 = "../data/entry-template.xml";
+  const char *fname = NULL;
+  if(g_file_test(fname1, G_FILE_TEST_EXISTS)) fname = fname1;
+  else if(g_file_test(fname2, G_FILE_TEST_EXISTS)) fname = fname2;
+  else if(g_file_test(fname3, G_FILE_TEST_EXISTS)) fname = fname3;
+  if(fname)
+  {
+    // load_parser_options() reads it later, when entries are reloaded
+    int validity = xmlDoValidityCheckingDefaultValue;
+    xmlDoValidityCheckingDefaultValue = 0;
+    entry_template_doc = xmlParseFile(fname);
+    xmlDoValidityCheckingDefaultValue = validity;
+  }
+  else
+  {
+    GtkWidget *dialog = gtk_message_dialog_new (GTK_WINDOW(app1),
+	GTK_DIALOG_DESTROY_WITH_PARENT,
+	GTK_MESSAGE_ERROR,
+	GTK_BUTTONS_CLOSE,
+	_("Couldn't find entry template.  Checked locations: "
+	  "'%s', '%s' and %s"), fname1, fname2, fname3);
+    gtk_dialog_run (GTK_DIALOG (dialog));
+    gtk_widget_destroy (dialog);
+  }
+  if(!entry_template_doc)
+    mystatus(_("Failed to parse entry template!"));
+}
+
+
 void
 on_new_entry_button_clicked            (GtkButton       *button,
                                         gpointer         user_data)
@@ -799,21 +1036,22 @@ on_new_entry_button_clicked            (GtkButton       *button,
 
   // create new node and insert it into teidoc
   xmlNodePtr new_entry;
+  entry_template_load();
 
   // way 1: entry_template_doc
   if(entry_template_doc)
   {
     new_entry = xmlDocCopyNode(
 	xmlDocGetRootElement(entry_template_doc), teidoc, 1);
-    xmlNodePtr ret = xmlAddChild(bodyNode, new_entry);
-    if(!ret)
+    if(!new_entry)
     {
-      mystatus(_("xmlAddChild(bodyNode, newEntry) failed!"));
+      mystatus(_("xmlDocCopyNode(entry_template_doc) failed!"));
       return;
     }
   }
   else // way 2: empty entry node (invalidates teidoc!)
-    new_entry = xmlNewChild(bodyNode, NULL, (xmlChar *) "entry", (xmlChar *) "\n");
+    new_entry = xmlNewDocNode(teidoc, NULL, (xmlChar *) "entry", (xmlChar *) "\n");
+  doc_edit_add_child(bodyNode, new_entry);
 
   // show in edit area
   set_edited_node(new_entry);
@@ -878,14 +1116,9 @@ on_delete_button_clicked               (GtkButton       *button,
   // don't delete things that are no entries
   g_return_if_fail(!strcmp((char *) edited_node->name, "entry"));
 
-  xmlUnlinkNode(edited_node);
-  sanity_treeview_remove_entry_pointers(edited_node);
-  xmlFree(edited_node);
+  doc_edit_remove(edited_node);
   set_edited_node(NULL);
 
-  if(!file_modified)
-  { file_modified = TRUE; on_file_modified_changed(); }
-
   // update treeview1
   on_select_entry_changed(NULL, NULL);
 }
@@ -1244,6 +1477,108 @@ Values *load_values_from_gconf(const char *relative_key,
   return v;
 }
 
+static gboolean form_values_loaded;
+
+/// Read the option tables from GConf and fill the headword option menus
+/** This is done when the Form view is used first, not at startup.
+ */
+void form_values_load(void)
+{
+  if(form_values_loaded) return;
+  form_values_loaded = TRUE;
+
+  pos_values = load_values_from_gconf("pos_values", pos_values_default);
+  num_values = load_values_from_gconf("num_values", num_values_default);
+  domain_values = load_values_from_gconf("domain_values",
+      domain_values_default);
+  register_values = load_values_from_gconf("register_values",
+      register_values_default);
+  xr_values = load_values_from_gconf("xr_values", xr_values_default);
+  gen_values = load_values_from_gconf("gen_values", gen_values_default);
+
+  // XXX the accel paths don't work :(
+  // maybe we just have to make menus with accelerators???
+  // how to make an accel configuration dialog?
+  create_menu(
+      GTK_OPTION_MENU(glade_xml_get_widget(my_glade_xml, "pos_optionmenu")),
+      "<" PACKAGE ">/Headword/pos",
+      pos_values);
+
+  create_menu(
+      GTK_OPTION_MENU(glade_xml_get_widget(my_glade_xml, "num_optionmenu")),
+      "<" PACKAGE ">/Headword/num",
+      num_values);
+
+  create_menu(
+      GTK_OPTION_MENU(glade_xml_get_widget(my_glade_xml, "gen_optionmenu")),
+      "<" PACKAGE ">/Headword/gen",
+      gen_values);
+
+  //  gtk_menu_set_accel_path(
+//      GTK_MENU(gtk_option_menu_get_menu(
+//	  GTK_OPTION_MENU(glade_xml_get_widget(my_glade_xml, "num_optionmenu")))),
+//      "<" PACKAGE ">/num_optionmenu");
+}
+
+
+/// Create the HTML preview widget, which stays empty until an entry is shown
+static void html_preview_create(void)
+{
+  if(html_view) return;
+  html_view = html_view_new();
+  gtk_paned_pack2 (GTK_PANED (glade_xml_get_widget(
+	  my_glade_xml, "editor_preview_vpaned")), html_view, FALSE, TRUE);
+  htdoc = html_document_new();
+  g_signal_connect((gpointer) htdoc, "link_clicked",
+      G_CALLBACK(on_link_clicked), NULL);
+  html_view_set_document(HTML_VIEW(html_view), htdoc);
+
+  char *key = gnome_gconf_get_app_settings_relative(NULL, "hide_html_preview");
+  if(!gconf_client_get_bool(gc_client, key, NULL)) gtk_widget_show(html_view);
+  g_free(key);
+}
+
+
+/// Parse the stylesheet of the HTML preview, when the first entry is shown
+static gboolean entry_stylesheet_load(void)
+{
+  static gboolean failed;
+  if(entry_stylesheet) return TRUE;
+  if(failed) return FALSE;
+
+  entry_stylesheet = xsltParseStylesheetFile((xmlChar *) stylesheetfn);
+  if(!entry_stylesheet)
+  {
+    failed = TRUE;
+    mystatus(_("Could not load entry stylesheet %s. HTML Preview won't work!"),
+	stylesheetfn);
+    if(html_view) gtk_widget_hide(html_view);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+/// Work that was left out of on_app1_show(), once the window is usable
+static gboolean on_startup_idle(gpointer data)
+{
+  html_preview_create();
+  startup_mark("HTML preview created");
+  return FALSE;
+}
+
+
+static gboolean on_app1_first_expose(GtkWidget *widget, GdkEvent *event,
+    gpointer user_data)
+{
+  g_signal_handlers_disconnect_by_func(widget,
+      G_CALLBACK(on_app1_first_expose), user_data);
+  startup_mark("first frame");
+  g_idle_add(on_startup_idle, NULL);
+  return FALSE;
+}
+
+
 // forward declaration
 static void on_gconf_client_notify(GConfClient *client, guint cnxn_id,
     GConfEntry *entry, gpointer user_data);
@@ -1253,8 +1588,16 @@ on_app1_show                           (GtkWidget       *widget,
                                         gpointer         user_data)
 {
   g_debug("on_app1_show()");
-  find_nodeset_mutex = g_mutex_new();
   find_nodeset_pcontext_mutex = g_mutex_new();
+  stats_add_menu_item(glade_xml_get_widget(my_glade_xml, "sanity_check"));
+  xsltprof_add_menu_items(glade_xml_get_widget(my_glade_xml, "view_html"));
+
+  // who has to learn about changes of teidoc
+  doc_edit_subscribe(stats_doc_edited, NULL);
+  doc_edit_subscribe(watch_doc_edited, NULL);
+  doc_edit_subscribe(on_doc_edited, NULL);
+  doc_edit_subscribe(form_prepare_doc_edited, NULL);
+  doc_edit_subscribe(xmlview_doc_edited, NULL);
 
   gc_client = gconf_client_get_default();
   char* freedictkeypath = gnome_gconf_get_app_settings_relative(NULL, NULL);
@@ -1266,6 +1609,7 @@ on_app1_show                           (GtkWidget       *widget,
                           NULL,
                           NULL, NULL);
   g_free(freedictkeypath);
+  startup_mark("GConf preloaded");
 
   // load settings
   if(!stylesheetfn)
@@ -1304,64 +1648,13 @@ on_app1_show                           (GtkWidget       *widget,
   key = gnome_gconf_get_app_settings_relative(NULL, "hide_html_preview");
   gconf_client_notify(gc_client, key);
   g_free(key);
+  startup_mark("settings applied");
 
-  pos_values = load_values_from_gconf("pos_values", pos_values_default);
-  num_values = load_values_from_gconf("num_values", num_values_default);
-  domain_values = load_values_from_gconf("domain_values",
-      domain_values_default);
-  register_values = load_values_from_gconf("register_values",
-      register_values_default);
-  xr_values = load_values_from_gconf("xr_values", xr_values_default);
-  gen_values = load_values_from_gconf("gen_values", gen_values_default);
-
-  if(!entry_template_doc)
-  {
-    xmlDoValidityCheckingDefaultValue = 0;
-    const char *fname1 = PACKAGE_DATA_DIR "/" PACKAGE "/entry-template.xml";
-    const char *fname2 = "data/entry-template.xml";
-    const char *fname3 = "../data/entry-template.xml";
-    if(g_file_test(fname1, G_FILE_TEST_EXISTS))
-      entry_template_doc = xmlParseFile(fname1);
-    else if(g_file_test(fname2, G_FILE_TEST_EXISTS))
-      entry_template_doc = xmlParseFile(fname2);
-    else if(g_file_test(fname3, G_FILE_TEST_EXISTS))
-      entry_template_doc = xmlParseFile(fname3);
-    else
-    {
-      GtkWidget *dialog = gtk_message_dialog_new (GTK_WINDOW(app1),
-	  GTK_DIALOG_DESTROY_WITH_PARENT,
-	  GTK_MESSAGE_ERROR,
-	  GTK_BUTTONS_CLOSE,
-	  _("Couldn't find entry template.  Checked locations: "
-	    "'%s', '%s' and %s"), fname1, fname2, fname3);
-      gtk_dialog_run (GTK_DIALOG (dialog));
-      gtk_widget_destroy (dialog);
-    }
-    if(!entry_template_doc)
-      mystatus(_("Failed to parse entry template!"));
-  }
-
-  if(!entry_stylesheet)
-  {
-    entry_stylesheet =
-      xsltParseStylesheetFile((xmlChar *) stylesheetfn);
-    if(!entry_stylesheet)
-    {
-      mystatus(_("Could not load entry stylesheet %s. HTML Preview won't work!"),
-	  stylesheetfn);
-    }
-    else
-    {
-      html_view = html_view_new();
-      gtk_paned_pack2 (GTK_PANED (glade_xml_get_widget(
-	      my_glade_xml, "editor_preview_vpaned")), html_view, FALSE, TRUE);
-      htdoc = html_document_new();
-      g_signal_connect((gpointer) htdoc, "link_clicked",
-	  G_CALLBACK(on_link_clicked), NULL);
-      html_view_set_document(HTML_VIEW(html_view), htdoc);
-      gtk_widget_show(html_view);
-    }
-  }
+  // The option tables, the entry template, the stylesheet and the HTML
+  // preview are not needed for the first frame.  See form_values_load(),
+  // entry_template_load(), entry_stylesheet_load() and on_startup_idle().
+  g_signal_connect(app1, "expose-event",
+      G_CALLBACK(on_app1_first_expose), NULL);
 
   if(!senses) senses = g_array_new(FALSE, TRUE, sizeof(Sense));
 
@@ -1395,29 +1688,6 @@ on_app1_show                           (GtkWidget       *widget,
 */
   setTeidoc(NULL);
 
-  // XXX the accel paths don't work :(
-  // maybe we just have to make menus with accelerators???
-  // how to make an accel configuration dialog?
-  create_menu(
-      GTK_OPTION_MENU(glade_xml_get_widget(my_glade_xml, "pos_optionmenu")),
-      "<" PACKAGE ">/Headword/pos",
-      pos_values);
-
-  create_menu(
-      GTK_OPTION_MENU(glade_xml_get_widget(my_glade_xml, "num_optionmenu")),
-      "<" PACKAGE ">/Headword/num",
-      num_values);
-
-  create_menu(
-      GTK_OPTION_MENU(glade_xml_get_widget(my_glade_xml, "gen_optionmenu")),
-      "<" PACKAGE ">/Headword/gen",
-      gen_values);
-
-  //  gtk_menu_set_accel_path(
-//      GTK_MENU(gtk_option_menu_get_menu(
-//	  GTK_OPTION_MENU(glade_xml_get_widget(my_glade_xml, "num_optionmenu")))),
-//      "<" PACKAGE ">/num_optionmenu");
-
   // enable drops
   static GtkTargetEntry target_table[] = {
     // I found this target type searching through the GTK sources, as in the
@@ -1438,15 +1708,15 @@ on_app1_show                           (GtkWidget       *widget,
 void update_html_preview(xmlNodePtr entry)
 {
   g_return_if_fail(entry);
-  g_return_if_fail(entry_stylesheet);
+  html_preview_create();
+  if(!entry_stylesheet_load()) return;
 
   // assert HTML preview is enabled
   // do not check it (again)
 
   xmlDocPtr xml_entry = copy_node_to_doc(entry);
   const char *params[1] = { NULL };
-  xmlDocPtr html_entry = xsltApplyStylesheet(entry_stylesheet,
-      xml_entry, params);
+  xmlDocPtr html_entry = xsltprof_apply(entry_stylesheet, xml_entry, params);
   if(xml_entry) xmlFreeDoc(xml_entry);
 
   const char *err = N_("Error converting entry to HTML!");
@@ -1696,6 +1966,8 @@ GtkListStore *spell_sugg_store;
 GtkCellRenderer *spell_sugg_renderer;
 
 xmlNodeSetPtr spell_nodes;
+/// Keeps the nodes of @a spell_nodes from being freed while they are checked
+guint spell_nodes_pin;
 /// Index into @a spell_nodes. Updates should be done using set_spell_current_node_idx()
 int spell_current_node_idx;
 xmlNodePtr spell_current_node;
@@ -1741,47 +2013,408 @@ static void set_spell_current_node_idx(unsigned int value)
       (gdouble) spell_current_node_idx /
       (gdouble) xmlXPathNodeSetGetLength(spell_nodes));
 }
-#endif
 
-static void spell_getsuggestions(char *word)
+static void spell_release_nodes(void)
 {
-#ifdef HAVE_LIBASPELL
-  GtkTreeView *sugg_treeview = GTK_TREE_VIEW(
-      glade_xml_get_widget(scw_xml, "suggestions_treeview"));
+  if(!spell_nodes) return;
+  xmlXPathFreeNodeSet(spell_nodes);
+  spell_nodes = 0;
+  doc_reader_unpin(spell_nodes_pin);
+}
 
-  if(!spell_sugg_store)
+/// Give the current text node new content
+static void spell_set_current_content(const xmlChar *content)
+{
+  xmlNodePtr n = doc_edit_set_text(spell_current_node, content);
+  g_return_if_fail(n);
+  spell_current_node = n;
+  spell_nodes->nodeTab[spell_current_node_idx] = n;
+}
+
+
+/// Content of text node @a n in ISO-8859-1, as aspell is fed with it
+static gchar *spell_node_latin1(const xmlNodePtr n)
+{
+  // a text node, whose content can be used in place
+  const xmlChar *content = node_single_text(n);
+  if(!content) return NULL;
+
+  // UTF-8 -> ISO-8859-1
+  // XXX also convert things for session/personal dict
+  GError *error = NULL;
+  char *iso88591text = g_convert((char *) content, strlen((char *) content),
+      "ISO-8859-1", "UTF-8", NULL, NULL, &error);
+  if(error != NULL)
   {
-    spell_sugg_store = gtk_list_store_new(1, G_TYPE_STRING);
-    gtk_tree_view_set_model(sugg_treeview,
-	GTK_TREE_MODEL(spell_sugg_store));
+    g_printerr("Couldn't convert string from UTF-8 to ISO-8859-1: '%s'. Ignoring.\n",
+	content);
+    g_error_free(error);
   }
-  else gtk_list_store_clear(spell_sugg_store);
+  return iso88591text;
+}
 
-  GtkTreeIter i;
 
-  const AspellWordList *suggestions = aspell_speller_suggest(s, word, -1);
+/// Suggestions of @a speller for @a word, converted to UTF-8
+/** aspell_speller_suggest() is the slowest call of aspell, so its results are
+ * kept in the suggestion cache.
+ * @return NULL terminated array to be freed with g_strfreev()
+ */
+static gchar **spell_suggest(AspellSpeller *speller, const char *word)
+{
+  GPtrArray *a = g_ptr_array_new();
+  const AspellWordList *suggestions = aspell_speller_suggest(speller, word, -1);
   AspellStringEnumeration *elements = aspell_word_list_elements(suggestions);
   const char *sugg;
   while((sugg = aspell_string_enumeration_next(elements)))
   {
     // XXX remove this... ISO-8859-1 -> UTF-8
-    gchar *utf8text;
-    gsize length = strlen(sugg);
     GError *error = NULL;
-
-    utf8text = g_convert(sugg, length, "UTF-8", "ISO-8859-1",
+    gchar *utf8text = g_convert(sugg, strlen(sugg), "UTF-8", "ISO-8859-1",
 	NULL, NULL, &error);
     if(error != NULL)
     {
       g_printerr("Couldn't convert string from ISO-8859-1 to UTF-8: '%s'. Ignoring.\n",
 	 sugg);
       g_error_free(error);
+      continue;
     }
+    g_ptr_array_add(a, utf8text);
+  }
+  delete_aspell_string_enumeration(elements);
+  g_ptr_array_add(a, NULL);
+  return (gchar **) g_ptr_array_free(a, FALSE);
+}
+
+
+/// Identifies the word lists of a speller made from @a config
+static gchar *spell_dict_key(AspellConfig *config)
+{
+  // each returned string is only valid until the next call
+  gchar *lang = g_strdup(aspell_config_retrieve(config, "lang"));
+  gchar *jargon = g_strdup(aspell_config_retrieve(config, "jargon"));
+  gchar *size = g_strdup(aspell_config_retrieve(config, "size"));
+  gchar *key = g_strdup_printf("%s/%s/%s/%s", lang, jargon, size,
+      aspell_config_retrieve(config, "run-together"));
+  g_free(lang);
+  g_free(jargon);
+  g_free(size);
+  return key;
+}
+
+
+/// spell_dict_key() of the current speller @a s
+static gchar *spell_dict;
+
+/// Suggestions by dictionary and word, "dict\nword" -> gchar **
+/** It is filled by the GUI and the prefetch thread, so access is guarded by
+ * @a spell_cache_mutex.
+ */
+static GHashTable *spell_cache;
+static GStaticMutex spell_cache_mutex = G_STATIC_MUTEX_INIT;
+/// When the cache has grown this large, it is emptied
+#define SPELL_CACHE_MAX 20000
+/// Bumped by spell_cache_forget(), only in the GUI thread
+/** Suggestions computed before are stale, so spell_cache_insert() drops
+ * them.  Written under @a spell_cache_mutex.
+ */
+static guint spell_cache_generation;
+
+/// Store @a sugg for @a word, unless it is known already or stale
+/** @a sugg is taken over.
+ *
+ * @arg generation @a spell_cache_generation when the decisions that
+ *      @a sugg follows were made
+ */
+static void spell_cache_insert(const char *dict, const char *word, gchar **sugg,
+    guint generation)
+{
+  gchar *key = g_strconcat(dict, "\n", word, NULL);
+  g_static_mutex_lock(&spell_cache_mutex);
+  if(!spell_cache) spell_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+      g_free, (GDestroyNotify) g_strfreev);
+  if(g_hash_table_size(spell_cache) >= SPELL_CACHE_MAX)
+    g_hash_table_remove_all(spell_cache);
+  if(generation == spell_cache_generation &&
+      !g_hash_table_lookup(spell_cache, key))
+  {
+    g_hash_table_insert(spell_cache, key, sugg);
+    key = NULL; sugg = NULL;
+  }
+  g_static_mutex_unlock(&spell_cache_mutex);
+  g_free(key);
+  g_strfreev(sugg);
+}
+
+
+/// @return a copy of the cached suggestions for @a word or NULL
+static gchar **spell_cache_lookup(const char *dict, const char *word)
+{
+  gchar *key = g_strconcat(dict, "\n", word, NULL);
+  g_static_mutex_lock(&spell_cache_mutex);
+  gchar **sugg = spell_cache ?
+    g_strdupv(g_hash_table_lookup(spell_cache, key)) : NULL;
+  g_static_mutex_unlock(&spell_cache_mutex);
+  g_free(key);
+  return sugg;
+}
+
+
+/// Drop the suggestions for @a word, eg. when a replacement was stored for it
+/** Prefetch jobs that were sent before are not told about the decision yet,
+ * so what they find is not stored anymore.
+ */
+static void spell_cache_forget(const char *dict, const char *word)
+{
+  gchar *key = g_strconcat(dict, "\n", word, NULL);
+  g_static_mutex_lock(&spell_cache_mutex);
+  if(spell_cache) g_hash_table_remove(spell_cache, key);
+  spell_cache_generation++;
+  g_static_mutex_unlock(&spell_cache_mutex);
+  g_free(key);
+}
+
+
+/// Worker thread computing suggestions ahead of the dialog
+static GThreadPool *spell_prefetch_pool;
+/// Number of jobs pushed to @a spell_prefetch_pool and not done yet
+static volatile gint spell_prefetch_running;
+/// Index into @a spell_nodes up to which prefetching was requested
+static int spell_prefetched_upto;
+/// How many nodes ahead of the current one misspellings are looked for
+#define SPELL_PREFETCH_NODES 32
+
+/// Words the prefetch speller should accept, not sent yet
+static GPtrArray *spell_pending_session;
+/// Misspelled word, replacement, ... for the prefetch speller, not sent yet
+static GPtrArray *spell_pending_replacements;
+
+/// An entry for the spell_prefetch_pool
+struct spell_prefetch_job
+{
+  AspellConfig *config;///< clone of @a c, or NULL to release the speller
+  gchar *dict;///< spell_dict_key() of @a config
+  gchar **texts;///< node contents in ISO-8859-1
+  GPtrArray *session;
+  GPtrArray *replacements;
+  guint generation;///< @a spell_cache_generation after @a replacements
+};
+
+// Owned by the prefetch thread.  The GUI speller @a s is not shared, as
+// aspell objects may only be used by one thread at a time.
+static AspellSpeller *spell_worker_speller;
+static AspellDocumentChecker *spell_worker_checker;
+static gchar *spell_worker_dict;
+
+
+static void spell_worker_release(void)
+{
+  if(spell_worker_checker) delete_aspell_document_checker(spell_worker_checker);
+  if(spell_worker_speller) delete_aspell_speller(spell_worker_speller);
+  spell_worker_checker = NULL;
+  spell_worker_speller = NULL;
+  g_free(spell_worker_dict);
+  spell_worker_dict = NULL;
+}
+
+
+static void spell_prefetch_thread(gpointer data, gpointer user_data)
+{
+  struct spell_prefetch_job *job = data;
+  guint i;
+
+  if(!job->config ||
+      (spell_worker_dict && strcmp(spell_worker_dict, job->dict)))
+    spell_worker_release();
 
+  if(job->config && !spell_worker_dict)
+  {
+    // new_aspell_speller() takes much time, but not in the GUI thread
+    spell_worker_dict = g_strdup(job->dict);
+    AspellCanHaveError *err = new_aspell_speller(job->config);
+    if(aspell_error_number(err) != 0)
+    {
+      g_printerr("Error: %s\n", aspell_error_message(err));
+      delete_aspell_can_have_error(err);
+    }
+    else spell_worker_speller = to_aspell_speller(err);
+
+    if(spell_worker_speller)
+    {
+      err = new_aspell_document_checker(spell_worker_speller);
+      if(aspell_error(err) != 0)
+      {
+	g_printerr("Error: %s\n", aspell_error_message(err));
+	delete_aspell_can_have_error(err);
+      }
+      else spell_worker_checker = to_aspell_document_checker(err);
+    }
+  }
+
+  // follow the decisions made in the dialog
+  if(spell_worker_speller)
+  {
+    for(i=0; job->session && i < job->session->len; i++)
+      aspell_speller_add_to_session(spell_worker_speller,
+	  g_ptr_array_index(job->session, i), -1);
+    for(i=0; job->replacements && i+1 < job->replacements->len; i+=2)
+      aspell_speller_store_replacement(spell_worker_speller,
+	  g_ptr_array_index(job->replacements, i), -1,
+	  g_ptr_array_index(job->replacements, i+1), -1);
+  }
+
+  for(i=0; spell_worker_checker && job->texts && job->texts[i]; i++)
+  {
+    aspell_document_checker_process(spell_worker_checker, job->texts[i], -1);
+    AspellToken t;
+    while(t = aspell_document_checker_next_misspelling(spell_worker_checker),
+	t.len != 0)
+    {
+      gchar *word = g_strndup(job->texts[i] + t.offset, t.len);
+      gchar **sugg = spell_cache_lookup(job->dict, word);
+      if(sugg) g_strfreev(sugg);
+      else spell_cache_insert(job->dict, word,
+	  spell_suggest(spell_worker_speller, word), job->generation);
+      g_free(word);
+    }
+  }
+
+  if(job->config) delete_aspell_config(job->config);
+  g_free(job->dict);
+  g_strfreev(job->texts);
+  if(job->session)
+  {
+    g_ptr_array_foreach(job->session, (GFunc) g_free, NULL);
+    g_ptr_array_free(job->session, TRUE);
+  }
+  if(job->replacements)
+  {
+    g_ptr_array_foreach(job->replacements, (GFunc) g_free, NULL);
+    g_ptr_array_free(job->replacements, TRUE);
+  }
+  g_free(job);
+  g_atomic_int_add(&spell_prefetch_running, -1);
+}
+
+
+static void spell_prefetch_push(struct spell_prefetch_job *job)
+{
+  if(!spell_prefetch_pool) spell_prefetch_pool =
+    g_thread_pool_new(spell_prefetch_thread, NULL, 1, FALSE, NULL);
+  job->session = spell_pending_session;
+  job->replacements = spell_pending_replacements;
+  spell_pending_session = NULL;
+  spell_pending_replacements = NULL;
+  // only the GUI thread changes it
+  job->generation = spell_cache_generation;
+  g_atomic_int_inc(&spell_prefetch_running);
+  g_thread_pool_push(spell_prefetch_pool, job, NULL);
+}
+
+
+/// Compute suggestions for the misspellings in the nodes from @a idx on
+/** This is done on a worker, so the dialog can show them without delay when
+ * it advances.  A new job is only queued when the previous one is done and
+ * the current node comes near the end of the prefetched range.
+ */
+static void spell_prefetch(int idx)
+{
+  g_return_if_fail(c && spell_dict);
+  int n = xmlXPathNodeSetGetLength(spell_nodes);
+  if(g_atomic_int_get(&spell_prefetch_running)) return;
+  if(spell_prefetched_upto >= n ||
+      spell_prefetched_upto >= idx + SPELL_PREFETCH_NODES/2) return;
+
+  int i, to = MIN(n, idx + SPELL_PREFETCH_NODES);
+  GPtrArray *texts = g_ptr_array_new();
+  for(i = MAX(idx, spell_prefetched_upto); i < to; i++)
+  {
+    xmlNodePtr nd = xmlXPathNodeSetItem(spell_nodes, i);
+    if(!nd || !doc_node_is_live(nd) || !xmlNodeIsText(nd)) continue;
+    gchar *t = spell_node_latin1(nd);
+    if(t) g_ptr_array_add(texts, t);
+  }
+  g_ptr_array_add(texts, NULL);
+  spell_prefetched_upto = to;
+
+  struct spell_prefetch_job *job = g_new0(struct spell_prefetch_job, 1);
+  job->config = aspell_config_clone(c);
+  job->dict = g_strdup(spell_dict);
+  job->texts = (gchar **) g_ptr_array_free(texts, FALSE);
+  spell_prefetch_push(job);
+}
+
+
+/// Let the prefetch speller accept @a word, like the GUI speller does now
+static void spell_prefetch_accept(const char *word)
+{
+  if(!spell_pending_session) spell_pending_session = g_ptr_array_new();
+  g_ptr_array_add(spell_pending_session, g_strdup(word));
+  spell_cache_forget(spell_dict, word);
+}
+
+
+/// Tell the prefetch speller about a replacement stored in the GUI speller
+static void spell_prefetch_replacement(const char *word, const char *replacement)
+{
+  if(!spell_pending_replacements) spell_pending_replacements = g_ptr_array_new();
+  g_ptr_array_add(spell_pending_replacements, g_strdup(word));
+  g_ptr_array_add(spell_pending_replacements, g_strdup(replacement));
+  // the suggestions should start with it now
+  spell_cache_forget(spell_dict, word);
+}
+
+
+/// Forget what was not sent to the prefetch speller yet
+static void spell_prefetch_forget_pending(void)
+{
+  if(spell_pending_session)
+  {
+    g_ptr_array_foreach(spell_pending_session, (GFunc) g_free, NULL);
+    g_ptr_array_free(spell_pending_session, TRUE);
+    spell_pending_session = NULL;
+  }
+  if(spell_pending_replacements)
+  {
+    g_ptr_array_foreach(spell_pending_replacements, (GFunc) g_free, NULL);
+    g_ptr_array_free(spell_pending_replacements, TRUE);
+    spell_pending_replacements = NULL;
+  }
+}
+#endif
+
+static void spell_getsuggestions(char *word)
+{
+#ifdef HAVE_LIBASPELL
+  GtkTreeView *sugg_treeview = GTK_TREE_VIEW(
+      glade_xml_get_widget(scw_xml, "suggestions_treeview"));
+
+  if(!spell_sugg_store)
+  {
+    spell_sugg_store = gtk_list_store_new(1, G_TYPE_STRING);
+    gtk_tree_view_set_model(sugg_treeview,
+	GTK_TREE_MODEL(spell_sugg_store));
+  }
+  else gtk_list_store_clear(spell_sugg_store);
+
+  GtkTreeIter i;
+
+  // usually the prefetch thread was faster
+  gchar **sugg = spell_cache_lookup(spell_dict, word);
+  if(!sugg)
+  {
+    sugg = spell_suggest(s, word);
+    spell_cache_insert(spell_dict, word, g_strdupv(sugg),
+	spell_cache_generation);
+  }
+
+  gchar **su;
+  for(su = sugg; *su; su++)
+  {
     // add to suggestion list
     gtk_list_store_append(spell_sugg_store, &i);// init i
-    gtk_list_store_set(spell_sugg_store, &i, 0, utf8text, -1);
+    gtk_list_store_set(spell_sugg_store, &i, 0, *su, -1);
   }
+  g_strfreev(sugg);
 
   if(!spell_sugg_renderer)
   {
@@ -1790,7 +2423,6 @@ static void spell_getsuggestions(char *word)
       ("Suggestions", spell_sugg_renderer, "text", 0, NULL);
     gtk_tree_view_append_column(sugg_treeview, spell_sugg_column);
   }
-  delete_aspell_string_enumeration(elements);
 
   // select first replacement
   GtkTreePath *p = gtk_tree_path_new_first();
@@ -1838,6 +2470,7 @@ gboolean spell_handle_current_word()
 
   gtk_entry_set_text(GTK_ENTRY(glade_xml_get_widget(scw_xml, "misspelled_word_entry")),
       misspelled_token_str);
+  spell_prefetch(spell_current_node_idx);
   spell_getsuggestions(misspelled_token_str);
 #else
   g_return_val_if_fail(spell_current_words &&
@@ -1871,6 +2504,7 @@ gboolean spell_handle_current_word()
 
   gtk_entry_set_text(GTK_ENTRY(glade_xml_get_widget(scw_xml, "misspelled_word_entry")),
       spell_current_words[spell_current_word_idx]);
+  spell_prefetch(spell_current_node_idx);
   spell_getsuggestions(spell_current_words[spell_current_word_idx]);
 #endif // NOCKR
 
@@ -1914,22 +2548,8 @@ gboolean spell_handle_current_node(void)
   if(!spell_current_words)
 #endif
   {
-    xmlChar *spell_current_content = xmlNodeGetContent(spell_current_node);
-
-    // UTF-8 -> ISO-8859-1
-    // XXX also convert things for session/personal dict
-    gsize length = strlen((char *) spell_current_content);
-    GError *error = NULL;
-
-    char *iso88591text = g_convert((char *) spell_current_content, length, "ISO-8859-1",
-       	"UTF-8", NULL, NULL, &error);
-    if(error != NULL)
-    {
-      g_printerr("Couldn't convert string from UTF-8 to ISO-8859-1: '%s'. Ignoring.\n",
-	 spell_current_content);
-      g_error_free(error);
-    }
-    g_strlcpy(spell_content, iso88591text, sizeof(spell_content));
+    char *iso88591text = spell_node_latin1(spell_current_node);
+    g_strlcpy(spell_content, iso88591text ? iso88591text : "", sizeof(spell_content));
     g_free(iso88591text);
 
 #ifndef NOCKR
@@ -1953,9 +2573,9 @@ gboolean spell_handle_current_node(void)
 
   if(replaced_something)
   {
-    xmlChar *old_content = xmlNodeGetContent(spell_current_node);
-    g_print("Node content: old='%s' new='%s'\n", old_content, spell_content);
-    xmlNodeSetContent(spell_current_node, (xmlChar *) spell_content);
+    g_print("Node content: old='%s' new='%s'\n",
+	node_single_text(spell_current_node), spell_content);
+    spell_set_current_content((xmlChar *) spell_content);
  }
   in_node = FALSE;
 #else
@@ -2001,6 +2621,12 @@ void get_new_checker_speller()
   else s = to_aspell_speller(possible_err);
   g_return_if_fail(s);
 
+  // decisions made for the previous speller do not apply anymore
+  g_free(spell_dict);
+  spell_dict = spell_dict_key(c);
+  spell_prefetch_forget_pending();
+  spell_prefetched_upto = 0;
+
   // Set up the document checker
   possible_err = new_aspell_document_checker(s);
   if(aspell_error(possible_err) != 0)
@@ -2093,6 +2719,13 @@ void spell_continue_check()
 
     if(!spell_current_node) break;// finished spellcheck
 
+    if(!doc_node_is_live(spell_current_node))
+    {
+      g_debug("Node %i was removed meanwhile. Skip.", spell_current_node_idx);
+      set_spell_current_node_idx(spell_current_node_idx+1);
+      continue;
+    }
+
     if(!xmlNodeIsText(spell_current_node))
     {
       g_debug("Node %i is no text node. Skip.", spell_current_node_idx);
@@ -2160,11 +2793,14 @@ void spell_query_nodes()
   }
   g_print("query: '%s'...", query);
 
+  spell_release_nodes();
+  spell_nodes_pin = doc_reader_pin();
   spell_nodes = find_node_set(query, teidoc, NULL);
   g_print(" %i nodes\n", xmlXPathNodeSetGetLength(spell_nodes));
 
   set_spell_current_node_idx(0);
   in_node = FALSE;
+  spell_prefetched_upto = 0;
 
   g_return_if_fail(xmlXPathNodeSetGetLength(spell_nodes));
 #endif
@@ -2288,6 +2924,7 @@ on_spell_replace_button_clicked        (GtkButton       *button,
   replaced_something = TRUE;
 
   aspell_speller_store_replacement(s, misspelled_token_str, -1, replacement, -1);
+  spell_prefetch_replacement(misspelled_token_str, replacement);
 #else
 
   char *old = spell_current_words[spell_current_word_idx];
@@ -2304,16 +2941,16 @@ on_spell_replace_button_clicked        (GtkButton       *button,
   // -> split again?
   spell_current_words[spell_current_word_idx] = replacement;
   aspell_speller_store_replacement(s, old, -1, replacement, -1);
+  spell_prefetch_replacement(old, replacement);
   g_free(old);
 
   gchar* new_content = g_strjoinv(" ", spell_current_words);
   g_print("New node content: '%s'\n", new_content);
 
   g_return_if_fail(spell_current_node);
-  xmlChar *spell_current_content = xmlNodeGetContent(spell_current_node);
-  g_print("Old node content: '%s'\n", spell_current_content);
+  g_print("Old node content: '%s'\n", node_single_text(spell_current_node));
 
-  xmlNodeSetContent(spell_current_node, new_content);
+  spell_set_current_content((xmlChar *) new_content);
   g_free(new_content);
 
 #endif
@@ -2373,6 +3010,7 @@ on_spell_ignore_all_button_clicked     (GtkButton       *button,
   int ret = aspell_speller_add_to_session(s, misspelled_token_str, -1);
   g_print("Storing '%s' in session word list gave %i (0 = error, 1 = success).\n",
       misspelled_token_str, ret);
+  if(ret) spell_prefetch_accept(misspelled_token_str);
 #else
   g_return_if_fail(spell_current_words);
   g_return_if_fail(spell_current_words[spell_current_word_idx]);
@@ -2380,6 +3018,7 @@ on_spell_ignore_all_button_clicked     (GtkButton       *button,
   int ret = aspell_speller_add_to_session(s, spell_current_words[spell_current_word_idx], -1);
   g_print("Storing '%s' in session word list gave %i (0 = error, 1 = success).\n",
       spell_current_words[spell_current_word_idx], ret);
+  if(ret) spell_prefetch_accept(spell_current_words[spell_current_word_idx]);
 #endif
   if(!ret) g_printerr("Aspell error: %s\n", aspell_speller_error_message(s));
   spell_continue_check();
@@ -2397,6 +3036,7 @@ on_spell_add_button_clicked            (GtkButton       *button,
   int ret = aspell_speller_add_to_personal(s, misspelled_token_str, -1);
   g_print("Storing '%s' in personal word list gave %i (0 = error, 1 = success).\n",
       misspelled_token_str, ret);
+  if(ret) spell_prefetch_accept(misspelled_token_str);
 #else
   g_return_if_fail(spell_current_words);
   g_return_if_fail(spell_current_words[spell_current_word_idx]);
@@ -2404,6 +3044,7 @@ on_spell_add_button_clicked            (GtkButton       *button,
   int ret = aspell_speller_add_to_personal(s, spell_current_words[spell_current_word_idx], -1);
   g_print("Storing '%s' in personal word list gave %i (0 = error, 1 = success).\n",
       spell_current_words[spell_current_word_idx], ret);
+  if(ret) spell_prefetch_accept(spell_current_words[spell_current_word_idx]);
 #endif
   if(!ret) g_printerr("Aspell error: %s\n", aspell_speller_error_message(s));
 
@@ -2431,7 +3072,14 @@ on_spell_close_button_clicked          (GtkButton       *button,
   int ret = aspell_speller_save_all_word_lists(s);
   g_printerr("aspell_speller_save_all_word_lists() gave %i\n", ret);
 
-  if(spell_nodes) { xmlXPathFreeNodeSet(spell_nodes); spell_nodes=0; }
+  spell_release_nodes();
+
+  // the cached suggestions are kept for the next check
+  spell_prefetch_forget_pending();
+  if(spell_prefetch_pool)
+    spell_prefetch_push(g_new0(struct spell_prefetch_job, 1));
+  g_free(spell_dict);
+  spell_dict = NULL;
 
   delete_aspell_string_map(replace_all_map);
   if(checker) { delete_aspell_document_checker(checker); checker=0; }
@@ -2609,6 +3257,8 @@ static void on_gconf_client_notify(GConfClient *client, guint cnxn_id,
   g_debug("on_gconf_client_notify for key %s\n", entry->key);
   if(!strcmp(entry->key, "/apps/freedict-editor/pos_values"))
   {
+    // loaded on first use otherwise
+    if(!form_values_loaded) return;
     my_free_values_array(&pos_values);
     pos_values = load_values_from_gconf("pos_values", pos_values_default);
     return;
@@ -2648,7 +3298,8 @@ static void on_gconf_client_notify(GConfClient *client, guint cnxn_id,
     GtkCheckMenuItem *item = GTK_CHECK_MENU_ITEM(
 	glade_xml_get_widget(my_glade_xml, "view_html"));
     gtk_check_menu_item_set_active(item, show);
-    my_widget_set_visible(GTK_WIDGET(html_view), show);
+    // created after the first frame
+    if(html_view) my_widget_set_visible(GTK_WIDGET(html_view), show);
     return;
   }
   // the following code is for demonstration purposes only
@@ -2855,6 +3506,8 @@ on_sanity_treeview_row_activated       (GtkTreeView     *treeview,
   // Therefore, on entry delete/modify _remove rows with the invalid pointer_
   // using sanity_treeview_remove_entry_pointers()!
   set_edited_node(e);
+  prepare_adjacent_rows(GTK_TREE_MODEL(sanity_store), path,
+      ENTRY_POINTER_COLUMN);
 }
 
 
@@ -2896,21 +3549,30 @@ void sanity_perform_check(const struct sanity_check *check, gboolean enabled)
 
   int nr = 0;
   xmlNodeSetPtr matches = NULL;
+  enum xpath_budget_exceeded exceeded = XPATH_BUDGET_KEPT;
   if(enabled)
   {
     g_printerr("Checking for: %s\n       using: %s...", check->title, check->select);
 
     // run in a thread, so GUI can update
-    matches = find_node_set_threaded(check->select, teidoc);
+    matches = find_node_set_threaded(check->select, teidoc,
+	&xpath_budget_sanity, &exceeded);
     if(matches) nr = matches->nodeNr;
-    g_printerr(" %i matches.\n", nr);
+    if(exceeded != XPATH_BUDGET_KEPT)
+      g_printerr(" stopped: it %s.\n",
+	  xpath_budget_describe(exceeded, &xpath_budget_sanity));
+    else g_printerr(" %i matches.\n", nr);
   }
   else g_printerr("Skipping '%s'.\n", check->title);
 
   // print number of matches in TITLE_COLUMN
   char title_string[99];
-  g_snprintf(title_string, sizeof(title_string), _("%1$s (%2$i matches)"),
-      _(check->title), nr);
+  if(exceeded != XPATH_BUDGET_KEPT)
+    g_snprintf(title_string, sizeof(title_string), _("%1$s (stopped: %2$s)"),
+	_(check->title), xpath_budget_describe(exceeded, &xpath_budget_sanity));
+  else
+    g_snprintf(title_string, sizeof(title_string), _("%1$s (%2$i matches)"),
+	_(check->title), nr);
   GtkTreeIter child_i, root_i;
   gtk_tree_store_append(sanity_store, &root_i, NULL);
   gtk_tree_store_set(sanity_store, &root_i,
@@ -2928,7 +3590,7 @@ void sanity_perform_check(const struct sanity_check *check, gboolean enabled)
   for(j=0, n=matches->nodeTab; *n && j<matches->nodeNr && j<50; n++, j++)
   {
     char headwords[100];
-    entry_orths_to_string(*n, sizeof(headwords), headwords);
+    entry_orths_to_string_cached(*n, sizeof(headwords), headwords);
     gtk_tree_store_append(sanity_store, &child_i, &root_i);
     gtk_tree_store_set(sanity_store, &child_i,
 	IS_TITLE_ROW, FALSE,
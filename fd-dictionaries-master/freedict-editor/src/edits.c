@@ -0,0 +1,190 @@
+/** @file
+ * @brief Changing the document and telling everyone who depends on it
+ *
+ * All changes the editor makes to the document go through the functions
+ * here.  They make the change reader-safe using versions.c, and record a
+ * struct doc_edit for it.  Subscribers (statistics, the bookkeeping of the
+ * file on disk, the XPath cache, the sanity check results, ...) receive the
+ * records of a batch at once, in the order the changes were made, when the
+ * outermost doc_edit_end() is reached.  A change outside of a batch is a
+ * batch of its own and is delivered before the function returns.
+ *
+ * While a batch is open the document is pinned, so replaced and removed
+ * nodes stay allocated until the subscribers have seen them.  Subscribers
+ * may read such old nodes, but must not keep pointers to them.  Code inside
+ * a batch must not rely on anything a subscriber maintains, as it is not
+ * updated yet.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "edits.h"
+#include "save.h"
+#include "versions.h"
+
+struct doc_edit_subscriber
+{
+  doc_edit_func func;
+  gpointer user_data;
+};
+
+/// struct doc_edit_subscriber, called in the order they subscribed
+static GArray *subscribers;
+
+/// struct doc_edit of the open batch
+static GArray *pending;
+
+static int batch_depth;
+static guint batch_pin;
+
+/// Nodes passed to doc_edit_removed_unsafely(), freed after delivery
+static GSList *discarded;
+
+
+/// Have @a func called after every batch of changes
+void doc_edit_subscribe(doc_edit_func func, gpointer user_data)
+{
+  g_return_if_fail(func);
+  if(!subscribers)
+    subscribers = g_array_new(FALSE, FALSE, sizeof(struct doc_edit_subscriber));
+  struct doc_edit_subscriber s = { func, user_data };
+  g_array_append_val(subscribers, s);
+}
+
+
+/// Start a batch, which may be nested
+void doc_edit_begin(void)
+{
+  if(!batch_depth++) batch_pin = doc_reader_pin();
+}
+
+
+/// End a batch and deliver its changes, if it was the outermost one
+void doc_edit_end(void)
+{
+  g_return_if_fail(batch_depth > 0);
+  if(--batch_depth) return;
+
+  // changes made by a subscriber form a new batch
+  GArray *edits = pending;
+  pending = NULL;
+  GSList *freeing = discarded;
+  discarded = NULL;
+  guint pin = batch_pin;
+
+  guint i;
+  for(i = 0; edits && subscribers && i < subscribers->len; i++)
+  {
+    struct doc_edit_subscriber *s =
+      &g_array_index(subscribers, struct doc_edit_subscriber, i);
+    s->func((struct doc_edit *) edits->data, edits->len, s->user_data);
+  }
+  if(edits) g_array_free(edits, TRUE);
+
+  GSList *l;
+  for(l = freeing; l; l = l->next) xmlFreeNode(l->data);
+  g_slist_free(freeing);
+  doc_reader_unpin(pin);
+}
+
+
+static void doc_edit_record(enum doc_edit_type type, xmlNodePtr old,
+    xmlNodePtr cur, gboolean local)
+{
+  if(!pending) pending = g_array_new(FALSE, FALSE, sizeof(struct doc_edit));
+  struct doc_edit e = { type, old, cur, doc_version(), local };
+  g_array_append_val(pending, e);
+}
+
+
+/// Replace @a old with @a cur, see doc_replace_node()
+void doc_edit_replace(xmlNodePtr old, xmlNodePtr cur)
+{
+  g_return_if_fail(old && old->parent);
+  g_return_if_fail(cur);
+
+  doc_edit_begin();
+  save_snapshot_before_modify(old);
+  doc_replace_node(old, cur);
+  doc_edit_record(DOC_EDIT_REPLACED, old, cur, TRUE);
+  doc_edit_end();
+}
+
+
+/// Remove @a n from the document, see doc_remove_node()
+void doc_edit_remove(xmlNodePtr n)
+{
+  g_return_if_fail(n && n->parent);
+
+  doc_edit_begin();
+  save_snapshot_before_modify(n);
+  doc_remove_node(n);
+  doc_edit_record(DOC_EDIT_REMOVED, n, NULL, TRUE);
+  doc_edit_end();
+}
+
+
+/// Append @a n to the children of @a parent, see doc_add_child()
+void doc_edit_add_child(xmlNodePtr parent, xmlNodePtr n)
+{
+  g_return_if_fail(parent);
+  g_return_if_fail(n);
+
+  doc_edit_begin();
+  doc_add_child(parent, n);
+  doc_edit_record(DOC_EDIT_ADDED, NULL, n, TRUE);
+  doc_edit_end();
+}
+
+
+/// Give text node @a n new content
+/** The node is replaced by a new one, as the old one may be read by
+ * another thread.
+ * @return the new text node
+ */
+xmlNodePtr doc_edit_set_text(xmlNodePtr n, const xmlChar *content)
+{
+  g_return_val_if_fail(n && xmlNodeIsText(n), NULL);
+  xmlNodePtr cur = xmlNewDocText(n->doc, content);
+  doc_edit_replace(n, cur);
+  return cur;
+}
+
+
+/// Record that @a n was unlinked without the functions of versions.c
+/** This is only done while doc_readers_active() is FALSE, to bring the
+ * document in line with the file on disk, so the change is not local.
+ * @a n is freed after the subscribers have seen it, so this has to be
+ * called inside a batch.
+ */
+void doc_edit_removed_unsafely(xmlNodePtr n)
+{
+  g_return_if_fail(n);
+  g_return_if_fail(batch_depth > 0);
+  doc_edit_record(DOC_EDIT_REMOVED, n, NULL, FALSE);
+  discarded = g_slist_prepend(discarded, n);
+}
+
+
+/// Record that @a n was linked without the functions of versions.c
+/** The counterpart of doc_edit_removed_unsafely().
+ */
+void doc_edit_added_unsafely(xmlNodePtr n)
+{
+  g_return_if_fail(n);
+  g_return_if_fail(batch_depth > 0);
+  doc_edit_record(DOC_EDIT_ADDED, NULL, n, FALSE);
+}
+
+
+/// Record that children of @a parent that stayed were put in another order
+/** Like doc_edit_removed_unsafely(), for relinking the children.
+ */
+void doc_edit_reordered_unsafely(xmlNodePtr parent)
+{
+  g_return_if_fail(parent);
+  g_return_if_fail(batch_depth > 0);
+  doc_edit_record(DOC_EDIT_REORDERED, NULL, parent, FALSE);
+}
@@ -0,0 +1,40 @@
+#include <libxml/tree.h>
+#include <glib.h>
+
+/// Kind of a struct doc_edit
+enum doc_edit_type
+{
+  DOC_EDIT_ADDED,
+  DOC_EDIT_REMOVED,
+  DOC_EDIT_REPLACED,///< by a changed copy, which may be below an entry
+  DOC_EDIT_REORDERED///< the children of new_node are in another order
+};
+
+/// One change of the document, as seen by subscribers
+struct doc_edit
+{
+  enum doc_edit_type type;
+  xmlNodePtr old_node;///< NULL for DOC_EDIT_ADDED
+  xmlNodePtr new_node;///< NULL for DOC_EDIT_REMOVED
+  guint version;///< doc_version() right after the change
+  gboolean local;///< FALSE if it came from the file on disk
+};
+
+/// Called with the changes of a batch, in the order they were made
+typedef void (*doc_edit_func)(const struct doc_edit *edits, guint n,
+    gpointer user_data);
+
+// Subscribing to changes of the document
+void doc_edit_subscribe(doc_edit_func func, gpointer user_data);
+
+// Changing the document.  Calls between doc_edit_begin() and doc_edit_end()
+// are delivered as one batch.
+void doc_edit_begin(void);
+void doc_edit_end(void);
+void doc_edit_replace(xmlNodePtr old, xmlNodePtr cur);
+void doc_edit_remove(xmlNodePtr n);
+void doc_edit_add_child(xmlNodePtr parent, xmlNodePtr n);
+xmlNodePtr doc_edit_set_text(xmlNodePtr n, const xmlChar *content);
+void doc_edit_removed_unsafely(xmlNodePtr n);
+void doc_edit_added_unsafely(xmlNodePtr n);
+void doc_edit_reordered_unsafely(xmlNodePtr parent);
@@ -15,6 +15,8 @@ extern GladeXML *my_glade_xml;
 #include "utils.h"
 
 #include "xml.h"
+#include "versions.h"
+#include "edits.h"
 
 // This feature is useful only if the optionmenus can be left with tab key as
 // well. Otherwise is is hard to skip an optionmenu.
@@ -136,19 +138,26 @@ static void on_xr_combo_dropdown(GtkWidget *widget, gpointer user_data)
       "/TEI.2/text/body/entry/form/orth[contains(.,'%s')]", select);
   xmlNodeSetPtr nodes = find_node_set(expr, teidoc, NULL);
 
+  // the combo copies the strings, so they can be used in place
+  GSList *copies = NULL;
   if(nodes)
   {
     xmlNodePtr *n;
     int i;
     for(i=0, n = nodes->nodeTab; *n && i<nodes->nodeNr; n++, i++)
     {
-      xmlChar* content = xmlNodeGetContent(*n);
-      items = g_list_append(items, content ? content : (xmlChar*) _("(nothing)"));
+      xmlChar *copy;
+      const xmlChar* content = node_text(*n, &copy);
+      if(copy) copies = g_slist_prepend(copies, copy);
+      items = g_list_append(items, content ? (gchar *) content : _("(nothing)"));
     }
-    xmlXPathFreeNodeSet(nodes);
   }
 
   gtk_combo_set_popdown_strings(GTK_COMBO(x->combo), items);
+  g_list_free(items);
+  g_slist_foreach(copies, (GFunc) xmlFree, NULL);
+  g_slist_free(copies);
+  if(nodes) xmlXPathFreeNodeSet(nodes);
 }
 
 
@@ -361,6 +370,7 @@ on_tr_delete_button_clicked	   (GtkButton	    *button,
 Sense *senses_append(GArray *senses)
 {
   g_return_val_if_fail(senses, NULL);
+  form_values_load();
 
   Sense s;
   memset(&s, 0, sizeof(s));
@@ -903,26 +913,128 @@ static gboolean parsed_entry2widgets(struct Parsed_entry *pe)
   return can;
 }
 
+/// xmlNodes of a translation equivalent, see struct Parsed_form
+typedef struct
+{
+  xmlNodePtr xTr, xPos, xGen;
+} Parsed_trans;
+
+/// xmlNodes of a cross reference, see struct Parsed_form
+typedef struct
+{
+  xmlNodePtr xRef, xType;
+} Parsed_xr;
+
+/// xmlNodes of a sense, see struct Parsed_form
+typedef struct
+{
+  xmlNodePtr xUsg, xRegister, xDef, xNote, xEx, xExTr;
+  GArray *trans;///< of Parsed_trans
+  GArray *xr;///< of Parsed_xr
+} Parsed_sense;
+
+/// An entry taken apart for the Form view, without any widgets
+/** The nodes are unlinked from @a entry_doc, a private copy of the entry,
+ * so parsing needs no GTK+ and can be done in another thread.
+ */
+struct Parsed_form
+{
+  struct Parsed_entry pe;
+  GArray *senses;///< of Parsed_sense
+  gboolean can;///< whether the entry could be taken apart completely
+  gboolean simple;///< single trans without sense, see xml2form_parse()
+  xmlDocPtr entry_doc;
+};
+
+
+static void parsed_form_free(struct Parsed_form *pf)
+{
+  g_return_if_fail(pf);
+  my_free_node(&(pf->pe.orth));
+  my_free_node(&(pf->pe.pron));
+  my_free_node(&(pf->pe.pos));
+  my_free_node(&(pf->pe.num));
+  my_free_node(&(pf->pe.gen));
+  my_free_node(&(pf->pe.noteRespTranslator));
+
+  int i, j;
+  for(i=0; i < pf->senses->len; i++)
+  {
+    Parsed_sense *ps = &g_array_index(pf->senses, Parsed_sense, i);
+    my_free_node(&(ps->xUsg));
+    my_free_node(&(ps->xRegister));
+    my_free_node(&(ps->xDef));
+    my_free_node(&(ps->xNote));
+    my_free_node(&(ps->xEx));
+    my_free_node(&(ps->xExTr));
+    for(j=0; j < ps->trans->len; j++)
+    {
+      Parsed_trans *pt = &g_array_index(ps->trans, Parsed_trans, j);
+      my_free_node(&(pt->xTr));
+      my_free_node(&(pt->xPos));
+      my_free_node(&(pt->xGen));
+    }
+    for(j=0; j < ps->xr->len; j++)
+    {
+      Parsed_xr *px = &g_array_index(ps->xr, Parsed_xr, j);
+      my_free_node(&(px->xRef));
+      my_free_node(&(px->xType));
+    }
+    g_array_free(ps->trans, TRUE);
+    g_array_free(ps->xr, TRUE);
+  }
+  g_array_free(pf->senses, TRUE);
+
+  // the nodes above point to it
+  if(pf->entry_doc) xmlFreeDoc(pf->entry_doc);
+  g_free(pf);
+}
+
+
+static Parsed_sense *parsed_form_append_sense(struct Parsed_form *pf)
+{
+  Parsed_sense ps;
+  memset(&ps, 0, sizeof(ps));
+  ps.trans = g_array_new(FALSE, TRUE, sizeof(Parsed_trans));
+  ps.xr = g_array_new(FALSE, TRUE, sizeof(Parsed_xr));
+  g_array_append_val(pf->senses, ps);
+  return &g_array_index(pf->senses, Parsed_sense, pf->senses->len-1);
+}
+
+
+static Parsed_trans *parsed_sense_append_trans(Parsed_sense *ps)
+{
+  Parsed_trans pt;
+  memset(&pt, 0, sizeof(pt));
+  g_array_append_val(ps->trans, pt);
+  return &g_array_index(ps->trans, Parsed_trans, ps->trans->len-1);
+}
+
+
 /** Checks whether @a entry is editable in our form. This is possible
  * only when @a entry has only elements/attributes that we can handle with our
  * form. We check this condition by first removing every node from the entry
  * tree that we handle (first attributes, then elements). Then we check whether
  * nothing remains from the tree.
- * @retval TRUE parsing the entry tree was successful
- * @retval FALSE otherwise
+ *
+ * No GTK+ functions are called, so this may run in a worker thread, as long
+ * as @a entry is pinned.
+ *
+ * @return the parsed entry, with @a can set to FALSE if parsing failed
  */
-gboolean xml2form(const xmlNodePtr entry, GArray *senses)
+static struct Parsed_form *xml2form_parse(const xmlNodePtr entry)
 {
-  g_return_val_if_fail(entry && senses, FALSE);
-
-  gboolean can = TRUE;// whether parsing the entry was successful
-  xmlDocPtr entry_doc = copy_node_to_doc(entry);
+  struct Parsed_form *pf = g_new0(struct Parsed_form, 1);
+  pf->senses = g_array_new(FALSE, TRUE, sizeof(Parsed_sense));
+  pf->can = TRUE;// whether parsing the entry was successful
+  gboolean *can = &pf->can;
+  xmlDocPtr entry_doc = pf->entry_doc = copy_node_to_doc(entry);
 
   // abbreviate the coming source
   // in the spirit of C++'s design macros are avoided
   xmlNodePtr inline my_unlink(const char *xpath)
   {
-    return unlink_leaf_node_with_attr(xpath, NULL, NULL, entry_doc, &can);
+    return unlink_leaf_node_with_attr(xpath, NULL, NULL, entry_doc, can);
   }
 
   void inline my_unlink_free(const char *xpath)
@@ -931,71 +1043,67 @@ gboolean xml2form(const xmlNodePtr entry, GArray *senses)
     if(n) xmlFreeNode(n);
   }
 
-  struct Parsed_entry pe;
-  memset(&pe, 0, sizeof(pe));
+  struct Parsed_entry *pe = &pf->pe;
 
-  pe.orth = my_unlink("/entry/form/orth[1]");
-  pe.pron = my_unlink("/entry/form/pron[1]");
+  pe->orth = my_unlink("/entry/form/orth[1]");
+  pe->pron = my_unlink("/entry/form/pron[1]");
 
   // <form> should be empty now and without attribute nodes
   my_unlink_free("/entry/form");
 
   if(find_single_node("/entry/gramGrp[1]", entry_doc))
   {
-    pe.pos = my_unlink("/entry/gramGrp/pos");
-    pe.num = my_unlink("/entry/gramGrp/num");
-    pe.gen = my_unlink("/entry/gramGrp/gen");
+    pe->pos = my_unlink("/entry/gramGrp/pos");
+    pe->num = my_unlink("/entry/gramGrp/num");
+    pe->gen = my_unlink("/entry/gramGrp/gen");
     my_unlink_free("/entry/gramGrp");
   }
 
-  senses_clear(senses);
-
   // simple entry format: only 1 trans (with upto 2 trs) ->
   // transform into single sense and 2 trans
   if(find_single_node("/entry/trans[1]", entry_doc))
   {
     //g_printerr("Simple Entry...\n");
-    Sense *s = senses_append(senses);
-    Sense_trans *t = sense_append_trans(s);
+    pf->simple = TRUE;
+    Parsed_sense *s = parsed_form_append_sense(pf);
+    Parsed_trans *t = parsed_sense_append_trans(s);
     t->xTr  = my_unlink("/entry/trans[1]/tr[1]");
     t->xGen = my_unlink("/entry/trans[1]/gen[1]");
 
     // second tr
     if(find_single_node("/entry/trans[1]/tr[1]", entry_doc))
     {
-      t = sense_append_trans(s);
+      t = parsed_sense_append_trans(s);
       t->xTr = my_unlink("/entry/trans[1]/tr[1]");
     }
 
     my_unlink_free("/entry/trans[1]");
-    sense_dom2widgets(senses, 0);
   }
   else
   {
     // complex entry format: many senses, many trans subelements
     //g_printerr("Complex Entry...\n");
-    while(can && find_single_node("/entry/sense[1]", entry_doc))
+    while(*can && find_single_node("/entry/sense[1]", entry_doc))
     {
       // parse a sense
-      Sense *s = senses_append(senses);
+      Parsed_sense *s = parsed_form_append_sense(pf);
 
       // usage domain
       const char *allowedattrs[] = { "type", NULL };
       const char *allowedattr_dom[] = { "dom", NULL };
       s->xUsg = unlink_leaf_node_with_attr("/entry/sense[1]/usg[@type='dom']",
-	  allowedattrs, allowedattr_dom, entry_doc, &can);
+	  allowedattrs, allowedattr_dom, entry_doc, can);
 
       // usage register
       const char *allowedattr_reg[] = { "reg", NULL };
       s->xRegister = unlink_leaf_node_with_attr("/entry/sense[1]/usg[@type='reg']",
-	  allowedattrs, allowedattr_reg, entry_doc, &can);
+	  allowedattrs, allowedattr_reg, entry_doc, can);
 
       // for all trans
-      while(can && find_single_node("/entry/sense[1]/trans[1]", entry_doc))
+      while(*can && find_single_node("/entry/sense[1]/trans[1]", entry_doc))
       {
 	// parse a trans
-	Sense_trans *t = sense_append_trans(s);
-	g_assert(t);
+	Parsed_trans *t = parsed_sense_append_trans(s);
 	t->xTr	= my_unlink("/entry/sense[1]/trans[1]/tr[1]");
 	t->xGen = my_unlink("/entry/sense[1]/trans[1]/gen[1]");
 	t->xPos = my_unlink("/entry/sense[1]/trans[1]/pos[1]");
@@ -1015,31 +1123,28 @@ gboolean xml2form(const xmlNodePtr entry, GArray *senses)
       my_unlink_free("/entry/sense[1]/eg[1]");
 
       // xr
-      while(can && find_single_node("/entry/sense[1]/xr[1]", entry_doc))
+      while(*can && find_single_node("/entry/sense[1]/xr[1]", entry_doc))
       {
 	// parse a xr
-	Sense_xr *xr = sense_append_xr(s);
-	xr->xRef = my_unlink("/entry/sense[1]/xr[1]/ref[1]");
+	Parsed_xr xr;
+	xr.xRef = my_unlink("/entry/sense[1]/xr[1]/ref[1]");
 	// @type
-	xr->xType = my_unlink("/entry/sense[1]/xr[1]/@type");
+	xr.xType = my_unlink("/entry/sense[1]/xr[1]/@type");
+	g_array_append_val(s->xr, xr);
 	my_unlink_free("/entry/sense[1]/xr[1]");
       }
 
       my_unlink_free("/entry/sense[1]");
-      can = can && sense_dom2widgets(senses, senses->len-1);
     } // while sense
     //g_printerr("Finished parsing complex entry\n");
   } // complex entry
 
   const char *allow_resp_attr[] = { "resp", NULL };
-  pe.noteRespTranslator = unlink_leaf_node_with_attr("/entry/note[@resp='translator'][1]",
-      allow_resp_attr, NULL, entry_doc, &can);
+  pe->noteRespTranslator = unlink_leaf_node_with_attr("/entry/note[@resp='translator'][1]",
+      allow_resp_attr, NULL, entry_doc, can);
 
   my_unlink_free("/entry");
 
-  // fill main Widgets
-  can = can && parsed_entry2widgets(&pe);
-
   // doc was successfully parsed if root element was unlinked
   if(xmlDocGetRootElement(entry_doc))
   {
@@ -1049,16 +1154,220 @@ gboolean xml2form(const xmlNodePtr entry, GArray *senses)
     g_assert(ret2 != -1);
     g_printerr(_("Remaining content in entry: '%s'.\n"), xmlBufferContent(buf));
     xmlBufferFree(buf);
-    can = FALSE;
+    *can = FALSE;
+  }
+
+  return pf;
+}
+
+
+/// Create the sense widgets for @a pf and fill all widgets
+/** The nodes of @a pf are handed over to the widget structures, which free
+ * them after use.  @a pf is freed.
+ */
+static gboolean parsed_form2widgets(struct Parsed_form *pf, GArray *senses)
+{
+  gboolean can = pf->can;
+
+  senses_clear(senses);
+
+  int i, j;
+  for(i=0; i < pf->senses->len; i++)
+  {
+    Parsed_sense *ps = &g_array_index(pf->senses, Parsed_sense, i);
+    Sense *s = senses_append(senses);
+    s->xUsg = ps->xUsg; ps->xUsg = NULL;
+    s->xRegister = ps->xRegister; ps->xRegister = NULL;
+    s->xDef = ps->xDef; ps->xDef = NULL;
+    s->xNote = ps->xNote; ps->xNote = NULL;
+    s->xEx = ps->xEx; ps->xEx = NULL;
+    s->xExTr = ps->xExTr; ps->xExTr = NULL;
+    for(j=0; j < ps->trans->len; j++)
+    {
+      Parsed_trans *pt = &g_array_index(ps->trans, Parsed_trans, j);
+      Sense_trans *t = sense_append_trans(s);
+      g_assert(t);
+      t->xTr = pt->xTr; pt->xTr = NULL;
+      t->xPos = pt->xPos; pt->xPos = NULL;
+      t->xGen = pt->xGen; pt->xGen = NULL;
+    }
+    for(j=0; j < ps->xr->len; j++)
+    {
+      Parsed_xr *px = &g_array_index(ps->xr, Parsed_xr, j);
+      Sense_xr *xr = sense_append_xr(s);
+      xr->xRef = px->xRef; px->xRef = NULL;
+      xr->xType = px->xType; px->xType = NULL;
+    }
+
+    // in the simple entry format, unknown values do not matter here
+    if(pf->simple) sense_dom2widgets(senses, i);
+    else if(!(can = sense_dom2widgets(senses, i) && can)) break;
   }
 
-  // free all nodes
-  if(entry_doc) xmlFreeDoc(entry_doc);
+  // fill main Widgets
+  can = can && parsed_entry2widgets(&pf->pe);
 
+  parsed_form_free(pf);
   return can;
 }
 
 
+/// Entries parsed ahead of time, xmlNodePtr -> struct prepare_job
+/** An entry is removed when it or anything below it is changed, see
+ * form_prepare_doc_edited().
+ */
+static GHashTable *prepared_forms;
+
+/// Worker thread for form_prepare()
+static GThreadPool *prepare_pool;
+
+/// An entry for the prepare_pool
+struct prepare_job
+{
+  xmlNodePtr entry;
+  guint version;///< pinned until the job is done
+  struct Parsed_form *pf;
+  gboolean done;///< @a pf may be used
+};
+
+
+/// Value destroy function of prepared_forms
+/** A running job is freed by on_form_prepared(), when it finds that it was
+ * removed.
+ */
+static void prepare_job_drop(gpointer data)
+{
+  struct prepare_job *job = data;
+  if(!job->done) return;
+  if(job->pf) parsed_form_free(job->pf);
+  g_free(job);
+}
+
+
+static gboolean on_form_prepared(gpointer data)
+{
+  struct prepare_job *job = data;
+  doc_reader_unpin(job->version);
+  job->done = TRUE;
+
+  // forgotten or changed meanwhile
+  if(g_hash_table_lookup(prepared_forms, job->entry) != job)
+    prepare_job_drop(job);
+  return FALSE;
+}
+
+
+static void form_prepare_thread(gpointer data, gpointer user_data)
+{
+  struct prepare_job *job = data;
+  job->pf = xml2form_parse(job->entry);
+  g_idle_add(on_form_prepared, job);
+}
+
+
+/// Remove prepared entries that are not in @a keep
+static gboolean form_prepare_is_unwanted(gpointer key, gpointer value,
+    gpointer user_data)
+{
+  return !g_hash_table_lookup(user_data, key);
+}
+
+
+/// Parse entries in the background, so they can be shown quickly later
+/** Prepared entries not listed in @a entries are dropped.  Nodes that are
+ * not entries are skipped.
+ */
+void form_prepare(xmlNodePtr *entries, int n)
+{
+  if(!prepared_forms)
+  {
+    prepared_forms = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+	NULL, prepare_job_drop);
+    prepare_pool = g_thread_pool_new(form_prepare_thread, NULL, 1, FALSE, NULL);
+  }
+
+  GHashTable *keep = g_hash_table_new(g_direct_hash, g_direct_equal);
+  int i;
+  for(i=0; i < n; i++)
+    if(entries[i]) g_hash_table_insert(keep, entries[i], entries[i]);
+  g_hash_table_foreach_remove(prepared_forms, form_prepare_is_unwanted, keep);
+  g_hash_table_destroy(keep);
+
+  for(i=0; i < n; i++)
+  {
+    xmlNodePtr e = entries[i];
+    if(!e || e->type != XML_ELEMENT_NODE ||
+	xmlStrcmp(e->name, (xmlChar *) "entry")) continue;
+    if(e == edited_node) continue;
+    if(g_hash_table_lookup_extended(prepared_forms, e, NULL, NULL)) continue;
+
+    struct prepare_job *job = g_new0(struct prepare_job, 1);
+    job->entry = e;
+    job->version = doc_reader_pin();
+    g_hash_table_insert(prepared_forms, e, job);
+    g_thread_pool_push(prepare_pool, job, NULL);
+  }
+}
+
+
+/// Drop all prepared entries, eg. when another document is opened
+void form_prepare_forget(void)
+{
+  // running ones are discarded when they are done
+  if(prepared_forms) g_hash_table_remove_all(prepared_forms);
+}
+
+
+/// Drop the prepared forms of entries that were changed
+/** Subscribed with doc_edit_subscribe().  Edits elsewhere in the document
+ * leave the prepared entries alone.
+ */
+void form_prepare_doc_edited(const struct doc_edit *edits, guint n,
+    gpointer user_data)
+{
+  if(!prepared_forms || !g_hash_table_size(prepared_forms)) return;
+  guint i;
+  for(i = 0; i < n; i++)
+  {
+    // removed and replaced nodes still point to their old parent
+    xmlNodePtr p;
+    for(p = edits[i].old_node; p; p = p->parent)
+      g_hash_table_remove(prepared_forms, p);
+    for(p = edits[i].new_node; p; p = p->parent)
+      g_hash_table_remove(prepared_forms, p);
+  }
+}
+
+
+/// Take the prepared form of @a entry, if form_prepare() produced it
+static struct Parsed_form *form_prepare_take(const xmlNodePtr entry)
+{
+  if(!prepared_forms) return NULL;
+  struct prepare_job *job = g_hash_table_lookup(prepared_forms, entry);
+  if(!job || !job->done) return NULL;
+  struct Parsed_form *pf = job->pf;
+  job->pf = NULL;
+  g_hash_table_remove(prepared_forms, entry);
+  return pf;
+}
+
+
+/// Parse @a entry and fill the Form view with it
+/** If the entry was prepared by form_prepare(), only the widgets are filled.
+ * @retval TRUE parsing the entry tree was successful
+ * @retval FALSE otherwise
+ */
+gboolean xml2form(const xmlNodePtr entry, GArray *senses)
+{
+  g_return_val_if_fail(entry && senses, FALSE);
+  form_values_load();
+
+  struct Parsed_form *pf = form_prepare_take(entry);
+  if(!pf) pf = xml2form_parse(entry);
+  return parsed_form2widgets(pf, senses);
+}
+
+
 static xmlNodePtr GtkEntry2xmlNode(const xmlNodePtr parent, const gchar *before, const gchar *name,
     GtkEntry *e, const gchar *after)
 {
@@ -1083,6 +1392,7 @@ static xmlNodePtr GtkEntry2xmlNode(const xmlNodePtr parent, const gchar *before,
 xmlNodePtr form2xml(const GArray *senses)
 {
   g_return_val_if_fail(teidoc, NULL);
+  form_values_load();
 
   xmlNodePtr entryNode = xmlNewDocNode(teidoc, NULL, (xmlChar *) "entry", (xmlChar *) "\n");
   xmlNodePtr formNode = string2xmlNode(entryNode, "  ", "form", "\n", "\n");
@@ -65,4 +65,9 @@ void         senses_remove_last(GArray *senses);
 
 // used in callbacks.c
 gboolean     xml2form(const xmlNodePtr entry, GArray *senses);
+void         form_prepare(xmlNodePtr *entries, int n);
+void         form_prepare_forget(void);
+struct doc_edit;
+void         form_prepare_doc_edited(const struct doc_edit *edits, guint n,
+    gpointer user_data);
 xmlNodePtr   form2xml(const GArray *senses);
@@ -0,0 +1,752 @@
+/** @file
+ * @brief Exporting a TEI dictionary into several formats from one parse
+ *
+ * The TEI file is read once with a streaming parser into a compact entry
+ * store: arrays of fixed size entry and sense records whose texts live in a
+ * shared string chunk.  Repeated values like parts of speech and usage
+ * labels are stored only once.  The store is not changed afterwards, so all
+ * enabled output writers read it at the same time, each in a thread of its
+ * own:
+ *
+ * - dictd: PREFIX.dict and PREFIX.index, as dictfmt writes them (the .dict
+ *   file can be compressed with dictzip afterwards)
+ * - lookup: PREFIX.lookup, a binary table for binary search, see
+ *   export_lookup()
+ * - words: PREFIX.words, the sorted headwords, one per line
+ * - stats: PREFIX.stats, counts of entries, senses, translations and parts
+ *   of speech
+ *
+ * Usage: freedict-export [-j THREADS] [-f FORMAT,...] [-o PREFIX] dictionary.tei
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <libxml/xmlreader.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// An entry of the store
+struct export_entry
+{
+  const char *headword;///< all orths, separated by ", "
+  const char *pron, *pos;
+  guint first_orth, n_orths;///< in export_store.orths
+  guint first_sense, n_senses;///< in export_store.senses
+};
+
+/// A sense of an entry, or the entry itself when it has no sense elements
+struct export_sense
+{
+  const char *usg;///< all usage labels, separated by ", "
+  const char *def, *note, *example, *example_tr;
+  const char *xr;///< all cross references, separated by ", "
+  guint first_tr, n_trs;///< in export_store.trs
+};
+
+/// The compact entry store, read-only once export_read() has returned
+struct export_store
+{
+  GStringChunk *strings;
+  const char *title;
+  GArray *entries;///< struct export_entry
+  GArray *senses;///< struct export_sense
+  GPtrArray *orths;///< headwords, const char *
+  GArray *orth_entries;///< index of the entry of each orth, guint
+  GPtrArray *trs;///< translations, const char *
+  const char **keys;///< lookup key of each orth, see export_key()
+  guint *order;///< indices of the orths, sorted by key
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+// Reading the TEI file into the store
+/////////////////////////////////////////////////////////////////////////
+
+static gboolean is_element(const xmlNodePtr n, const char *name)
+{
+  return n->type == XML_ELEMENT_NODE && !xmlStrcmp(n->name, (xmlChar *) name);
+}
+
+
+/// The first child element of @a n called @a name
+static xmlNodePtr export_child(const xmlNodePtr n, const char *name)
+{
+  xmlNodePtr c;
+  if(!n) return NULL;
+  for(c = n->children; c; c = c->next)
+    if(is_element(c, name)) return c;
+  return NULL;
+}
+
+
+/// Copy @a s into the store with its whitespace collapsed, and free it
+/** @arg shared for values that repeat a lot, which are stored only once
+ * @return NULL for missing or empty strings
+ */
+static const char *export_intern(struct export_store *st, xmlChar *s,
+    gboolean shared)
+{
+  if(!s) return NULL;
+  // collapsing only shortens, so it is done in place
+  char *w = (char *) s, *r;
+  gboolean space = TRUE;
+  for(r = (char *) s; *r; r++)
+  {
+    if(g_ascii_isspace(*r)) { space = TRUE; continue; }
+    if(space && w != (char *) s) *w++ = ' ';
+    space = FALSE;
+    *w++ = *r;
+  }
+  *w = '\0';
+
+  const char *ret = NULL;
+  if(*s) ret = shared ? g_string_chunk_insert_const(st->strings, (char *) s) :
+    g_string_chunk_insert(st->strings, (char *) s);
+  xmlFree(s);
+  return ret;
+}
+
+
+/// Text content of the first child element of @a n called @a name
+static const char *export_child_text(struct export_store *st,
+    const xmlNodePtr n, const char *name, gboolean shared)
+{
+  xmlNodePtr c = export_child(n, name);
+  return c ? export_intern(st, xmlNodeGetContent(c), shared) : NULL;
+}
+
+
+/// Append the text of @a n to @a s, separated by ", "
+static void export_join(GString *s, const xmlNodePtr n)
+{
+  xmlChar *t = n ? xmlNodeGetContent(n) : NULL;
+  if(t && *t)
+  {
+    if(s->len) g_string_append(s, ", ");
+    g_string_append(s, (char *) t);
+  }
+  if(t) xmlFree(t);
+}
+
+
+/// The content of @a s as a string of the store, NULL if empty
+static const char *export_intern_joined(struct export_store *st, GString *s,
+    gboolean shared)
+{
+  const char *ret = s->len ?
+    export_intern(st, xmlStrdup((xmlChar *) s->str), shared) : NULL;
+  g_string_truncate(s, 0);
+  return ret;
+}
+
+
+/// Add a sense to the store
+/** @arg n a sense element, or the entry itself in the simple format where
+ *  trans elements are direct children of entry
+ */
+static void export_read_sense(struct export_store *st, const xmlNodePtr n,
+    GString *buf)
+{
+  struct export_sense s;
+  memset(&s, 0, sizeof(s));
+  xmlNodePtr eg = export_child(n, "eg");
+  s.def = export_child_text(st, n, "def", FALSE);
+  s.note = export_child_text(st, n, "note", FALSE);
+  s.example = export_child_text(st, eg, "q", FALSE);
+  s.example_tr = export_child_text(st, export_child(eg, "trans"), "tr", FALSE);
+  s.first_tr = st->trs->len;
+
+  xmlNodePtr c, t;
+  for(c = n->children; c; c = c->next)
+    if(is_element(c, "usg")) export_join(buf, c);
+  s.usg = export_intern_joined(st, buf, TRUE);
+  for(c = n->children; c; c = c->next)
+    if(is_element(c, "xr")) export_join(buf, export_child(c, "ref"));
+  s.xr = export_intern_joined(st, buf, FALSE);
+
+  for(c = n->children; c; c = c->next)
+  {
+    if(!is_element(c, "trans")) continue;
+    for(t = c->children; t; t = t->next)
+    {
+      if(!is_element(t, "tr")) continue;
+      const char *tr = export_intern(st, xmlNodeGetContent(t), FALSE);
+      if(tr) g_ptr_array_add(st->trs, (gpointer) tr);
+    }
+  }
+  s.n_trs = st->trs->len - s.first_tr;
+  g_array_append_val(st->senses, s);
+}
+
+
+/// Add the entry element @a n to the store
+static void export_read_entry(struct export_store *st, const xmlNodePtr n,
+    GString *buf)
+{
+  struct export_entry e;
+  memset(&e, 0, sizeof(e));
+  guint index = st->entries->len;
+  xmlNodePtr form = export_child(n, "form");
+  e.first_orth = st->orths->len;
+  xmlNodePtr c;
+  for(c = form ? form->children : NULL; c; c = c->next)
+  {
+    if(!is_element(c, "orth")) continue;
+    const char *orth = export_intern(st, xmlNodeGetContent(c), FALSE);
+    if(!orth) continue;
+    if(buf->len) g_string_append(buf, ", ");
+    g_string_append(buf, orth);
+    g_ptr_array_add(st->orths, (gpointer) orth);
+    g_array_append_val(st->orth_entries, index);
+  }
+  e.n_orths = st->orths->len - e.first_orth;
+  // an entry without headword cannot be looked up
+  if(!e.n_orths) return;
+  e.headword = e.n_orths == 1 ? g_ptr_array_index(st->orths, e.first_orth) :
+    export_intern_joined(st, buf, FALSE);
+  g_string_truncate(buf, 0);
+  e.pron = export_child_text(st, form, "pron", FALSE);
+  e.pos = export_child_text(st, export_child(n, "gramGrp"), "pos", TRUE);
+
+  e.first_sense = st->senses->len;
+  for(c = n->children; c; c = c->next)
+    if(is_element(c, "sense")) export_read_sense(st, c, buf);
+  if(st->senses->len == e.first_sense && export_child(n, "trans"))
+    export_read_sense(st, n, buf);
+  e.n_senses = st->senses->len - e.first_sense;
+  g_array_append_val(st->entries, e);
+}
+
+
+/// Lookup key of a headword: lower case, only letters, digits and spaces
+/** This is the order of "sort -df", which dictfmt uses for the index.
+ */
+static const char *export_key(struct export_store *st, const char *s)
+{
+  gchar *folded = g_utf8_casefold(s, -1);
+  gchar *w = folded, *r;
+  for(r = folded; *r; r = g_utf8_next_char(r))
+  {
+    gunichar c = g_utf8_get_char(r);
+    if(!g_unichar_isalnum(c) && c != ' ') continue;
+    w += g_unichar_to_utf8(c, w);
+  }
+  *w = '\0';
+  const char *key = g_string_chunk_insert(st->strings, folded);
+  g_free(folded);
+  return key;
+}
+
+
+static gint export_compare_orths(gconstpointer a, gconstpointer b,
+    gpointer data)
+{
+  const struct export_store *st = data;
+  guint i = *(const guint *) a, j = *(const guint *) b;
+  int ret = strcmp(st->keys[i], st->keys[j]);
+  if(!ret) ret = strcmp(g_ptr_array_index(st->orths, i),
+      g_ptr_array_index(st->orths, j));
+  return ret ? ret : (i < j ? -1 : i > j);
+}
+
+
+/// Fill @a st from the TEI file @a filename
+static gboolean export_read(struct export_store *st, const char *filename)
+{
+  xmlTextReaderPtr reader = xmlReaderForFile(filename, NULL,
+      XML_PARSE_NOENT | XML_PARSE_DTDLOAD | XML_PARSE_NONET);
+  if(!reader)
+  {
+    g_printerr("Could not open %s\n", filename);
+    return FALSE;
+  }
+
+  GString *buf = g_string_new(NULL);
+  int ret = xmlTextReaderRead(reader);
+  while(ret == 1)
+  {
+    const xmlChar *name = xmlTextReaderConstLocalName(reader);
+    if(xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT ||
+	(xmlStrcmp(name, (xmlChar *) "entry") &&
+	 xmlStrcmp(name, (xmlChar *) "teiHeader")))
+    {
+      ret = xmlTextReaderRead(reader);
+      continue;
+    }
+
+    xmlNodePtr n = xmlTextReaderExpand(reader);
+    if(!n) { ret = -1; break; }
+    if(is_element(n, "entry")) export_read_entry(st, n, buf);
+    else st->title = export_child_text(st, export_child(export_child(n,
+	    "fileDesc"), "titleStmt"), "title", FALSE);
+    // skip the subtree, so the reader can free it
+    ret = xmlTextReaderNext(reader);
+  }
+  xmlFreeTextReader(reader);
+  g_string_free(buf, TRUE);
+
+  if(ret < 0)
+  {
+    g_printerr("%s: parse error\n", filename);
+    return FALSE;
+  }
+
+  guint i, n = st->orths->len;
+  st->keys = g_new(const char *, n);
+  st->order = g_new(guint, n);
+  for(i = 0; i < n; i++)
+  {
+    st->keys[i] = export_key(st, g_ptr_array_index(st->orths, i));
+    st->order[i] = i;
+  }
+  g_qsort_with_data(st->order, n, sizeof(guint), export_compare_orths, st);
+  return TRUE;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+// Output writers
+/////////////////////////////////////////////////////////////////////////
+
+static const struct export_entry *export_entry_of_orth(
+    const struct export_store *st, guint orth)
+{
+  return &g_array_index(st->entries, struct export_entry,
+      g_array_index(st->orth_entries, guint, orth));
+}
+
+
+/// Append the plain text article of @a e to @a out
+static void export_render(const struct export_store *st,
+    const struct export_entry *e, GString *out)
+{
+  g_string_append(out, e->headword);
+  if(e->pron) g_string_append_printf(out, " /%s/", e->pron);
+  if(e->pos) g_string_append_printf(out, " <%s>", e->pos);
+  g_string_append_c(out, '\n');
+
+  guint i, t;
+  for(i = 0; i < e->n_senses; i++)
+  {
+    const struct export_sense *s = &g_array_index(st->senses,
+	struct export_sense, e->first_sense + i);
+    if(e->n_senses > 1) g_string_append_printf(out, "%2u. ", i + 1);
+    else g_string_append(out, "    ");
+    if(s->usg) g_string_append_printf(out, "(%s) ", s->usg);
+    for(t = 0; t < s->n_trs; t++)
+    {
+      if(t) g_string_append(out, ", ");
+      g_string_append(out, g_ptr_array_index(st->trs, s->first_tr + t));
+    }
+    g_string_append_c(out, '\n');
+    if(s->def) g_string_append_printf(out, "    %s\n", s->def);
+    if(s->note) g_string_append_printf(out, "    Note: %s\n", s->note);
+    if(s->example)
+      g_string_append_printf(out, "    \"%s\"%s%s\n", s->example,
+	  s->example_tr ? " - " : "", s->example_tr ? s->example_tr : "");
+    if(s->xr) g_string_append_printf(out, "    See also: %s\n", s->xr);
+  }
+}
+
+
+/// Open @a prefix + @a suffix for writing
+static FILE *export_open(const char *prefix, const char *suffix, gchar **name)
+{
+  *name = g_strconcat(prefix, suffix, NULL);
+  FILE *f = fopen(*name, "wb");
+  if(!f) g_printerr("Could not open %s for writing\n", *name);
+  return f;
+}
+
+
+/// Close @a f, reporting write errors
+static gboolean export_close(FILE *f, gchar *name)
+{
+  gboolean ok = !ferror(f);
+  if(fclose(f)) ok = FALSE;
+  if(!ok) g_printerr("Could not write %s\n", name);
+  g_free(name);
+  return ok;
+}
+
+
+/// Append @a v in the base64 number format of dictd index files
+static void export_dictd_number(GString *out, guint64 v)
+{
+  static const char digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char buf[12];
+  int i = sizeof(buf);
+  do
+  {
+    buf[--i] = digits[v & 63];
+    v >>= 6;
+  } while(v);
+  g_string_append_len(out, buf + i, sizeof(buf) - i);
+}
+
+
+static void export_dictd_line(GString *index, const char *key, guint64 offset,
+    guint64 length)
+{
+  g_string_append(index, key);
+  g_string_append_c(index, '\t');
+  export_dictd_number(index, offset);
+  g_string_append_c(index, '\t');
+  export_dictd_number(index, length);
+  g_string_append_c(index, '\n');
+}
+
+
+/// Writes PREFIX.dict and PREFIX.index for dictd
+static gboolean export_dictd(const struct export_store *st, const char *prefix)
+{
+  gchar *dictname, *indexname;
+  FILE *dict = export_open(prefix, ".dict", &dictname);
+  if(!dict) { g_free(dictname); return FALSE; }
+  FILE *index = export_open(prefix, ".index", &indexname);
+  if(!index) { g_free(indexname); export_close(dict, dictname); return FALSE; }
+
+  // the headers come first in the index, since digits sort before letters
+  GString *idx = g_string_new(NULL), *body = g_string_new(NULL);
+  guint64 offset = 0;
+  if(st->title)
+  {
+    g_string_printf(body, "00-database-short\n    %s\n", st->title);
+    export_dictd_line(idx, "00-database-short", offset, body->len);
+    fwrite(body->str, 1, body->len, dict);
+    offset += body->len;
+  }
+  g_string_assign(body, "00-database-utf8\n");
+  export_dictd_line(idx, "00-database-utf8", offset, body->len);
+  fwrite(body->str, 1, body->len, dict);
+  offset += body->len;
+
+  guint n = st->entries->len, i;
+  guint64 *offsets = g_new(guint64, n);
+  guint *lengths = g_new(guint, n);
+  for(i = 0; i < n; i++)
+  {
+    g_string_truncate(body, 0);
+    export_render(st, &g_array_index(st->entries, struct export_entry, i),
+	body);
+    fwrite(body->str, 1, body->len, dict);
+    offsets[i] = offset;
+    lengths[i] = body->len;
+    offset += body->len;
+  }
+
+  for(i = 0; i < st->orths->len; i++)
+  {
+    guint o = st->order[i];
+    guint e = g_array_index(st->orth_entries, guint, o);
+    export_dictd_line(idx, g_ptr_array_index(st->orths, o), offsets[e],
+	lengths[e]);
+  }
+  fwrite(idx->str, 1, idx->len, index);
+
+  g_free(offsets);
+  g_free(lengths);
+  g_string_free(body, TRUE);
+  g_string_free(idx, TRUE);
+  gboolean ok = export_close(dict, dictname);
+  return export_close(index, indexname) && ok;
+}
+
+
+/// Writes PREFIX.lookup, a table for binary search
+/** All numbers are 32 bit little endian.  The file consists of:
+ *
+ * - a header: the 8 bytes "FDLOOKUP", the version 1, the number N of
+ *   headwords and the size of the key area
+ * - N records of three numbers, sorted by key: offset of the key in the key
+ *   area, offset and length of the article in the article area
+ * - the key area: the keys of all headwords, see export_key(), each ending
+ *   with a NUL byte
+ * - the article area: the articles of all entries, as in the dictd format
+ *
+ * Headwords of the same entry point to the same article.
+ */
+static gboolean export_lookup(const struct export_store *st,
+    const char *prefix)
+{
+  guint n = st->orths->len, i;
+  GString *keys = g_string_new(NULL), *articles = g_string_new(NULL);
+  guint32 *records = g_new(guint32, 3 * n);
+  guint32 *offsets = g_new(guint32, st->entries->len);
+  guint32 *lengths = g_new(guint32, st->entries->len);
+
+  for(i = 0; i < st->entries->len; i++)
+  {
+    gsize start = articles->len;
+    export_render(st, &g_array_index(st->entries, struct export_entry, i),
+	articles);
+    offsets[i] = GUINT32_TO_LE(start);
+    lengths[i] = GUINT32_TO_LE(articles->len - start);
+  }
+  for(i = 0; i < n; i++)
+  {
+    guint o = st->order[i];
+    guint e = g_array_index(st->orth_entries, guint, o);
+    records[3 * i] = GUINT32_TO_LE(keys->len);
+    records[3 * i + 1] = offsets[e];
+    records[3 * i + 2] = lengths[e];
+    g_string_append_len(keys, st->keys[o], strlen(st->keys[o]) + 1);
+  }
+
+  gboolean ok = articles->len <= G_MAXUINT32 && keys->len <= G_MAXUINT32;
+  if(!ok) g_printerr("%s.lookup: dictionary too large\n", prefix);
+  gchar *name;
+  FILE *f = ok ? export_open(prefix, ".lookup", &name) : NULL;
+  if(f)
+  {
+    guint32 header[3] = { GUINT32_TO_LE(1), GUINT32_TO_LE(n),
+      GUINT32_TO_LE(keys->len) };
+    fwrite("FDLOOKUP", 1, 8, f);
+    fwrite(header, sizeof(guint32), 3, f);
+    fwrite(records, sizeof(guint32), 3 * n, f);
+    fwrite(keys->str, 1, keys->len, f);
+    fwrite(articles->str, 1, articles->len, f);
+    ok = export_close(f, name);
+  }
+  else if(ok)
+  {
+    g_free(name);
+    ok = FALSE;
+  }
+
+  g_free(records);
+  g_free(offsets);
+  g_free(lengths);
+  g_string_free(keys, TRUE);
+  g_string_free(articles, TRUE);
+  return ok;
+}
+
+
+/// Writes PREFIX.words, the sorted headwords without duplicates
+static gboolean export_words(const struct export_store *st, const char *prefix)
+{
+  gchar *name;
+  FILE *f = export_open(prefix, ".words", &name);
+  if(!f) { g_free(name); return FALSE; }
+  const char *last = NULL;
+  guint i;
+  for(i = 0; i < st->orths->len; i++)
+  {
+    const char *orth = g_ptr_array_index(st->orths, st->order[i]);
+    // equal headwords are adjacent, since they have equal keys
+    if(last && !strcmp(orth, last)) continue;
+    fprintf(f, "%s\n", orth);
+    last = orth;
+  }
+  return export_close(f, name);
+}
+
+
+/// Writes PREFIX.stats, with one "name<TAB>count" line each
+static gboolean export_stats(const struct export_store *st, const char *prefix)
+{
+  guint pron = 0, i;
+  GHashTable *pos = g_hash_table_new(g_str_hash, g_str_equal);
+  for(i = 0; i < st->entries->len; i++)
+  {
+    const struct export_entry *e =
+      &g_array_index(st->entries, struct export_entry, i);
+    if(e->pron) pron++;
+    if(!e->pos) continue;
+    guint count = GPOINTER_TO_UINT(g_hash_table_lookup(pos, e->pos));
+    g_hash_table_insert(pos, (gpointer) e->pos, GUINT_TO_POINTER(count + 1));
+  }
+  guint distinct = 0;
+  for(i = 0; i < st->orths->len; i++)
+    if(!i || strcmp(g_ptr_array_index(st->orths, st->order[i]),
+	  g_ptr_array_index(st->orths, st->order[i - 1]))) distinct++;
+
+  gchar *name;
+  FILE *f = export_open(prefix, ".stats", &name);
+  if(!f)
+  {
+    g_free(name);
+    g_hash_table_destroy(pos);
+    return FALSE;
+  }
+  fprintf(f, "entries\t%u\nheadwords\t%u\ndistinct headwords\t%u\n"
+      "senses\t%u\ntranslations\t%u\nwith pronunciation\t%u\n",
+      st->entries->len, st->orths->len, distinct, st->senses->len,
+      st->trs->len, pron);
+
+  GList *names = g_list_sort(g_hash_table_get_keys(pos),
+      (GCompareFunc) strcmp), *l;
+  for(l = names; l; l = l->next)
+    fprintf(f, "pos %s\t%u\n", (char *) l->data,
+	GPOINTER_TO_UINT(g_hash_table_lookup(pos, l->data)));
+  g_list_free(names);
+  g_hash_table_destroy(pos);
+  return export_close(f, name);
+}
+
+
+/// An output format
+struct export_writer
+{
+  const char *name;
+  gboolean (*write)(const struct export_store *st, const char *prefix);
+  gboolean enabled, ok;
+  gdouble seconds;
+};
+
+static struct export_writer export_writers[] = {
+  { "dictd", export_dictd },
+  { "lookup", export_lookup },
+  { "words", export_words },
+  { "stats", export_stats }
+};
+
+#define EXPORT_N_WRITERS G_N_ELEMENTS(export_writers)
+
+static const struct export_store *export_the_store;
+static const char *export_prefix;
+
+
+/// Thread pool function: run one writer on the shared store
+static void export_run_writer(gpointer data, gpointer user_data)
+{
+  struct export_writer *w = data;
+  GTimer *timer = g_timer_new();
+  w->ok = w->write(export_the_store, export_prefix);
+  w->seconds = g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+}
+
+
+/// Enable the writers named in the comma separated list @a formats
+static gboolean export_enable(const char *formats)
+{
+  gchar **names = g_strsplit(formats, ",", -1);
+  gboolean ok = TRUE;
+  int i;
+  guint w;
+  for(i = 0; names[i]; i++)
+  {
+    for(w = 0; w < EXPORT_N_WRITERS; w++)
+      if(!strcmp(names[i], export_writers[w].name)) break;
+    if(w < EXPORT_N_WRITERS) export_writers[w].enabled = TRUE;
+    else
+    {
+      g_printerr("Unknown format: %s\n", names[i]);
+      ok = FALSE;
+    }
+  }
+  g_strfreev(names);
+  return ok;
+}
+
+
+static void export_usage(const char *name)
+{
+  g_printerr("Usage: %s [-j THREADS] [-f FORMAT,...] [-o PREFIX] "
+      "dictionary.tei\n"
+      "Reads a TEI dictionary once and writes it in all FORMATs at the same\n"
+      "time.  FORMAT is one of dictd, lookup, words and stats (default: all).\n"
+      "The output files are named PREFIX.dict, PREFIX.index, PREFIX.lookup,\n"
+      "PREFIX.words and PREFIX.stats; PREFIX defaults to the name of the\n"
+      "TEI file without .tei.\n"
+      "  -j  number of formats written at the same time (default: all)\n",
+      name);
+}
+
+
+int main(int argc, char *argv[])
+{
+  int threads = 0;
+  const char *formats = NULL;
+  int i = 1;
+  for(; i + 1 < argc && argv[i][0] == '-'; i += 2)
+  {
+    if(!strcmp(argv[i], "-j")) threads = atoi(argv[i + 1]);
+    else if(!strcmp(argv[i], "-f")) formats = argv[i + 1];
+    else if(!strcmp(argv[i], "-o")) export_prefix = argv[i + 1];
+    else break;
+  }
+  if(argc - i != 1 || threads < 0)
+  {
+    export_usage(argv[0]);
+    return 2;
+  }
+  const char *filename = argv[i];
+
+  guint w;
+  if(!formats)
+    for(w = 0; w < EXPORT_N_WRITERS; w++) export_writers[w].enabled = TRUE;
+  else if(!export_enable(formats))
+  {
+    export_usage(argv[0]);
+    return 2;
+  }
+
+  gchar *prefix = NULL;
+  if(!export_prefix)
+  {
+    prefix = g_str_has_suffix(filename, ".tei") ?
+      g_strndup(filename, strlen(filename) - 4) : g_strdup(filename);
+    export_prefix = prefix;
+  }
+
+  LIBXML_TEST_VERSION
+  if(!g_thread_supported()) g_thread_init(NULL);
+
+  struct export_store st;
+  memset(&st, 0, sizeof(st));
+  st.strings = g_string_chunk_new(1 << 20);
+  st.entries = g_array_new(FALSE, FALSE, sizeof(struct export_entry));
+  st.senses = g_array_new(FALSE, FALSE, sizeof(struct export_sense));
+  st.orths = g_ptr_array_new();
+  st.orth_entries = g_array_new(FALSE, FALSE, sizeof(guint));
+  st.trs = g_ptr_array_new();
+
+  GTimer *timer = g_timer_new();
+  gboolean ok = export_read(&st, filename);
+  if(ok)
+    g_print("%s: %u entries read in %.2f s\n", filename, st.entries->len,
+	g_timer_elapsed(timer, NULL));
+  g_timer_destroy(timer);
+
+  if(ok)
+  {
+    export_the_store = &st;
+    int enabled = 0;
+    for(w = 0; w < EXPORT_N_WRITERS; w++) enabled += export_writers[w].enabled;
+    GThreadPool *pool = g_thread_pool_new(export_run_writer, NULL,
+	threads ? threads : enabled, FALSE, NULL);
+    for(w = 0; w < EXPORT_N_WRITERS; w++)
+      if(export_writers[w].enabled)
+	g_thread_pool_push(pool, &export_writers[w], NULL);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    for(w = 0; w < EXPORT_N_WRITERS; w++)
+    {
+      struct export_writer *wr = &export_writers[w];
+      if(!wr->enabled) continue;
+      if(wr->ok) g_print("%s: written in %.2f s\n", wr->name, wr->seconds);
+      else ok = FALSE;
+    }
+  }
+
+  g_free(st.keys);
+  g_free(st.order);
+  g_ptr_array_free(st.trs, TRUE);
+  g_array_free(st.orth_entries, TRUE);
+  g_ptr_array_free(st.orths, TRUE);
+  g_array_free(st.senses, TRUE);
+  g_array_free(st.entries, TRUE);
+  g_string_chunk_free(st.strings);
+  g_free(prefix);
+  xmlCleanupParser();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,684 @@
+/** @file
+ * @brief Parsing large TEI files with one parser per chunk of entries
+ *
+ * The body of a dictionary is a flat list of independent entries.  A fast
+ * scan over the raw file (memchr() from '<' to '<') finds the start and end
+ * tag of body and cuts its content into chunks at entry boundaries.  Each
+ * chunk is parsed by its own parser context in a thread pool.  It is wrapped
+ * as "<body>...</body>" behind the original prologue, so the parser sees the
+ * same DTD as for the whole file: attribute defaults, normalization of
+ * attribute values and entity declarations work the same.  The rest of the
+ * file is parsed as a skeleton with an empty body, and the children of the
+ * chunk bodies are grafted into it.
+ *
+ * Whenever the file does not look like we expect or a chunk is not well
+ * formed, we fall back to xmlParseFile(), so the user gets the usual error
+ * messages.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "load.h"
+#include "schemacache.h"
+
+#include <libxml/parser.h>
+#include <libxml/valid.h>
+#include <libxml/hash.h>
+
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Files smaller than this are parsed by xmlParseFile()
+#define LOAD_PARALLEL_MIN_SIZE (1024 * 1024)
+
+/// Minimum size of a chunk of body content in bytes
+#define LOAD_MIN_CHUNK_SIZE (256 * 1024)
+
+/// Result of load_prescan()
+struct load_prescan
+{
+  const char *buf;
+  gsize len;
+  gsize root_start;///< Offset of the start tag of the root element
+  guint prologue_lines;///< Number of newlines before @a root_start
+  gsize body_start;///< Offset just behind the start tag of body
+  gsize body_end;///< Offset of the end tag of body
+  GArray *cuts;///< Offsets (gsize) behind entries where chunks end
+  /// Chunks are parsed behind the start tags of their ancestors
+  gboolean keep_ancestors;
+};
+
+/// A range of body content and what became of it
+struct load_chunk
+{
+  const struct load_prescan *scan;
+  const char *filename;
+  int options;
+  gsize start, end;
+  guint newlines;///< Number of newlines in the chunk
+  guint line;///< Line of the file where the chunk starts
+  xmlDocPtr doc;
+  GPtrArray *ids;///< Attributes in @a doc that were registered as IDs
+  GPtrArray *refs;///< Attributes declared as IDREF or IDREFS
+  xmlNodePtr first, last;///< Grafted nodes, for validation
+  gboolean failed;
+};
+
+/// Kinds of markup, see load_skip_markup()
+enum { MARKUP_START, MARKUP_EMPTY, MARKUP_END, MARKUP_OTHER };
+
+
+static const char *load_find(const char *p, const char *end,
+    const char *needle)
+{
+  return g_strstr_len(p, end - p, needle);
+}
+
+
+/// Skip the markup that starts with '<' at @a p
+/** @arg type set to one of MARKUP_START, MARKUP_EMPTY, MARKUP_END or
+ * MARKUP_OTHER for comments, CDATA sections, PIs and declarations
+ * @return pointer behind the markup, NULL if it is not terminated
+ */
+static const char *load_skip_markup(const char *p, const char *end, int *type)
+{
+  *type = MARKUP_OTHER;
+  if(end - p >= 4 && !memcmp(p, "<!--", 4))
+  {
+    p = load_find(p + 4, end, "-->");
+    return p ? p + 3 : NULL;
+  }
+  if(end - p >= 9 && !memcmp(p, "<![CDATA[", 9))
+  {
+    p = load_find(p + 9, end, "]]>");
+    return p ? p + 3 : NULL;
+  }
+  if(end - p >= 2 && p[1] == '?')
+  {
+    p = load_find(p + 2, end, "?>");
+    return p ? p + 2 : NULL;
+  }
+  if(end - p >= 2 && p[1] == '!')
+  {
+    // document type declaration, possibly with an internal subset
+    const char *gt = memchr(p, '>', end - p);
+    const char *br = memchr(p, '[', end - p);
+    if(!br || (gt && gt < br)) return gt ? gt + 1 : NULL;
+    for(p = br; (p = memchr(p, ']', end - p)); )
+    {
+      for(p++; p < end && g_ascii_isspace(*p); p++);
+      if(p < end && *p == '>') return p + 1;
+    }
+    return NULL;
+  }
+
+  *type = p[1] == '/' ? MARKUP_END : MARKUP_START;
+  char quote = 0;
+  for(p++; p < end; p++)
+  {
+    if(quote) { if(*p == quote) quote = 0; }
+    else if(*p == '"' || *p == '\'') quote = *p;
+    else if(*p == '>')
+    {
+      if(*type == MARKUP_START && p[-1] == '/') *type = MARKUP_EMPTY;
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+
+/// Whether the tag at @a p has the name @a name
+static gboolean load_tag_is(const char *p, const char *end, const char *name)
+{
+  gsize l = strlen(name);
+  if(end - p < l + 2 || memcmp(p + 1, name, l)) return FALSE;
+  char c = p[l + 1];
+  return g_ascii_isspace(c) || c == '>' || c == '/';
+}
+
+
+/// Whether the XML declaration at the start of @a s declares UTF-8
+/** A missing declaration or encoding means UTF-8 as well.
+ */
+static gboolean load_encoding_is_utf8(const struct load_prescan *s)
+{
+  const char *p = s->buf, *end = s->buf + s->len;
+  if(s->len >= 3 && !memcmp(p, "\xEF\xBB\xBF", 3)) p += 3;
+  if(end - p < 5 || memcmp(p, "<?xml", 5)) return TRUE;
+
+  const char *declend = load_find(p, end, "?>");
+  if(!declend) return FALSE;
+  const char *e = load_find(p, declend, "encoding");
+  if(!e) return TRUE;
+  for(e += 8; e < declend && (g_ascii_isspace(*e) || *e == '='); e++);
+  if(e >= declend || (*e != '"' && *e != '\'')) return FALSE;
+  e++;
+  return !g_ascii_strncasecmp(e, "UTF-8", 5) && (e[5] == '"' || e[5] == '\'');
+}
+
+
+/// Find root, body and the chunk boundaries
+/** @arg chunk_size chunks end behind the first entry after this many bytes
+ * @retval FALSE the file has to be parsed as a whole
+ */
+static gboolean load_prescan(struct load_prescan *s, gsize chunk_size)
+{
+  if(!load_encoding_is_utf8(s)) return FALSE;
+
+  const char *p = s->buf, *end = s->buf + s->len, *tag;
+  gboolean seen_root = FALSE;
+  int type;
+  while((p = memchr(p, '<', end - p)))
+  {
+    tag = p;
+    if(!(p = load_skip_markup(p, end, &type))) return FALSE;
+    if(type == MARKUP_OTHER) continue;
+    if(!seen_root)
+    {
+      s->root_start = tag - s->buf;
+      seen_root = TRUE;
+    }
+    if(load_tag_is(tag, end, "body"))
+    {
+      if(type != MARKUP_START) return FALSE;
+      s->body_start = p - s->buf;
+      break;
+    }
+  }
+  if(!p) return FALSE;
+
+  // namespace declarations in scope of body would be lost in the chunks
+  if(!s->keep_ancestors && load_find(s->buf, p, "xmlns")) return FALSE;
+
+  const char *q;
+  for(q = s->buf; (q = memchr(q, '\n', s->buf + s->root_start - q)); q++)
+    s->prologue_lines++;
+
+  int depth = 0;
+  gsize chunk_start = s->body_start;
+  while((p = memchr(p, '<', end - p)))
+  {
+    tag = p;
+    if(!(p = load_skip_markup(p, end, &type))) return FALSE;
+    switch(type)
+    {
+      case MARKUP_START:
+	depth++;
+	continue;
+      case MARKUP_END:
+	if(!depth)
+	{
+	  // </body>
+	  s->body_end = tag - s->buf;
+	  return TRUE;
+	}
+	depth--;
+	break;
+      case MARKUP_EMPTY:
+	break;
+      default:
+	continue;
+    }
+
+    if(!depth && p - s->buf - chunk_start >= chunk_size)
+    {
+      chunk_start = p - s->buf;
+      g_array_append_val(s->cuts, chunk_start);
+    }
+  }
+  return FALSE;
+}
+
+
+/// Whether all entity references between @a p and @a end are predefined
+static gboolean load_only_predefined_entities(const char *p, const char *end)
+{
+  const char *names[] = { "amp;", "lt;", "gt;", "quot;", "apos;", "#", NULL };
+  for(; (p = memchr(p, '&', end - p)); p++)
+  {
+    const char **n;
+    for(n = names; *n; n++)
+      if(end - p > strlen(*n) && !memcmp(p + 1, *n, strlen(*n))) break;
+    if(!*n) return FALSE;
+  }
+  return TRUE;
+}
+
+
+/// GFunc for the first thread pool: checks the chunk and counts its lines
+static void load_scan_chunk(gpointer data, gpointer user_data)
+{
+  struct load_chunk *c = data;
+  const char *p = c->scan->buf + c->start, *end = c->scan->buf + c->end;
+
+  if(!g_utf8_validate(p, end - p, NULL) ||
+      (!(c->options & XML_PARSE_NOENT) &&
+       !load_only_predefined_entities(p, end)))
+  {
+    c->failed = TRUE;
+    return;
+  }
+
+  for(; (p = memchr(p, '\n', end - p)); p++) c->newlines++;
+}
+
+
+/// Make line numbers relative to the file and collect IDs and IDREFs
+static void load_walk_chunk(struct load_chunk *c, xmlNodePtr n, guint offset)
+{
+  for(; n; n = n->next)
+  {
+    // xmlParseFile() stores at most 65535
+    if(n->line && n->line < 65535) n->line = MIN(n->line + offset, 65535);
+    if(n->type != XML_ELEMENT_NODE) continue;
+
+    xmlAttrPtr a;
+    for(a = n->properties; a; a = a->next)
+      if(a->atype == XML_ATTRIBUTE_ID) g_ptr_array_add(c->ids, a);
+      else if(xmlIsRef(c->doc, n, a)) g_ptr_array_add(c->refs, a);
+    load_walk_chunk(c, n->children, offset);
+  }
+}
+
+
+/// Parse @a buf, returns NULL unless it is well formed
+static xmlDocPtr load_parse_memory(const char *buf, gsize len,
+    const char *filename, int options)
+{
+  xmlParserCtxtPtr ctxt = xmlNewParserCtxt();
+  if(!ctxt) return NULL;
+  schema_cache_use(ctxt);
+  xmlDocPtr doc = xmlCtxtReadMemory(ctxt, buf, len, filename, NULL, options);
+  if(doc && !ctxt->wellFormed)
+  {
+    xmlFreeDoc(doc);
+    doc = NULL;
+  }
+  xmlFreeParserCtxt(ctxt);
+  return doc;
+}
+
+
+/// Parse part of the content of body in the context of the original DTD
+/** @arg prologue everything in front of the root element of the file
+ * @arg content complete elements and the text between them
+ * @return a document whose root element is a body element that contains the
+ * parsed @a content, or NULL if it is not well formed
+ */
+xmlDocPtr load_parse_body_content(const char *prologue, gsize prologue_len,
+    const char *content, gsize len, const char *filename, int options)
+{
+  GString *buf = g_string_sized_new(prologue_len + len + 16);
+  g_string_append_len(buf, prologue, prologue_len);
+  g_string_append(buf, "<body>");
+  g_string_append_len(buf, content, len);
+  g_string_append(buf, "</body>");
+  xmlDocPtr doc = load_parse_memory(buf->str, buf->len, filename, options);
+  g_string_free(buf, TRUE);
+  return doc;
+}
+
+
+/// Parser options equivalent to the current defaults of xmlParseFile()
+/** Errors are suppressed, the caller falls back to xmlParseFile() to report
+ * them.  No dictionary is used, so nodes can move between documents.
+ */
+int load_parser_options(void)
+{
+  int options = XML_PARSE_NODICT | XML_PARSE_DTDLOAD |
+    XML_PARSE_NOERROR | XML_PARSE_NOWARNING;
+  if(xmlSubstituteEntitiesDefaultValue) options |= XML_PARSE_NOENT;
+  if(!xmlKeepBlanksDefaultValue) options |= XML_PARSE_NOBLANKS;
+  if(xmlLoadExtDtdDefaultValue & XML_COMPLETE_ATTRS)
+    options |= XML_PARSE_DTDATTR;
+  return options;
+}
+
+
+/// Split @a buf into the prologue, the content of body and the rest
+/** @arg root_start set to the offset of the root element
+ * @arg body_start set to the offset behind the start tag of body
+ * @arg body_end set to the offset of the end tag of body
+ * @arg cuts offsets (gsize) behind every element in body are appended
+ * @arg keep_ancestors TRUE if the caller puts each chunk between everything
+ * in front of @a body_start and everything from @a body_end on, so namespace
+ * declarations on the ancestors of body are allowed
+ * @retval FALSE @a buf can only be parsed as a whole
+ */
+gboolean load_split_entries(const char *buf, gsize len, gsize *root_start,
+    gsize *body_start, gsize *body_end, GArray *cuts, gboolean keep_ancestors)
+{
+  struct load_prescan scan;
+  memset(&scan, 0, sizeof(scan));
+  scan.buf = buf;
+  scan.len = len;
+  scan.cuts = cuts;
+  scan.keep_ancestors = keep_ancestors;
+  if(!load_prescan(&scan, 0)) return FALSE;
+  *root_start = scan.root_start;
+  *body_start = scan.body_start;
+  *body_end = scan.body_end;
+  return TRUE;
+}
+
+
+/// GFunc for the second thread pool: parses the chunk into its own doc
+static void load_parse_chunk(gpointer data, gpointer user_data)
+{
+  struct load_chunk *c = data;
+  const struct load_prescan *s = c->scan;
+  if(c->failed) return;
+
+  c->doc = load_parse_body_content(s->buf, s->root_start, s->buf + c->start,
+      c->end - c->start, c->filename, c->options);
+  xmlNodePtr root = c->doc ? xmlDocGetRootElement(c->doc) : NULL;
+  if(!root)
+  {
+    c->failed = TRUE;
+    return;
+  }
+
+  // the chunk content starts on line prologue_lines + 1 of the wrapper
+  load_walk_chunk(c, root->children, c->line - (s->prologue_lines + 1));
+}
+
+
+/// Validate @a n and its descendants, except their ID and IDREF attributes
+/** Unlike xmlValidateElement() this does not change @a doc, so several
+ * threads may do it at once.  Validating an ID or IDREF attribute adds it
+ * to the tables of @a doc, that is left to load_validate_ids().
+ * @arg stop element whose descendants are skipped, or NULL
+ */
+static void load_validate_tree(xmlValidCtxtPtr vctxt, xmlDocPtr doc,
+    xmlNodePtr n, xmlNodePtr stop)
+{
+  if(n->type != XML_ELEMENT_NODE) return;
+  xmlValidateOneElement(vctxt, doc, n);
+
+  xmlAttrPtr a;
+  for(a = n->properties; a; a = a->next)
+  {
+    if(xmlIsID(doc, n, a) || xmlIsRef(doc, n, a)) continue;
+    xmlChar *value = xmlNodeListGetString(doc, a->children, 0);
+    xmlValidateOneAttribute(vctxt, doc, n, a, value);
+    if(value) xmlFree(value);
+  }
+
+  xmlNsPtr ns;
+  for(ns = n->nsDef; ns; ns = ns->next)
+    xmlValidateOneNamespace(vctxt, doc, n, ns->prefix, ns, ns->href);
+
+  if(n == stop) return;
+  xmlNodePtr child;
+  for(child = n->children; child; child = child->next)
+    load_validate_tree(vctxt, doc, child, stop);
+}
+
+
+/// GFunc for the third thread pool: validates the grafted nodes
+static void load_validate_chunk(gpointer data, gpointer user_data)
+{
+  struct load_chunk *c = data;
+  xmlDocPtr doc = user_data;
+  if(!c->first) return;
+
+  xmlValidCtxtPtr vctxt = xmlNewValidCtxt();
+  xmlNodePtr n;
+  for(n = c->first; n; n = n->next)
+  {
+    load_validate_tree(vctxt, doc, n, NULL);
+    if(n == c->last) break;
+  }
+  xmlFreeValidCtxt(vctxt);
+}
+
+
+/// Validate the ID and IDREF attributes in @a attrs, adding them to @a doc
+static void load_validate_ids(xmlValidCtxtPtr vctxt, xmlDocPtr doc,
+    GPtrArray *attrs)
+{
+  guint i;
+  for(i = 0; i < attrs->len; i++)
+  {
+    xmlAttrPtr a = g_ptr_array_index(attrs, i);
+    xmlChar *value = xmlNodeListGetString(doc, a->children, 0);
+    xmlValidateOneAttribute(vctxt, doc, a->parent, a, value);
+    if(value) xmlFree(value);
+  }
+}
+
+
+/// Register the IDs of the chunks with @a doc, like the parser did
+static void load_register_ids(xmlDocPtr doc, struct load_chunk *chunks,
+    guint nchunks)
+{
+  guint i;
+  for(i = 0; i < nchunks; i++)
+  {
+    int j;
+    for(j = 0; j < chunks[i].ids->len; j++)
+    {
+      xmlAttrPtr a = g_ptr_array_index(chunks[i].ids, j);
+      xmlChar *id = xmlNodeListGetString(doc, a->children, 1);
+      xmlAttrPtr other = id ? xmlGetID(doc, id) : NULL;
+      if(!other) xmlAddID(NULL, doc, id, a);
+      else if(other != a) g_printerr("ID %s already defined\n", id);
+      xmlFree(id);
+    }
+    for(j = 0; j < chunks[i].refs->len; j++)
+    {
+      xmlAttrPtr a = g_ptr_array_index(chunks[i].refs, j);
+      xmlChar *ref = xmlNodeListGetString(doc, a->children, 1);
+      if(ref) xmlAddRef(NULL, doc, ref, a);
+      xmlFree(ref);
+    }
+  }
+}
+
+
+static void load_build_content_model(void *payload, void *data,
+    const xmlChar *name)
+{
+  xmlElementPtr e = payload;
+  if(e->etype == XML_ELEMENT_TYPE_ELEMENT && !e->contModel)
+    xmlValidBuildContentModel(data, e);
+}
+
+
+/// The same validation as the validating xmlParseFile() does
+/** Entries are validated in parallel.  The regular expressions of the
+ * content models are compiled lazily by libxml2, so we build all of them
+ * before starting the threads.  The threads only read @a doc: the IDs and
+ * IDREFs of the chunks are validated and registered here afterwards, in
+ * document order, so duplicate IDs are reported like by the parser.  The
+ * skeleton's IDs and IDREFs were registered when it was parsed.
+ */
+static void load_validate(xmlDocPtr doc, xmlNodePtr body,
+    struct load_chunk *chunks, guint nchunks, long ncpus)
+{
+  xmlValidCtxtPtr vctxt = xmlNewValidCtxt();
+  if(doc->intSubset && doc->intSubset->elements)
+    xmlHashScan(doc->intSubset->elements,
+	(xmlHashScanner) load_build_content_model, vctxt);
+  if(doc->extSubset && doc->extSubset->elements)
+    xmlHashScan(doc->extSubset->elements,
+	(xmlHashScanner) load_build_content_model, vctxt);
+
+  GThreadPool *pool = g_thread_pool_new(load_validate_chunk, doc, ncpus,
+      FALSE, NULL);
+  guint i;
+  for(i = 0; i < nchunks; i++)
+    if(pool) g_thread_pool_push(pool, &chunks[i], NULL);
+    else load_validate_chunk(&chunks[i], doc);
+
+  xmlValidateRoot(vctxt, doc);
+  xmlNodePtr n;
+  for(n = doc->children; n; n = n->next)
+    load_validate_tree(vctxt, doc, n, body);
+  if(pool) g_thread_pool_free(pool, FALSE, TRUE);
+
+  for(i = 0; i < nchunks; i++)
+  {
+    load_validate_ids(vctxt, doc, chunks[i].ids);
+    load_validate_ids(vctxt, doc, chunks[i].refs);
+  }
+
+  // IDREFs can point into any chunk
+  xmlValidateDocumentFinal(vctxt, doc);
+  xmlFreeValidCtxt(vctxt);
+}
+
+
+/// First element called "body" in document order
+static xmlNodePtr load_find_body(xmlNodePtr n)
+{
+  for(; n; n = n->next)
+  {
+    if(n->type != XML_ELEMENT_NODE) continue;
+    if(!strcmp((char *) n->name, "body")) return n;
+    xmlNodePtr b = load_find_body(n->children);
+    if(b) return b;
+  }
+  return NULL;
+}
+
+
+/// Loads @a filename like xmlParseFile(), but with one thread per CPU
+/** Honours the parser defaults set with xmlSubstituteEntitiesDefault(),
+ * xmlKeepBlanksDefault() and xmlDoValidityCheckingDefaultValue.
+ */
+xmlDocPtr load_file_parallel(const char *filename)
+{
+  g_return_val_if_fail(filename, NULL);
+
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct stat st;
+  if(ncpus < 2 || stat(filename, &st) || st.st_size < LOAD_PARALLEL_MIN_SIZE)
+    return schema_cache_parse_file(filename);
+
+  gchar *contents;
+  struct load_prescan scan;
+  memset(&scan, 0, sizeof(scan));
+  if(!g_file_get_contents(filename, &contents, &scan.len, NULL))
+    return schema_cache_parse_file(filename);
+  scan.buf = contents;
+  scan.cuts = g_array_new(FALSE, FALSE, sizeof(gsize));
+
+  xmlDocPtr doc = NULL;
+  struct load_chunk *chunks = NULL;
+  guint nchunks = 0, i;
+
+  // a few chunks per thread, so a slow chunk does not stall the others
+  gsize chunk_size = MAX(LOAD_MIN_CHUNK_SIZE, scan.len / (4 * ncpus));
+  if(!load_prescan(&scan, chunk_size)) goto fallback;
+
+  int options = load_parser_options();
+
+  nchunks = scan.cuts->len + 1;
+  chunks = g_new0(struct load_chunk, nchunks);
+  for(i = 0; i < nchunks; i++)
+  {
+    chunks[i].scan = &scan;
+    chunks[i].filename = filename;
+    chunks[i].options = options;
+    chunks[i].start = i ? g_array_index(scan.cuts, gsize, i - 1)
+      : scan.body_start;
+    chunks[i].end = i < scan.cuts->len ? g_array_index(scan.cuts, gsize, i)
+      : scan.body_end;
+    chunks[i].ids = g_ptr_array_new();
+    chunks[i].refs = g_ptr_array_new();
+  }
+
+  GThreadPool *pool = g_thread_pool_new(load_scan_chunk, NULL, ncpus,
+      FALSE, NULL);
+  if(!pool) goto fallback;
+  for(i = 0; i < nchunks; i++) g_thread_pool_push(pool, &chunks[i], NULL);
+  g_thread_pool_free(pool, FALSE, TRUE);
+
+  // line numbers of the chunks, counted from the start of the file
+  guint line = 1;
+  const char *p;
+  for(p = scan.buf; (p = memchr(p, '\n', scan.buf + chunks[0].start - p)); p++)
+    line++;
+  for(i = 0; i < nchunks; i++)
+  {
+    if(chunks[i].failed) goto fallback;
+    chunks[i].line = line;
+    line += chunks[i].newlines;
+  }
+
+  pool = g_thread_pool_new(load_parse_chunk, NULL, ncpus, FALSE, NULL);
+  if(!pool) goto fallback;
+  for(i = 0; i < nchunks; i++) g_thread_pool_push(pool, &chunks[i], NULL);
+
+  // meanwhile parse everything but the body content
+  GString *skeleton = g_string_sized_new(scan.body_start +
+      scan.len - scan.body_end);
+  g_string_append_len(skeleton, scan.buf, scan.body_start);
+  g_string_append_len(skeleton, scan.buf + scan.body_end,
+      scan.len - scan.body_end);
+  doc = load_parse_memory(skeleton->str, skeleton->len, filename, options);
+  g_string_free(skeleton, TRUE);
+
+  g_thread_pool_free(pool, FALSE, TRUE);
+
+  xmlNodePtr body = doc ? load_find_body(doc->children) : NULL;
+  if(!body || body->children) goto fallback;
+  for(i = 0; i < nchunks; i++)
+    if(chunks[i].failed) goto fallback;
+
+  // graft the children of the chunk bodies; adopting them points xml:lang
+  // and the like to the namespace of doc instead of the freed chunk doc
+  for(i = 0; i < nchunks; i++)
+  {
+    struct load_chunk *c = &chunks[i];
+    xmlNodePtr root = xmlDocGetRootElement(c->doc);
+    xmlNodePtr n;
+    while((n = root->children))
+    {
+      xmlUnlinkNode(n);
+      xmlDOMWrapAdoptNode(NULL, c->doc, n, doc, body, 0);
+      if(!c->first) c->first = n;
+      c->last = n;
+      n->parent = body;
+      n->prev = body->last;
+      if(body->last) body->last->next = n;
+      else body->children = n;
+      body->last = n;
+    }
+    xmlFreeDoc(c->doc);
+    c->doc = NULL;
+  }
+
+  if(xmlDoValidityCheckingDefaultValue)
+    load_validate(doc, body, chunks, nchunks, ncpus);
+  else load_register_ids(doc, chunks, nchunks);
+
+  for(i = 0; i < nchunks; i++)
+  {
+    g_ptr_array_free(chunks[i].ids, TRUE);
+    g_ptr_array_free(chunks[i].refs, TRUE);
+  }
+  g_free(chunks);
+  g_array_free(scan.cuts, TRUE);
+  g_free(contents);
+  g_debug("Parsed %s in %u chunks", filename, nchunks);
+  return doc;
+
+fallback:
+  for(i = 0; i < nchunks; i++)
+  {
+    if(chunks[i].doc) xmlFreeDoc(chunks[i].doc);
+    g_ptr_array_free(chunks[i].ids, TRUE);
+    g_ptr_array_free(chunks[i].refs, TRUE);
+  }
+  g_free(chunks);
+  if(doc) xmlFreeDoc(doc);
+  g_array_free(scan.cuts, TRUE);
+  g_free(contents);
+  return schema_cache_parse_file(filename);
+}
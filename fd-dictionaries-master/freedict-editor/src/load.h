@@ -0,0 +1,10 @@
+#include <libxml/tree.h>
+#include <glib.h>
+
+// Loading large TEI files with one parser per chunk of entries
+xmlDocPtr load_file_parallel(const char *filename);
+gboolean load_split_entries(const char *buf, gsize len, gsize *root_start,
+    gsize *body_start, gsize *body_end, GArray *cuts, gboolean keep_ancestors);
+int load_parser_options(void);
+xmlDocPtr load_parse_body_content(const char *prologue, gsize prologue_len,
+    const char *content, gsize len, const char *filename, int options);
@@ -10,6 +10,7 @@
 #include <glade/glade.h>
 
 #include "callbacks.h"
+#include "utils.h"
 
 const char *glade_filename;
 GladeXML *my_glade_xml;
@@ -18,6 +19,8 @@ GtkWidget* app1;
 int
 main (int argc, char *argv[])
 {
+  startup_mark("main()");
+
   // g_thread_supported() should be renamed to g_thread_initialized()
   if(!g_thread_supported()) g_thread_init(NULL);
 
@@ -59,10 +62,12 @@ main (int argc, char *argv[])
     }
 
   glade_xml_signal_autoconnect(my_glade_xml);
+  startup_mark("interface loaded");
     
   app1 = glade_xml_get_widget(my_glade_xml, "app1");
   gtk_widget_show_all(app1);
   on_app1_show(NULL, NULL);// XXX this event handler is not called by show_all?
+  startup_mark("window set up");
 
   extern void myload(const char *filename);
   if(selected_filename) myload(selected_filename);
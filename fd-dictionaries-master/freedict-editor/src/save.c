@@ -0,0 +1,603 @@
+/** @file
+ * @brief Saving a document from a point-in-time snapshot in a worker thread
+ *
+ * A snapshot is a flat list of pieces that together make up the serialized
+ * document: the XML declaration and the start and end tags of the elements
+ * leading to /TEI.2/text/body are kept as literal text, everything else (the
+ * header, each entry, whitespace between them) as a pointer to the subtree in
+ * the live document.  Taking a snapshot therefore costs one walk over the
+ * children of body, not a copy of the document.
+ *
+ * While the writer thread runs, the user keeps editing.  Every function that
+ * is about to change, replace, unlink or free a node of the document has to
+ * call save_snapshot_before_modify() first.  If the node belongs to a piece
+ * that is not written yet, the piece is replaced by a private copy of the old
+ * subtree (copy-on-write), so the file gets the state at the time of the
+ * snapshot.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "save.h"
+#include "xml.h"
+
+#include <glib/gi18n.h>
+#include <libxml/xmlsave.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/// Comment that marks where the children of a container element go
+#define SNAPSHOT_SPLIT_MARKER "fd-snapshot-split"
+
+/// A part of the serialized document
+struct snapshot_piece
+{
+  xmlNodePtr node;///< Subtree to dump, or NULL if @a text is used
+  gchar *text;///< Literal UTF-8 output, already escaped
+  gboolean owned;///< @a node is a private copy that we have to free
+};
+
+/// Range of pieces that one worker formats into a buffer of its own
+struct snapshot_chunk
+{
+  guint first, end;///< Pieces first ... end-1
+  GString *buf;
+  gboolean done;///< @a buf is complete, protected by snapshot.mutex
+  gboolean failed;
+};
+
+/// States of a piece, see snapshot.state
+enum { PIECE_PENDING, PIECE_WRITING, PIECE_DONE };
+
+struct snapshot
+{
+  xmlDocPtr doc;
+  gchar *filename, *tmpfilename;
+
+  /// Array of struct snapshot_piece, its size is fixed after creation
+  GArray *pieces;
+
+  /// Maps each xmlNodePtr in @a pieces to its index + 1
+  GHashTable *index;
+
+  /// Protects @a state, @a done, the chunks and the nodes in @a pieces
+  GMutex *mutex;
+  /// Signalled when a piece or a chunk is finished
+  GCond *cond;
+  /// One of PIECE_PENDING, PIECE_WRITING or PIECE_DONE for each piece
+  guchar *state;
+  /// Number of pieces in state PIECE_DONE
+  guint done;
+
+  /// Set by the writer to make the formatting threads skip their chunks
+  volatile gint cancelled;
+
+  volatile gint finished;
+  gboolean ok;
+  gchar *error;
+  GThread *thread;
+};
+
+/// The snapshot currently being written, only accessed from the GUI thread
+static struct snapshot *current_snapshot;
+
+
+static void snapshot_add_piece(struct snapshot *sn, xmlNodePtr node, gchar *text)
+{
+  struct snapshot_piece p;
+  p.node = node;
+  p.text = text;
+  p.owned = FALSE;
+  g_array_append_val(sn->pieces, p);
+  if(node) g_hash_table_insert(sn->index, node,
+      GUINT_TO_POINTER(sn->pieces->len));
+}
+
+
+/// Same output as the XML declaration written by xmlSaveFile()
+static gchar *snapshot_xml_declaration(const xmlDocPtr doc)
+{
+  xmlBufferPtr buf = xmlBufferCreate();
+  xmlBufferCCat(buf, "<?xml version=");
+  if(doc->version) xmlBufferWriteQuotedString(buf, doc->version);
+  else xmlBufferCCat(buf, "\"1.0\"");
+  if(doc->encoding)
+  {
+    xmlBufferCCat(buf, " encoding=");
+    xmlBufferWriteQuotedString(buf, doc->encoding);
+  }
+  switch(doc->standalone)
+  {
+    case 0: xmlBufferCCat(buf, " standalone=\"no\""); break;
+    case 1: xmlBufferCCat(buf, " standalone=\"yes\""); break;
+  }
+  xmlBufferCCat(buf, "?>\n");
+  gchar *s = g_strdup((char *) xmlBufferContent(buf));
+  xmlBufferFree(buf);
+  return s;
+}
+
+
+static int snapshot_gstring_write(void *context, const char *buffer, int len)
+{
+  g_string_append_len((GString *) context, buffer, len);
+  return len;
+}
+
+
+/// Split the serialization of element @a n into start and end tag
+/** We let libxml2 dump a shallow copy of @a n with a single marker comment
+ * as its child, so attributes, namespace declarations and escaping come out
+ * exactly as in a full dump.  The copy lives on the stack and shares all
+ * pointers with @a n, nothing in the document is modified.
+ */
+static gboolean snapshot_container_tags(const xmlDocPtr doc, const xmlNodePtr n,
+    gchar **start, gchar **end)
+{
+  xmlNode shallow = *n;
+  xmlNodePtr marker = xmlNewDocComment(doc, (xmlChar *) SNAPSHOT_SPLIT_MARKER);
+  shallow.children = shallow.last = marker;
+  marker->parent = &shallow;
+
+  GString *s = g_string_new(NULL);
+  xmlOutputBufferPtr out = xmlOutputBufferCreateIO(snapshot_gstring_write,
+      NULL, s, NULL);
+  xmlNodeDumpOutput(out, doc, &shallow, 0, 0, (const char *) doc->encoding);
+  xmlOutputBufferClose(out);
+
+  marker->parent = NULL;
+  xmlFreeNode(marker);
+
+  char *m = strstr(s->str, "<!--" SNAPSHOT_SPLIT_MARKER "-->");
+  if(!m)
+  {
+    g_string_free(s, TRUE);
+    return FALSE;
+  }
+  *start = g_strndup(s->str, m - s->str);
+  *end = g_strdup(m + strlen("<!--" SNAPSHOT_SPLIT_MARKER "-->"));
+  g_string_free(s, TRUE);
+  return TRUE;
+}
+
+
+/// Add pieces for @a n, splitting the elements that contain @a body
+static void snapshot_plan(struct snapshot *sn, const xmlNodePtr n,
+    const xmlNodePtr body)
+{
+  gboolean is_container = FALSE;
+  if(n->type == XML_ELEMENT_NODE && n->children && body)
+  {
+    xmlNodePtr a;
+    for(a = body; a; a = a->parent)
+      if(a == n) { is_container = TRUE; break; }
+  }
+
+  gchar *start, *end;
+  if(!is_container || !snapshot_container_tags(sn->doc, n, &start, &end))
+  {
+    snapshot_add_piece(sn, n, NULL);
+    return;
+  }
+
+  snapshot_add_piece(sn, NULL, start);
+  xmlNodePtr c;
+  for(c = n->children; c; c = c->next) snapshot_plan(sn, c, body);
+  snapshot_add_piece(sn, NULL, end);
+}
+
+
+static void snapshot_free(struct snapshot *sn)
+{
+  int i;
+  for(i = 0; i < sn->pieces->len; i++)
+  {
+    struct snapshot_piece *p = &g_array_index(sn->pieces,
+	struct snapshot_piece, i);
+    if(p->owned) xmlFreeNode(p->node);
+    g_free(p->text);
+  }
+  g_array_free(sn->pieces, TRUE);
+  g_hash_table_destroy(sn->index);
+  g_mutex_free(sn->mutex);
+  g_cond_free(sn->cond);
+  g_free(sn->state);
+  g_free(sn->filename);
+  g_free(sn->tmpfilename);
+  g_free(sn->error);
+  g_free(sn);
+}
+
+
+/// Serialize piece @a i to @a out
+/** The piece is marked as being written, so save_snapshot_before_modify()
+ * waits instead of copying a subtree that is read at the same time.
+ */
+static void snapshot_dump_piece(struct snapshot *sn, xmlOutputBufferPtr out,
+    guint i)
+{
+  g_mutex_lock(sn->mutex);
+  struct snapshot_piece p = g_array_index(sn->pieces, struct snapshot_piece, i);
+  sn->state[i] = PIECE_WRITING;
+  g_mutex_unlock(sn->mutex);
+
+  if(p.node) xmlNodeDumpOutput(out, sn->doc, p.node, 0, 0,
+      (const char *) sn->doc->encoding);
+  else xmlOutputBufferWriteString(out, p.text);
+
+  g_mutex_lock(sn->mutex);
+  sn->state[i] = PIECE_DONE;
+  sn->done++;
+  g_cond_broadcast(sn->cond);
+  g_mutex_unlock(sn->mutex);
+}
+
+
+/// Whether the output of each chunk can be encoded independently
+/** True for encodings without shift states or byte order marks, where
+ * concatenating separately encoded parts gives the same bytes as encoding
+ * the whole.
+ */
+static gboolean snapshot_encoding_is_stateless(const char *encoding)
+{
+  if(!encoding) return TRUE;
+  const char *prefixes[] = { "UTF-8", "UTF8", "ISO-8859-", "ISO8859-",
+    "ISO-LATIN-", "ASCII", "US-ASCII", "WINDOWS-125", "CP125", "KOI8-",
+    NULL };
+  const char **pr;
+  for(pr = prefixes; *pr; pr++)
+    if(!g_ascii_strncasecmp(encoding, *pr, strlen(*pr))) return TRUE;
+  return FALSE;
+}
+
+
+/// GFunc for the thread pool, formats one chunk into its buffer
+static void snapshot_format_chunk(gpointer data, gpointer user_data)
+{
+  struct snapshot_chunk *c = data;
+  struct snapshot *sn = user_data;
+  xmlOutputBufferPtr out = NULL;
+
+  if(!g_atomic_int_get(&sn->cancelled))
+  {
+    // every chunk needs its own handler, iconv handlers are freed on close
+    const char *encoding = (const char *) sn->doc->encoding;
+    xmlCharEncodingHandlerPtr handler =
+      encoding ? xmlFindCharEncodingHandler(encoding) : NULL;
+    out = xmlOutputBufferCreateIO(snapshot_gstring_write, NULL, c->buf,
+	handler);
+  }
+
+  guint i;
+  for(i = c->first; out && i < c->end && !out->error; i++)
+    snapshot_dump_piece(sn, out, i);
+
+  int ret = out ? xmlOutputBufferClose(out) : -1;
+  g_mutex_lock(sn->mutex);
+  c->failed = ret == -1 || i < c->end;
+  c->done = TRUE;
+  g_cond_broadcast(sn->cond);
+  g_mutex_unlock(sn->mutex);
+}
+
+
+/// Write all of @a iov to @a fd, continuing after partial writes
+static gboolean snapshot_writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+  while(iovcnt)
+  {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if(n == -1)
+    {
+      if(errno == EINTR) continue;
+      return FALSE;
+    }
+    while(iovcnt && n >= iov->iov_len)
+    {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if(iovcnt)
+    {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return TRUE;
+}
+
+
+/// Minimum number of pieces per chunk, to keep the per-chunk overhead low
+#define SNAPSHOT_MIN_CHUNK_PIECES 256
+
+/// Format chunks of pieces in parallel and write them in order to @a fd
+/** Chunks are formatted by a thread pool with one thread per CPU.  As soon
+ * as the next chunks in file order are complete, they are written with one
+ * writev() call, so disk I/O overlaps with formatting of later chunks.
+ * @retval 0 success
+ * @retval -1 error, @a sn->error is set
+ * @retval 1 the parallel serializer can't be used
+ */
+static int snapshot_write_parallel(struct snapshot *sn, int fd)
+{
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  guint npieces = sn->pieces->len;
+  if(ncpus < 2 || npieces < 2 * SNAPSHOT_MIN_CHUNK_PIECES ||
+      !snapshot_encoding_is_stateless((const char *) sn->doc->encoding))
+    return 1;
+
+  // a few chunks per thread, so a slow chunk does not stall the others
+  guint nchunks = MIN(4 * ncpus, npieces / SNAPSHOT_MIN_CHUNK_PIECES);
+  struct snapshot_chunk *chunks = g_new0(struct snapshot_chunk, nchunks);
+  guint i;
+  for(i = 0; i < nchunks; i++)
+  {
+    chunks[i].first = (guint64) npieces * i / nchunks;
+    chunks[i].end = (guint64) npieces * (i + 1) / nchunks;
+    chunks[i].buf = g_string_sized_new(64 * 1024);
+  }
+
+  GError *err = NULL;
+  GThreadPool *pool = g_thread_pool_new(snapshot_format_chunk, sn, ncpus,
+      FALSE, &err);
+  if(!pool)
+  {
+    g_printerr("%s\n", err->message);
+    g_error_free(err);
+    for(i = 0; i < nchunks; i++) g_string_free(chunks[i].buf, TRUE);
+    g_free(chunks);
+    return 1;
+  }
+  for(i = 0; i < nchunks; i++) g_thread_pool_push(pool, &chunks[i], NULL);
+
+  struct iovec iov[64];
+  i = 0;
+  while(i < nchunks && !sn->error)
+  {
+    // wait for the next chunk, then take all consecutive finished ones
+    guint j = i;
+    g_mutex_lock(sn->mutex);
+    while(!chunks[i].done) g_cond_wait(sn->cond, sn->mutex);
+    while(j < nchunks && j - i < G_N_ELEMENTS(iov) && chunks[j].done) j++;
+    g_mutex_unlock(sn->mutex);
+
+    guint k;
+    for(k = i; k < j; k++)
+    {
+      if(chunks[k].failed)
+	sn->error = g_strdup_printf(_("Formatting %s failed"), sn->filename);
+      iov[k - i].iov_base = chunks[k].buf->str;
+      iov[k - i].iov_len = chunks[k].buf->len;
+    }
+    if(!sn->error && !snapshot_writev_all(fd, iov, j - i))
+      sn->error = g_strdup_printf(_("Writing %s failed: %s"),
+	  sn->tmpfilename, g_strerror(errno));
+
+    for(k = i; k < j; k++)
+    {
+      g_string_free(chunks[k].buf, TRUE);
+      chunks[k].buf = NULL;
+    }
+    i = j;
+  }
+
+  if(sn->error) g_atomic_int_set(&sn->cancelled, 1);
+  g_thread_pool_free(pool, FALSE, TRUE);
+  for(; i < nchunks; i++) g_string_free(chunks[i].buf, TRUE);
+  g_free(chunks);
+  return sn->error ? -1 : 0;
+}
+
+
+/// Serialize all pieces to @a fd in this thread
+static void snapshot_write_serial(struct snapshot *sn, int fd)
+{
+  const char *encoding = (const char *) sn->doc->encoding;
+  xmlCharEncodingHandlerPtr handler = NULL;
+  if(encoding && !(handler = xmlFindCharEncodingHandler(encoding)))
+  {
+    sn->error = g_strdup_printf(_("Unknown encoding %s"), encoding);
+    return;
+  }
+
+  // the fd is closed by the caller, not by xmlOutputBufferClose()
+  xmlOutputBufferPtr out = xmlOutputBufferCreateFd(fd, handler);
+  guint i;
+  for(i = 0; out && i < sn->pieces->len && !out->error; i++)
+    snapshot_dump_piece(sn, out, i);
+
+  int ret = out ? xmlOutputBufferClose(out) : -1;
+  if(ret == -1 || i < sn->pieces->len)
+    sn->error = g_strdup_printf(_("Writing %s failed"), sn->tmpfilename);
+}
+
+
+/// Thread function that serializes the pieces into a temporary file
+/** The temporary file is synced and then renamed over the target, so the
+ * target always contains either the old or the complete new dictionary.
+ */
+static gpointer snapshot_write_thread(gpointer data)
+{
+  struct snapshot *sn = data;
+
+  int fd = g_mkstemp(sn->tmpfilename);
+  if(fd == -1)
+  {
+    sn->error = g_strdup_printf(_("Could not create %s: %s"),
+	sn->tmpfilename, g_strerror(errno));
+    g_atomic_int_set(&sn->finished, 1);
+    return NULL;
+  }
+
+  // g_mkstemp() creates the file with mode 0600, keep the old permissions
+  struct stat st;
+  if(stat(sn->filename, &st) == 0) fchmod(fd, st.st_mode & 07777);
+  else
+  {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+  }
+
+  if(snapshot_write_parallel(sn, fd) == 1) snapshot_write_serial(sn, fd);
+
+  if(!sn->error && fsync(fd) == -1)
+    sn->error = g_strdup_printf(_("Syncing %s failed: %s"),
+	sn->tmpfilename, g_strerror(errno));
+
+  if(close(fd) == -1 && !sn->error)
+    sn->error = g_strdup_printf(_("Closing %s failed: %s"),
+	sn->tmpfilename, g_strerror(errno));
+
+  if(!sn->error && rename(sn->tmpfilename, sn->filename) == -1)
+    sn->error = g_strdup_printf(_("Renaming %s to %s failed: %s"),
+	sn->tmpfilename, sn->filename, g_strerror(errno));
+
+  if(sn->error) unlink(sn->tmpfilename);
+  else sn->ok = TRUE;
+
+  g_atomic_int_set(&sn->finished, 1);
+  return NULL;
+}
+
+
+/// Take a snapshot of @a doc and start writing it to @a filename
+/** Has to be called from the GUI thread.  Only one snapshot can be written
+ * at a time.
+ * @arg error set to a newly allocated message on failure
+ * @retval TRUE the writer thread was started
+ * @retval FALSE a save is still running or the thread could not be started
+ */
+gboolean save_snapshot_start(const xmlDocPtr doc, const char *filename,
+    gchar **error)
+{
+  g_return_val_if_fail(doc && filename, FALSE);
+  if(current_snapshot)
+  {
+    if(error) *error = g_strdup(_("Another save is still running"));
+    return FALSE;
+  }
+
+  struct snapshot *sn = g_new0(struct snapshot, 1);
+  sn->doc = doc;
+  sn->filename = g_strdup(filename);
+  sn->tmpfilename = g_strdup_printf("%s.XXXXXX", filename);
+  sn->pieces = g_array_new(FALSE, TRUE, sizeof(struct snapshot_piece));
+  sn->index = g_hash_table_new(g_direct_hash, g_direct_equal);
+  sn->mutex = g_mutex_new();
+  sn->cond = g_cond_new();
+
+  xmlNodePtr body = find_single_node("/TEI.2/text/body[1]", doc);
+  snapshot_add_piece(sn, NULL, snapshot_xml_declaration(doc));
+  xmlNodePtr c;
+  for(c = doc->children; c; c = c->next)
+  {
+    snapshot_plan(sn, c, body);
+    if(c->type != XML_XINCLUDE_START && c->type != XML_XINCLUDE_END)
+      snapshot_add_piece(sn, NULL, g_strdup("\n"));
+  }
+  sn->state = g_new0(guchar, sn->pieces->len);
+
+  GError *err = NULL;
+  sn->thread = g_thread_create(snapshot_write_thread, sn, TRUE, &err);
+  if(!sn->thread)
+  {
+    if(error) *error = g_strdup(err->message);
+    g_error_free(err);
+    snapshot_free(sn);
+    return FALSE;
+  }
+
+  current_snapshot = sn;
+  return TRUE;
+}
+
+
+/// Whether a snapshot exists that was not joined yet
+gboolean save_snapshot_running(void)
+{
+  return current_snapshot != NULL;
+}
+
+
+/// Whether the writer thread is done, so save_snapshot_join() won't block
+gboolean save_snapshot_finished(void)
+{
+  return !current_snapshot || g_atomic_int_get(&current_snapshot->finished);
+}
+
+
+/// Fraction of the pieces that are written already
+gdouble save_snapshot_progress(void)
+{
+  struct snapshot *sn = current_snapshot;
+  if(!sn || !sn->pieces->len) return 0;
+  g_mutex_lock(sn->mutex);
+  guint done = sn->done;
+  g_mutex_unlock(sn->mutex);
+  return (gdouble) done / (gdouble) sn->pieces->len;
+}
+
+
+/// Wait for the writer thread and free the snapshot
+/** @arg error set to a newly allocated message on failure, can be NULL
+ * @retval TRUE the file was written and renamed into place
+ */
+gboolean save_snapshot_join(gchar **error)
+{
+  struct snapshot *sn = current_snapshot;
+  g_return_val_if_fail(sn, FALSE);
+
+  g_thread_join(sn->thread);
+  current_snapshot = NULL;
+
+  gboolean ok = sn->ok;
+  if(!ok)
+  {
+    g_printerr("%s\n", sn->error);
+    if(error) *error = g_strdup(sn->error);
+  }
+  snapshot_free(sn);
+  return ok;
+}
+
+
+/// Copy-on-write hook, to be called before @a n is changed in any way
+/** If @a n is inside a piece of the running snapshot that is not written yet,
+ * the piece gets a private copy of its old subtree.  If a writer thread is
+ * busy with exactly that piece, we wait until it is done.
+ */
+void save_snapshot_before_modify(const xmlNodePtr n)
+{
+  struct snapshot *sn = current_snapshot;
+  if(!sn || !n || g_atomic_int_get(&sn->finished)) return;
+
+  // find the piece containing n
+  guint i = 0;
+  xmlNodePtr a;
+  for(a = n; a && !i; a = a->parent)
+    i = GPOINTER_TO_UINT(g_hash_table_lookup(sn->index, a));
+  if(!i) return;
+  i--;
+
+  g_mutex_lock(sn->mutex);
+  while(sn->state[i] == PIECE_WRITING) g_cond_wait(sn->cond, sn->mutex);
+
+  if(sn->state[i] == PIECE_PENDING)
+  {
+    struct snapshot_piece *p = &g_array_index(sn->pieces,
+	struct snapshot_piece, i);
+    g_hash_table_remove(sn->index, p->node);
+    p->node = xmlDocCopyNode(p->node, sn->doc, 1);
+    p->owned = TRUE;
+  }
+  g_mutex_unlock(sn->mutex);
+}
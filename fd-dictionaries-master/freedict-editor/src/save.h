@@ -0,0 +1,11 @@
+#include <libxml/tree.h>
+#include <glib.h>
+
+// Saving a document from a point-in-time snapshot in a worker thread
+gboolean save_snapshot_start(const xmlDocPtr doc, const char *filename,
+    gchar **error);
+gboolean save_snapshot_running(void);
+gboolean save_snapshot_finished(void);
+gdouble  save_snapshot_progress(void);
+gboolean save_snapshot_join(gchar **error);
+void     save_snapshot_before_modify(const xmlNodePtr n);
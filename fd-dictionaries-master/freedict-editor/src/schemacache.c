@@ -0,0 +1,330 @@
+/** @file
+ * @brief Parsing every DTD and RelaxNG schema only once per process
+ *
+ * Every dictionary ships its own copy of freedict-P5.dtd and
+ * freedict-P5.rng.  Schemas are looked up by a hash of their content, so
+ * identical copies in different directories are parsed only once.
+ *
+ * For DTDs, the parser is given a copy of the cached declarations as the
+ * external subset of the document instead of parsing the file.  Copying
+ * the declarations is much cheaper than parsing them with all their
+ * parameter entities.  Attribute defaults and types, which the parser also
+ * remembers for itself while reading a DTD, are fed to it from a short
+ * text holding only the relevant ATTLIST declarations.
+ *
+ * Only simple cases are handled this way: a DTD that is given by a SYSTEM
+ * identifier alone and does not load other files, and a document whose
+ * internal subset declares no parameter entities.  Everything else is
+ * parsed as usual.
+ *
+ * Compiled RelaxNG schemas are shared as they are: libxml2 does not change
+ * them during validation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "schemacache.h"
+
+#include <libxml/SAX2.h>
+#include <libxml/parserInternals.h>
+#include <libxml/uri.h>
+#include <libxml/valid.h>
+
+#include <string.h>
+
+/// A parsed DTD and what the parser needs from it besides the declarations
+struct schema_cache_dtd
+{
+  xmlDtdPtr dtd;
+  /// ATTLIST declarations of defaulted xmlns attributes, or NULL
+  xmlChar *attlists;
+};
+
+static GStaticMutex schema_cache_mutex = G_STATIC_MUTEX_INIT;
+
+/// Maps content hashes to struct schema_cache_dtd, NULL if not cacheable
+static GHashTable *schema_cache_dtds;
+
+/// Maps content hashes to xmlRelaxNGPtr
+static GHashTable *schema_cache_rngs;
+
+
+/// Hash of the content of the local file @a path, NULL if unreadable
+static gchar *schema_cache_hash_file(const char *path)
+{
+  gchar *content;
+  gsize len;
+  if(!g_file_get_contents(path, &content, &len, NULL)) return NULL;
+  gchar *hash = g_compute_checksum_for_data(G_CHECKSUM_SHA1,
+      (guchar *) content, len);
+  g_free(content);
+  return hash;
+}
+
+
+/// The local filename of @a URI, NULL if it is remote
+static const char *schema_cache_local_path(const xmlChar *URI)
+{
+  const char *path = (const char *) URI;
+  if(!g_ascii_strncasecmp(path, "file://", 7)) path += 7;
+  return strstr(path, "://") ? NULL : path;
+}
+
+
+static void schema_cache_check_pentity(void *payload, void *data,
+    const xmlChar *name)
+{
+  xmlEntityPtr e = payload;
+  if(e->etype == XML_EXTERNAL_PARAMETER_ENTITY) *(gboolean *) data = TRUE;
+}
+
+
+/// ATTLIST declarations collected by schema_cache_collect_attlist()
+struct schema_cache_attlists
+{
+  xmlBufferPtr buf;
+  gboolean unwritable;///< a default value cannot be written as is
+};
+
+
+static void schema_cache_collect_attlist(void *payload, void *data,
+    const xmlChar *name)
+{
+  xmlAttributePtr a = payload;
+  struct schema_cache_attlists *l = data;
+  if(!a->defaultValue) return;
+  if(xmlStrcmp(a->name, (xmlChar *) "xmlns") &&
+      xmlStrcmp(a->prefix, (xmlChar *) "xmlns")) return;
+  // the value is written without escaping
+  if(xmlStrchr(a->defaultValue, '&') || xmlStrchr(a->defaultValue, '<') ||
+      xmlStrchr(a->defaultValue, '%'))
+    l->unwritable = TRUE;
+  else
+    xmlDumpAttributeDecl(l->buf, a);
+}
+
+
+/// Parse the DTD at @a URI, NULL if it cannot be cached
+static struct schema_cache_dtd *schema_cache_parse_dtd(const xmlChar *URI)
+{
+  xmlDtdPtr dtd = xmlParseDTD(NULL, URI);
+  if(!dtd) return NULL;
+
+  // the hash only covers the main file
+  gboolean external = FALSE;
+  if(dtd->pentities)
+    xmlHashScan(dtd->pentities, schema_cache_check_pentity, &external);
+
+  struct schema_cache_attlists l = { xmlBufferCreate(), FALSE };
+  if(!external && dtd->attributes)
+    xmlHashScan(dtd->attributes, schema_cache_collect_attlist, &l);
+  if(external || l.unwritable)
+  {
+    g_debug("DTD %s is not cached", URI);
+    xmlBufferFree(l.buf);
+    xmlFreeDtd(dtd);
+    return NULL;
+  }
+
+  struct schema_cache_dtd *c = g_new(struct schema_cache_dtd, 1);
+  c->dtd = dtd;
+  c->attlists = xmlBufferLength(l.buf) ?
+    xmlStrdup(xmlBufferContent(l.buf)) : NULL;
+  xmlBufferFree(l.buf);
+  return c;
+}
+
+
+/// resolveEntity() handler while the parser reads the ATTLIST declarations
+static xmlParserInputPtr schema_cache_resolve_attlists(void *ctx,
+    const xmlChar *publicId, const xmlChar *systemId)
+{
+  xmlParserCtxtPtr ctxt = ctx;
+  struct schema_cache_dtd *c = ctxt->_private;
+  return xmlNewStringInputStream(ctxt, c->attlists);
+}
+
+
+/// Enter the type of an attribute into the table of the parser
+/** Like the parser does for every ATTLIST declaration.  Values of attributes
+ * that are not CDATA are normalized while parsing.
+ */
+static void schema_cache_add_special(void *payload, void *data,
+    const xmlChar *name)
+{
+  xmlAttributePtr a = payload;
+  xmlParserCtxtPtr ctxt = data;
+  if(a->atype == XML_ATTRIBUTE_CDATA) return;
+
+  xmlChar *fullattr = a->prefix ?
+    xmlStrncatNew(a->prefix, (xmlChar *) ":", 1) : NULL;
+  if(fullattr) fullattr = xmlStrcat(fullattr, a->name);
+  xmlHashAddEntry2(ctxt->attsSpecial, a->elem, fullattr ? fullattr : a->name,
+      (void *) (ptrdiff_t) a->atype);
+  xmlFree(fullattr);
+}
+
+
+/// externalSubset() SAX handler that takes the DTD from the cache
+static void schema_cache_external_subset(void *ctx, const xmlChar *name,
+    const xmlChar *ExternalID, const xmlChar *SystemID)
+{
+  xmlParserCtxtPtr ctxt = ctx;
+  xmlDocPtr doc = ctxt->myDoc;
+  gboolean eligible = doc && ctxt->wellFormed && SystemID && !ExternalID &&
+    (ctxt->validate || ctxt->loadsubset) &&
+    !(ctxt->loadsubset & XML_COMPLETE_ATTRS) && !doc->extSubset &&
+    !(doc->intSubset && doc->intSubset->pentities &&
+	xmlHashSize(doc->intSubset->pentities));
+
+  // resolve SystemID like xmlSAX2ResolveEntity() does
+  xmlChar *URI = NULL;
+  if(eligible)
+  {
+    const char *base = ctxt->input && ctxt->input->filename ?
+      ctxt->input->filename : ctxt->directory;
+    URI = xmlBuildURI(SystemID, (xmlChar *) base);
+  }
+  const char *path = URI ? schema_cache_local_path(URI) : NULL;
+  gchar *hash = path ? schema_cache_hash_file(path) : NULL;
+  if(!hash)
+  {
+    xmlFree(URI);
+    xmlSAX2ExternalSubset(ctx, name, ExternalID, SystemID);
+    return;
+  }
+
+  g_static_mutex_lock(&schema_cache_mutex);
+  if(!schema_cache_dtds)
+    schema_cache_dtds = g_hash_table_new(g_str_hash, g_str_equal);
+  gpointer key, value;
+  struct schema_cache_dtd *c;
+  if(g_hash_table_lookup_extended(schema_cache_dtds, hash, &key, &value))
+  {
+    c = value;
+    g_free(hash);
+  }
+  else
+  {
+    c = schema_cache_parse_dtd(URI);
+    g_hash_table_insert(schema_cache_dtds, hash, c);
+  }
+  g_static_mutex_unlock(&schema_cache_mutex);
+  xmlFree(URI);
+
+  if(!c)
+  {
+    xmlSAX2ExternalSubset(ctx, name, ExternalID, SystemID);
+    return;
+  }
+
+  // let the parser register default namespaces; their declarations end up
+  // in an external subset of their own
+  if(c->attlists)
+  {
+    void *private = ctxt->_private;
+    resolveEntitySAXFunc resolve = ctxt->sax->resolveEntity;
+    ctxt->_private = c;
+    ctxt->sax->resolveEntity = schema_cache_resolve_attlists;
+    xmlSAX2ExternalSubset(ctx, name, ExternalID, SystemID);
+    ctxt->sax->resolveEntity = resolve;
+    ctxt->_private = private;
+  }
+
+  if(c->dtd->attributes)
+  {
+    if(!ctxt->attsSpecial) ctxt->attsSpecial = xmlHashCreateDict(10, ctxt->dict);
+    if(ctxt->attsSpecial)
+      xmlHashScan(c->dtd->attributes, schema_cache_add_special, ctxt);
+  }
+
+  // use the complete declarations
+  // (cached DTDs are never changed, so they can be copied without the lock)
+  xmlDtdPtr attlists = doc->extSubset;
+  xmlDtdPtr dtd = xmlCopyDtd(c->dtd);
+  if(!dtd) return;
+  dtd->doc = doc;
+  xmlFree((xmlChar *) dtd->name);
+  dtd->name = xmlStrdup(name);
+  xmlFree((xmlChar *) dtd->SystemID);
+  dtd->SystemID = xmlStrdup(SystemID);
+  xmlNodePtr n;
+  for(n = dtd->children; n; n = n->next) n->doc = doc;
+  doc->extSubset = dtd;
+  if(attlists) xmlFreeDtd(attlists);
+}
+
+
+/// Let @a ctxt take external DTD subsets from the cache
+/** Call this before parsing with @a ctxt.
+ */
+void schema_cache_use(xmlParserCtxtPtr ctxt)
+{
+  g_return_if_fail(ctxt && ctxt->sax);
+  ctxt->sax->externalSubset = schema_cache_external_subset;
+}
+
+
+/// Like xmlParseFile(), but with the DTD from the cache
+xmlDocPtr schema_cache_parse_file(const char *filename)
+{
+  g_return_val_if_fail(filename, NULL);
+  xmlParserCtxtPtr ctxt = xmlCreateFileParserCtxt(filename);
+  if(!ctxt) return NULL;
+  schema_cache_use(ctxt);
+  xmlParseDocument(ctxt);
+
+  xmlDocPtr doc = ctxt->myDoc;
+  if(!ctxt->wellFormed)
+  {
+    xmlFreeDoc(doc);
+    doc = NULL;
+  }
+  ctxt->myDoc = NULL;
+  xmlFreeParserCtxt(ctxt);
+  return doc;
+}
+
+
+/// The compiled RelaxNG schema in @a filename
+/** Schemas that include other files are shared only by files in the same
+ * place, since the hash only covers the main file.
+ *
+ * @return the schema, owned by the cache, or NULL if it cannot be compiled
+ */
+xmlRelaxNGPtr schema_cache_relaxng(const char *filename)
+{
+  g_return_val_if_fail(filename, NULL);
+  gchar *content;
+  gsize len;
+  if(!g_file_get_contents(filename, &content, &len, NULL)) return NULL;
+  gchar *hash = g_compute_checksum_for_data(G_CHECKSUM_SHA1,
+      (guchar *) content, len);
+  if(g_strstr_len(content, len, "include") ||
+      g_strstr_len(content, len, "externalRef"))
+  {
+    gchar *where = g_strconcat(hash, " ", filename, NULL);
+    g_free(hash);
+    hash = where;
+  }
+  g_free(content);
+
+  g_static_mutex_lock(&schema_cache_mutex);
+  if(!schema_cache_rngs)
+    schema_cache_rngs = g_hash_table_new(g_str_hash, g_str_equal);
+  xmlRelaxNGPtr schema = g_hash_table_lookup(schema_cache_rngs, hash);
+  if(schema) g_free(hash);
+  else
+  {
+    xmlRelaxNGParserCtxtPtr pctxt = xmlRelaxNGNewParserCtxt(filename);
+    schema = pctxt ? xmlRelaxNGParse(pctxt) : NULL;
+    if(pctxt) xmlRelaxNGFreeParserCtxt(pctxt);
+    // errors are reported again on the next try
+    if(schema) g_hash_table_insert(schema_cache_rngs, hash, schema);
+    else g_free(hash);
+  }
+  g_static_mutex_unlock(&schema_cache_mutex);
+  return schema;
+}
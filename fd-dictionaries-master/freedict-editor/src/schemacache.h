@@ -0,0 +1,8 @@
+#include <libxml/parser.h>
+#include <libxml/relaxng.h>
+#include <glib.h>
+
+// Process-wide cache of parsed DTDs and compiled RelaxNG schemas
+void schema_cache_use(xmlParserCtxtPtr ctxt);
+xmlDocPtr schema_cache_parse_file(const char *filename);
+xmlRelaxNGPtr schema_cache_relaxng(const char *filename);
@@ -0,0 +1,502 @@
+/** @file
+ * @brief Exporting a TEI dictionary into an SQLite database for analysis
+ *
+ * The TEI file is read with a streaming parser, one entry at a time, so
+ * memory use does not grow with the size of the dictionary.  Entries,
+ * senses, translations, usage labels and cross references go into
+ * normalized tables; headwords, translations, definitions and examples are
+ * also put into an FTS5 full-text index.
+ *
+ * Every entry is stored with a fingerprint of its XML.  When the database
+ * already exists, entries whose fingerprint is found are kept, and only new
+ * or changed entries are inserted and vanished ones deleted.  Refreshing
+ * after some edits therefore costs little more than reading the file.
+ *
+ * Usage: freedict-sqlexport [--full] dictionary.tei database.sqlite
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <glib.h>
+#include <libxml/xmlreader.h>
+#include <sqlite3.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/// Entries inserted per transaction
+#define SQLEXPORT_BATCH 20000
+
+static const char sqlexport_schema[] =
+  "PRAGMA foreign_keys = ON;"
+  "CREATE TABLE IF NOT EXISTS meta ("
+  "  key TEXT PRIMARY KEY, value TEXT);"
+  "CREATE TABLE IF NOT EXISTS entries ("
+  "  id INTEGER PRIMARY KEY,"
+  "  position INTEGER NOT NULL,"
+  "  fingerprint INTEGER NOT NULL,"
+  "  xmlid TEXT, headword TEXT NOT NULL, pron TEXT, pos TEXT);"
+  "CREATE INDEX IF NOT EXISTS entries_fingerprint ON entries(fingerprint);"
+  "CREATE INDEX IF NOT EXISTS entries_headword ON entries(headword);"
+  "CREATE TABLE IF NOT EXISTS senses ("
+  "  id INTEGER PRIMARY KEY,"
+  "  entry_id INTEGER NOT NULL REFERENCES entries(id) ON DELETE CASCADE,"
+  "  nr INTEGER NOT NULL,"
+  "  def TEXT, note TEXT, example TEXT, example_tr TEXT);"
+  "CREATE INDEX IF NOT EXISTS senses_entry ON senses(entry_id);"
+  "CREATE TABLE IF NOT EXISTS translations ("
+  "  id INTEGER PRIMARY KEY,"
+  "  sense_id INTEGER NOT NULL REFERENCES senses(id) ON DELETE CASCADE,"
+  "  tr TEXT NOT NULL, pos TEXT, gen TEXT);"
+  "CREATE INDEX IF NOT EXISTS translations_sense ON translations(sense_id);"
+  "CREATE INDEX IF NOT EXISTS translations_tr ON translations(tr);"
+  "CREATE TABLE IF NOT EXISTS usages ("
+  "  id INTEGER PRIMARY KEY,"
+  "  sense_id INTEGER NOT NULL REFERENCES senses(id) ON DELETE CASCADE,"
+  "  type TEXT, value TEXT NOT NULL);"
+  "CREATE INDEX IF NOT EXISTS usages_sense ON usages(sense_id);"
+  "CREATE TABLE IF NOT EXISTS xrefs ("
+  "  id INTEGER PRIMARY KEY,"
+  "  sense_id INTEGER NOT NULL REFERENCES senses(id) ON DELETE CASCADE,"
+  "  type TEXT, ref TEXT NOT NULL);"
+  "CREATE INDEX IF NOT EXISTS xrefs_sense ON xrefs(sense_id);"
+  "CREATE VIRTUAL TABLE IF NOT EXISTS search USING fts5("
+  "  headword, translations, definitions, examples);"
+  "CREATE TEMP TABLE kept (id INTEGER PRIMARY KEY);";
+
+/// Prepared statements, in the order of sqlexport_statements[]
+enum
+{
+  STMT_FIND,
+  STMT_KEEP,
+  STMT_MOVE,
+  STMT_ENTRY,
+  STMT_SENSE,
+  STMT_TRANSLATION,
+  STMT_USAGE,
+  STMT_XREF,
+  STMT_SEARCH,
+  N_STMTS
+};
+
+static const char *sqlexport_statements[N_STMTS] =
+{
+  "SELECT id, position FROM entries WHERE fingerprint = ?"
+    " AND id NOT IN kept LIMIT 1",
+  "INSERT INTO kept VALUES (?)",
+  "UPDATE entries SET position = ? WHERE id = ?",
+  "INSERT INTO entries (position, fingerprint, xmlid, headword, pron, pos)"
+    " VALUES (?, ?, ?, ?, ?, ?)",
+  "INSERT INTO senses (entry_id, nr, def, note, example, example_tr)"
+    " VALUES (?, ?, ?, ?, ?, ?)",
+  "INSERT INTO translations (sense_id, tr, pos, gen) VALUES (?, ?, ?, ?)",
+  "INSERT INTO usages (sense_id, type, value) VALUES (?, ?, ?)",
+  "INSERT INTO xrefs (sense_id, type, ref) VALUES (?, ?, ?)",
+  "INSERT INTO search (rowid, headword, translations, definitions, examples)"
+    " VALUES (?, ?, ?, ?, ?)"
+};
+
+/// State of one export run
+struct sqlexport
+{
+  sqlite3 *db;
+  sqlite3_stmt *stmts[N_STMTS];
+  xmlBufferPtr dump;///< for fingerprints
+  int position;///< of the current entry in the file
+  int inserted, moved, kept, deleted, in_batch;
+  /// texts of the current entry for the full-text index
+  GString *translations, *definitions, *examples;
+};
+
+
+/// 64 bit FNV-1a hash
+static gint64 sqlexport_fingerprint(const xmlChar *p, int len)
+{
+  guint64 h = G_GUINT64_CONSTANT(14695981039346656037);
+  const xmlChar *end = p + len;
+  for(; p < end; p++)
+  {
+    h ^= *p;
+    h *= G_GUINT64_CONSTANT(1099511628211);
+  }
+  return (gint64) h;
+}
+
+
+static gboolean sqlexport_exec(sqlite3 *db, const char *sql)
+{
+  char *msg = NULL;
+  if(sqlite3_exec(db, sql, NULL, NULL, &msg) == SQLITE_OK) return TRUE;
+  g_printerr("SQLite: %s\n", msg);
+  sqlite3_free(msg);
+  return FALSE;
+}
+
+
+/// Run a prepared INSERT/UPDATE statement and reset it
+static gboolean sqlexport_step(struct sqlexport *ex, int stmt)
+{
+  sqlite3_stmt *st = ex->stmts[stmt];
+  int ret = sqlite3_step(st);
+  sqlite3_reset(st);
+  sqlite3_clear_bindings(st);
+  if(ret == SQLITE_DONE) return TRUE;
+  g_printerr("SQLite: %s\n", sqlite3_errmsg(ex->db));
+  return FALSE;
+}
+
+
+/// Bind a string, or NULL for a missing or empty one
+static void sqlexport_bind_text(sqlite3_stmt *st, int i, const xmlChar *s)
+{
+  if(s && *s) sqlite3_bind_text(st, i, (const char *) s, -1, SQLITE_TRANSIENT);
+  else sqlite3_bind_null(st, i);
+}
+
+
+static gboolean is_element(const xmlNodePtr n, const char *name)
+{
+  return n->type == XML_ELEMENT_NODE && !xmlStrcmp(n->name, (xmlChar *) name);
+}
+
+
+/// The first child element of @a n called @a name
+static xmlNodePtr sqlexport_child(const xmlNodePtr n, const char *name)
+{
+  xmlNodePtr c;
+  if(!n) return NULL;
+  for(c = n->children; c; c = c->next)
+    if(is_element(c, name)) return c;
+  return NULL;
+}
+
+
+/// Text content of the first child element of @a n called @a name
+/** @return string to be freed with xmlFree(), or NULL
+ */
+static xmlChar *sqlexport_child_text(const xmlNodePtr n, const char *name)
+{
+  xmlNodePtr c = sqlexport_child(n, name);
+  return c ? xmlNodeGetContent(c) : NULL;
+}
+
+
+static void sqlexport_append(GString *s, const xmlChar *text)
+{
+  if(!text || !*text) return;
+  if(s->len) g_string_append(s, "; ");
+  g_string_append(s, (const char *) text);
+}
+
+
+/// Insert the tr elements of @a trans
+static gboolean sqlexport_translations(struct sqlexport *ex, sqlite3_int64 sense,
+    const xmlNodePtr trans)
+{
+  xmlChar *pos = sqlexport_child_text(trans, "pos");
+  xmlChar *gen = sqlexport_child_text(trans, "gen");
+  gboolean ok = TRUE;
+  xmlNodePtr c;
+  for(c = trans->children; ok && c; c = c->next)
+  {
+    if(!is_element(c, "tr")) continue;
+    xmlChar *tr = xmlNodeGetContent(c);
+    sqlite3_stmt *st = ex->stmts[STMT_TRANSLATION];
+    sqlite3_bind_int64(st, 1, sense);
+    sqlite3_bind_text(st, 2, tr ? (char *) tr : "", -1, SQLITE_TRANSIENT);
+    sqlexport_bind_text(st, 3, pos);
+    sqlexport_bind_text(st, 4, gen);
+    ok = sqlexport_step(ex, STMT_TRANSLATION);
+    sqlexport_append(ex->translations, tr);
+    if(tr) xmlFree(tr);
+  }
+  if(pos) xmlFree(pos);
+  if(gen) xmlFree(gen);
+  return ok;
+}
+
+
+/// Insert a sense and what belongs to it
+/** @arg n a sense element, or the entry itself in the simple format where
+ *  trans elements are direct children of entry
+ */
+static gboolean sqlexport_sense(struct sqlexport *ex, sqlite3_int64 entry,
+    int nr, const xmlNodePtr n)
+{
+  xmlChar *def = sqlexport_child_text(n, "def");
+  xmlChar *note = sqlexport_child_text(n, "note");
+  xmlNodePtr eg = sqlexport_child(n, "eg");
+  xmlChar *example = sqlexport_child_text(eg, "q");
+  xmlChar *example_tr = sqlexport_child_text(sqlexport_child(eg, "trans"), "tr");
+
+  sqlite3_stmt *st = ex->stmts[STMT_SENSE];
+  sqlite3_bind_int64(st, 1, entry);
+  sqlite3_bind_int(st, 2, nr);
+  sqlexport_bind_text(st, 3, def);
+  sqlexport_bind_text(st, 4, note);
+  sqlexport_bind_text(st, 5, example);
+  sqlexport_bind_text(st, 6, example_tr);
+  gboolean ok = sqlexport_step(ex, STMT_SENSE);
+  sqlite3_int64 sense = sqlite3_last_insert_rowid(ex->db);
+
+  sqlexport_append(ex->definitions, def);
+  sqlexport_append(ex->definitions, note);
+  sqlexport_append(ex->examples, example);
+  sqlexport_append(ex->examples, example_tr);
+  if(def) xmlFree(def);
+  if(note) xmlFree(note);
+  if(example) xmlFree(example);
+  if(example_tr) xmlFree(example_tr);
+
+  xmlNodePtr c;
+  for(c = n->children; ok && c; c = c->next)
+  {
+    if(is_element(c, "trans")) ok = sqlexport_translations(ex, sense, c);
+    else if(is_element(c, "usg") || is_element(c, "xr"))
+    {
+      gboolean usg = is_element(c, "usg");
+      xmlChar *type = xmlGetProp(c, (xmlChar *) "type");
+      xmlChar *value = usg ? xmlNodeGetContent(c) :
+	sqlexport_child_text(c, "ref");
+      st = ex->stmts[usg ? STMT_USAGE : STMT_XREF];
+      sqlite3_bind_int64(st, 1, sense);
+      sqlexport_bind_text(st, 2, type);
+      sqlite3_bind_text(st, 3, value ? (char *) value : "", -1,
+	  SQLITE_TRANSIENT);
+      ok = sqlexport_step(ex, usg ? STMT_USAGE : STMT_XREF);
+      if(type) xmlFree(type);
+      if(value) xmlFree(value);
+    }
+  }
+  return ok;
+}
+
+
+/// Insert a new entry with its senses and full-text row
+static gboolean sqlexport_insert_entry(struct sqlexport *ex, const xmlNodePtr n,
+    gint64 fp)
+{
+  xmlNodePtr form = sqlexport_child(n, "form");
+  GString *headword = g_string_new(NULL);
+  xmlNodePtr c;
+  for(c = form ? form->children : NULL; c; c = c->next)
+  {
+    if(!is_element(c, "orth")) continue;
+    xmlChar *orth = xmlNodeGetContent(c);
+    if(headword->len) g_string_append(headword, ", ");
+    if(orth) g_string_append(headword, (char *) orth);
+    if(orth) xmlFree(orth);
+  }
+  xmlChar *pron = sqlexport_child_text(form, "pron");
+  xmlChar *pos = sqlexport_child_text(sqlexport_child(n, "gramGrp"), "pos");
+  xmlChar *xmlid = xmlGetProp(n, (xmlChar *) "id");
+  if(!xmlid) xmlid = xmlGetNsProp(n, (xmlChar *) "id", XML_XML_NAMESPACE);
+
+  sqlite3_stmt *st = ex->stmts[STMT_ENTRY];
+  sqlite3_bind_int(st, 1, ex->position);
+  sqlite3_bind_int64(st, 2, fp);
+  sqlexport_bind_text(st, 3, xmlid);
+  sqlite3_bind_text(st, 4, headword->str, -1, SQLITE_TRANSIENT);
+  sqlexport_bind_text(st, 5, pron);
+  sqlexport_bind_text(st, 6, pos);
+  gboolean ok = sqlexport_step(ex, STMT_ENTRY);
+  sqlite3_int64 entry = sqlite3_last_insert_rowid(ex->db);
+  if(xmlid) xmlFree(xmlid);
+  if(pron) xmlFree(pron);
+  if(pos) xmlFree(pos);
+
+  g_string_truncate(ex->translations, 0);
+  g_string_truncate(ex->definitions, 0);
+  g_string_truncate(ex->examples, 0);
+
+  int nr = 0;
+  for(c = n->children; ok && c; c = c->next)
+    if(is_element(c, "sense")) ok = sqlexport_sense(ex, entry, ++nr, c);
+  if(ok && !nr && sqlexport_child(n, "trans"))
+    ok = sqlexport_sense(ex, entry, 1, n);
+
+  if(ok)
+  {
+    st = ex->stmts[STMT_SEARCH];
+    sqlite3_bind_int64(st, 1, entry);
+    sqlite3_bind_text(st, 2, headword->str, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(st, 3, ex->translations->str, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(st, 4, ex->definitions->str, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(st, 5, ex->examples->str, -1, SQLITE_TRANSIENT);
+    ok = sqlexport_step(ex, STMT_SEARCH);
+  }
+
+  if(ok)
+  {
+    st = ex->stmts[STMT_KEEP];
+    sqlite3_bind_int64(st, 1, entry);
+    ok = sqlexport_step(ex, STMT_KEEP);
+  }
+  g_string_free(headword, TRUE);
+  ex->inserted++;
+  return ok;
+}
+
+
+/// Keep the stored version of an unchanged entry, or insert it
+static gboolean sqlexport_entry(struct sqlexport *ex, const xmlNodePtr n)
+{
+  xmlBufferEmpty(ex->dump);
+  xmlNodeDump(ex->dump, n->doc, n, 0, 0);
+  gint64 fp = sqlexport_fingerprint(xmlBufferContent(ex->dump),
+      xmlBufferLength(ex->dump));
+
+  sqlite3_stmt *st = ex->stmts[STMT_FIND];
+  sqlite3_bind_int64(st, 1, fp);
+  gboolean found = sqlite3_step(st) == SQLITE_ROW;
+  sqlite3_int64 id = found ? sqlite3_column_int64(st, 0) : 0;
+  int position = found ? sqlite3_column_int(st, 1) : 0;
+  sqlite3_reset(st);
+
+  if(!found) return sqlexport_insert_entry(ex, n, fp);
+
+  ex->kept++;
+  st = ex->stmts[STMT_KEEP];
+  sqlite3_bind_int64(st, 1, id);
+  if(!sqlexport_step(ex, STMT_KEEP)) return FALSE;
+  if(position == ex->position) return TRUE;
+
+  ex->moved++;
+  st = ex->stmts[STMT_MOVE];
+  sqlite3_bind_int(st, 1, ex->position);
+  sqlite3_bind_int64(st, 2, id);
+  return sqlexport_step(ex, STMT_MOVE);
+}
+
+
+/// Stream the entries of @a filename into the database
+static gboolean sqlexport_file(struct sqlexport *ex, const char *filename)
+{
+  xmlTextReaderPtr reader = xmlReaderForFile(filename, NULL,
+      XML_PARSE_NOENT | XML_PARSE_DTDLOAD | XML_PARSE_NONET);
+  if(!reader)
+  {
+    g_printerr("Could not open %s\n", filename);
+    return FALSE;
+  }
+
+  gboolean ok = sqlexport_exec(ex->db, "BEGIN");
+  int ret = xmlTextReaderRead(reader);
+  while(ok && ret == 1)
+  {
+    if(xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT ||
+	xmlStrcmp(xmlTextReaderConstLocalName(reader), (xmlChar *) "entry"))
+    {
+      ret = xmlTextReaderRead(reader);
+      continue;
+    }
+
+    xmlNodePtr n = xmlTextReaderExpand(reader);
+    if(!n) { ret = -1; break; }
+    ok = sqlexport_entry(ex, n);
+    ex->position++;
+
+    if(++ex->in_batch >= SQLEXPORT_BATCH)
+    {
+      ok = ok && sqlexport_exec(ex->db, "COMMIT; BEGIN");
+      ex->in_batch = 0;
+    }
+    // skip the subtree, so the reader can free it
+    ret = xmlTextReaderNext(reader);
+  }
+  xmlFreeTextReader(reader);
+
+  if(ret < 0)
+  {
+    g_printerr("%s: parse error\n", filename);
+    ok = FALSE;
+  }
+
+  // entries that are not in the file anymore
+  if(ok)
+  {
+    ok = sqlexport_exec(ex->db,
+	"DELETE FROM search WHERE rowid NOT IN kept;"
+	"DELETE FROM entries WHERE id NOT IN kept;");
+    ex->deleted = sqlite3_changes(ex->db);
+  }
+
+  if(ok)
+  {
+    char *sql = sqlite3_mprintf(
+	"INSERT OR REPLACE INTO meta VALUES ('source', %Q);"
+	"INSERT OR REPLACE INTO meta VALUES ('exported', datetime('now'));"
+	"COMMIT", filename);
+    ok = sqlexport_exec(ex->db, sql);
+    sqlite3_free(sql);
+  }
+  else sqlexport_exec(ex->db, "ROLLBACK");
+  return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+  gboolean full = argc > 1 && !strcmp(argv[1], "--full");
+  if(argc != 3 + full)
+  {
+    g_printerr("Usage: %s [--full] dictionary.tei database.sqlite\n"
+	"Exports the entries of a TEI dictionary into an SQLite database.\n"
+	"An existing database is refreshed: only changed entries are\n"
+	"written, unless --full is given.\n", argv[0]);
+    return 2;
+  }
+  const char *filename = argv[1 + full], *dbname = argv[2 + full];
+
+  LIBXML_TEST_VERSION
+  xmlSubstituteEntitiesDefault(1);
+
+  struct sqlexport ex;
+  memset(&ex, 0, sizeof(ex));
+  if(sqlite3_open(dbname, &ex.db) != SQLITE_OK)
+  {
+    g_printerr("Could not open %s: %s\n", dbname, sqlite3_errmsg(ex.db));
+    sqlite3_close(ex.db);
+    return 1;
+  }
+
+  // a lost export can be redone, so prefer speed over durability
+  gboolean ok = sqlexport_exec(ex.db,
+      "PRAGMA journal_mode = WAL; PRAGMA synchronous = OFF;");
+  if(ok && full)
+    ok = sqlexport_exec(ex.db,
+	"DROP TABLE IF EXISTS search; DROP TABLE IF EXISTS xrefs;"
+	"DROP TABLE IF EXISTS usages; DROP TABLE IF EXISTS translations;"
+	"DROP TABLE IF EXISTS senses; DROP TABLE IF EXISTS entries;");
+  ok = ok && sqlexport_exec(ex.db, sqlexport_schema);
+
+  int i;
+  for(i = 0; ok && i < N_STMTS; i++)
+    if(sqlite3_prepare_v2(ex.db, sqlexport_statements[i], -1,
+	  &ex.stmts[i], NULL) != SQLITE_OK)
+    {
+      g_printerr("SQLite: %s\n", sqlite3_errmsg(ex.db));
+      ok = FALSE;
+    }
+
+  ex.dump = xmlBufferCreate();
+  ex.translations = g_string_new(NULL);
+  ex.definitions = g_string_new(NULL);
+  ex.examples = g_string_new(NULL);
+
+  if(ok) ok = sqlexport_file(&ex, filename);
+  if(ok)
+    g_print("%i entries: %i inserted, %i unchanged (%i moved), %i deleted\n",
+	ex.position, ex.inserted, ex.kept, ex.moved, ex.deleted);
+
+  for(i = 0; i < N_STMTS; i++) sqlite3_finalize(ex.stmts[i]);
+  xmlBufferFree(ex.dump);
+  g_string_free(ex.translations, TRUE);
+  g_string_free(ex.definitions, TRUE);
+  g_string_free(ex.examples, TRUE);
+  sqlite3_close(ex.db);
+  xmlCleanupParser();
+  return ok ? 0 : 1;
+}
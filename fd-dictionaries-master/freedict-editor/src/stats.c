@@ -0,0 +1,431 @@
+/** @file
+ * @brief Statistics panel with counters that are maintained incrementally
+ *
+ * The counters are computed for every entry when a document is opened, and
+ * what each entry contributed is kept.  Afterwards only the counts of single
+ * entries are added or subtracted, when an entry is inserted, replaced or
+ * deleted, or when something below it changes.  The document is never walked
+ * again, so the panel can be refreshed after every change.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gnome.h>
+
+#include "stats.h"
+#include "edits.h"
+#include "utils.h"
+#include "xml.h"
+
+#include <string.h>
+
+extern GtkWidget *app1;
+
+/// Counts of one entry, or sums of them
+struct dict_stats
+{
+  int entries;
+  int senses;///< an entry with trans directly below counts as one sense
+  int translations;///< tr elements
+  int examples;///< eg elements
+  int xrs;
+  int entries_without_gen;
+};
+
+/// What one entry contributes to the totals
+struct entry_stats
+{
+  struct dict_stats st;
+  const gchar *pos;///< interned, see stats_entry_pos()
+};
+
+/// Sums over all entries of the document
+static struct dict_stats totals;
+
+/// Translations per part of speech of the headword, interned gchar * -> int
+static GHashTable *translations_per_pos;
+
+/// Entry node -> struct entry_stats that was added to the totals
+static GHashTable *entry_stats;
+
+static GtkWidget *stats_window;
+static GtkListStore *stats_store;
+static guint stats_refresh_id;
+
+enum
+{
+  STATS_NAME_COLUMN,
+  STATS_VALUE_COLUMN,
+  N_STATS_COLUMNS
+};
+
+
+static gboolean is_element(const xmlNodePtr n, const char *name)
+{
+  return n->type == XML_ELEMENT_NODE && !xmlStrcmp(n->name, (xmlChar *) name);
+}
+
+
+/// Count the elements below @a n
+static void stats_count(const xmlNodePtr n, struct dict_stats *st,
+    gboolean *has_gen)
+{
+  xmlNodePtr c;
+  for(c = n->children; c; c = c->next)
+  {
+    if(c->type != XML_ELEMENT_NODE) continue;
+    if(is_element(c, "sense")) st->senses++;
+    else if(is_element(c, "tr")) st->translations++;
+    else if(is_element(c, "eg")) st->examples++;
+    else if(is_element(c, "xr")) st->xrs++;
+    else if(is_element(c, "gen")) *has_gen = TRUE;
+    stats_count(c, st, has_gen);
+  }
+}
+
+
+/// The part of speech of the headword of @a entry
+/** The few different values are interned, so entries can share them.
+ */
+static const gchar *stats_entry_pos(const xmlNodePtr entry)
+{
+  xmlNodePtr g, p;
+  for(g = entry->children; g; g = g->next)
+  {
+    if(!is_element(g, "gramGrp")) continue;
+    for(p = g->children; p; p = p->next)
+    {
+      if(!is_element(p, "pos")) continue;
+      xmlChar *copy;
+      const xmlChar *pos = node_text(p, &copy);
+      const gchar *ret = g_intern_string(pos && *pos ? (char *) pos :
+	  _("(none)"));
+      if(copy) xmlFree(copy);
+      return ret;
+    }
+  }
+  return g_intern_string(_("(none)"));
+}
+
+
+/// Count what entry @a n contributes to the totals
+static void stats_entry_count(const xmlNodePtr n, struct entry_stats *es)
+{
+  memset(es, 0, sizeof(*es));
+  struct dict_stats *st = &es->st;
+  gboolean has_gen = FALSE;
+  stats_count(n, st, &has_gen);
+  if(!st->senses)
+  {
+    xmlNodePtr c;
+    for(c = n->children; c; c = c->next)
+      if(is_element(c, "trans")) { st->senses = 1; break; }
+  }
+  st->entries = 1;
+  st->entries_without_gen = !has_gen;
+  if(st->translations) es->pos = stats_entry_pos(n);
+}
+
+
+/// Add (@a sign 1) or subtract (@a sign -1) the counts of one entry
+static void stats_apply(const struct entry_stats *es, int sign)
+{
+  const struct dict_stats *st = &es->st;
+  totals.entries += sign * st->entries;
+  totals.senses += sign * st->senses;
+  totals.translations += sign * st->translations;
+  totals.examples += sign * st->examples;
+  totals.xrs += sign * st->xrs;
+  totals.entries_without_gen += sign * st->entries_without_gen;
+
+  if(!st->translations) return;
+  int count = sign * st->translations +
+    GPOINTER_TO_INT(g_hash_table_lookup(translations_per_pos, es->pos));
+  if(count) g_hash_table_insert(translations_per_pos, (gpointer) es->pos,
+      GINT_TO_POINTER(count));
+  else g_hash_table_remove(translations_per_pos, es->pos);
+}
+
+
+/// Subtract what entry @a n contributed, if anything
+static void stats_entry_removed(const xmlNodePtr n)
+{
+  struct entry_stats *es = g_hash_table_lookup(entry_stats, n);
+  if(!es) return;
+  stats_apply(es, -1);
+  g_hash_table_remove(entry_stats, n);
+}
+
+
+/// Add the counts of entry @a n, replacing what it contributed before
+static void stats_entry_changed(const xmlNodePtr n)
+{
+  stats_entry_removed(n);
+  struct entry_stats *es = g_slice_new(struct entry_stats);
+  stats_entry_count(n, es);
+  stats_apply(es, 1);
+  g_hash_table_insert(entry_stats, n, es);
+}
+
+
+static void stats_entry_free(gpointer data)
+{
+  g_slice_free(struct entry_stats, data);
+}
+
+
+/// Count the entry that @a n is part of again, if it is counted
+static void stats_below_entry_changed(xmlNodePtr n)
+{
+  for(; n; n = n->parent)
+    if(is_element(n, "entry"))
+    {
+      if(g_hash_table_lookup(entry_stats, n)) stats_entry_changed(n);
+      return;
+    }
+}
+
+
+static void stats_append_row(const char *name, const char *value)
+{
+  GtkTreeIter iter;
+  gtk_list_store_append(stats_store, &iter);
+  gtk_list_store_set(stats_store, &iter,
+      STATS_NAME_COLUMN, name, STATS_VALUE_COLUMN, value, -1);
+}
+
+
+static void stats_append_int_row(const char *name, int value)
+{
+  char str[20];
+  g_snprintf(str, sizeof(str), "%i", value);
+  stats_append_row(name, str);
+}
+
+
+static void stats_append_pos_row(gpointer key, gpointer value,
+    gpointer user_data)
+{
+  char name[100];
+  g_snprintf(name, sizeof(name), _("Translations with POS %s"), (char *) key);
+  stats_append_int_row(name, GPOINTER_TO_INT(value));
+}
+
+
+/// Fill the panel from the counters
+static gboolean stats_refresh(gpointer data)
+{
+  stats_refresh_id = 0;
+  if(!stats_store) return FALSE;
+
+  gtk_list_store_clear(stats_store);
+  stats_append_int_row(_("Entries"), totals.entries);
+  stats_append_int_row(_("Senses"), totals.senses);
+  stats_append_int_row(_("Translations"), totals.translations);
+  stats_append_int_row(_("Entries without gender"), totals.entries_without_gen);
+  stats_append_int_row(_("Examples"), totals.examples);
+
+  char str[20];
+  g_snprintf(str, sizeof(str), "%.2f",
+      totals.entries ? (double) totals.examples / totals.entries : 0.0);
+  stats_append_row(_("Examples per entry"), str);
+
+  stats_append_int_row(_("Cross references"), totals.xrs);
+  if(translations_per_pos)
+    g_hash_table_foreach(translations_per_pos, stats_append_pos_row, NULL);
+  return FALSE;
+}
+
+
+/// Refresh the panel once the current change is complete
+static void stats_changed(void)
+{
+  if(stats_window && !stats_refresh_id)
+    stats_refresh_id = g_idle_add(stats_refresh, NULL);
+}
+
+
+/// Compute the counters of all entries of @a doc
+/** This is the only time the whole document is walked.
+ */
+void stats_set_document(const xmlDocPtr doc)
+{
+  memset(&totals, 0, sizeof(totals));
+  if(translations_per_pos) g_hash_table_destroy(translations_per_pos);
+  translations_per_pos = g_hash_table_new(g_str_hash, g_str_equal);
+  if(entry_stats) g_hash_table_destroy(entry_stats);
+  entry_stats = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+      NULL, stats_entry_free);
+
+  xmlNodePtr body = doc ? find_single_node("/TEI.2/text/body[1]", doc) : NULL;
+  if(body)
+  {
+    xmlNodePtr n;
+    for(n = body->children; n; n = n->next)
+      if(is_element(n, "entry")) stats_entry_changed(n);
+  }
+  stats_changed();
+}
+
+
+/// Apply the deltas of added, removed and replaced entries
+/** Subscribed with doc_edit_subscribe().  Old nodes are still readable
+ * while this is called.  A change below an entry subtracts what the entry
+ * contributed before and adds its counts as they are now.  Later changes of
+ * the batch may be counted already, but counting an entry again gives the
+ * same result.
+ */
+void stats_doc_edited(const struct doc_edit *edits, guint n,
+    gpointer user_data)
+{
+  if(!entry_stats) return;
+  guint i;
+  for(i = 0; i < n; i++)
+  {
+    const struct doc_edit *e = &edits[i];
+    if(e->old_node)
+    {
+      if(is_element(e->old_node, "entry")) stats_entry_removed(e->old_node);
+      // the removed node still points to its old parent
+      else if(e->type == DOC_EDIT_REMOVED)
+	stats_below_entry_changed(e->old_node->parent);
+    }
+    if(!e->new_node) continue;
+    if(is_element(e->new_node, "entry")) stats_entry_changed(e->new_node);
+    else stats_below_entry_changed(e->new_node);
+  }
+  stats_changed();
+}
+
+
+/// Write the rows of the panel as tab separated values
+static void stats_export(const char *filename)
+{
+  GString *s = g_string_new(NULL);
+  GtkTreeIter iter;
+  gboolean valid = gtk_tree_model_get_iter_first(GTK_TREE_MODEL(stats_store),
+      &iter);
+  while(valid)
+  {
+    gchar *name, *value;
+    gtk_tree_model_get(GTK_TREE_MODEL(stats_store), &iter,
+	STATS_NAME_COLUMN, &name, STATS_VALUE_COLUMN, &value, -1);
+    g_string_append_printf(s, "%s\t%s\n", name, value);
+    g_free(name);
+    g_free(value);
+    valid = gtk_tree_model_iter_next(GTK_TREE_MODEL(stats_store), &iter);
+  }
+
+  GError *error = NULL;
+  if(!g_file_set_contents(filename, s->str, s->len, &error))
+  {
+    mystatus(_("Could not export statistics: %s"), error->message);
+    g_error_free(error);
+  }
+  else mystatus(_("Statistics exported to %s."), filename);
+  g_string_free(s, TRUE);
+}
+
+
+static void on_stats_export_clicked(GtkButton *button, gpointer user_data)
+{
+  GtkWidget *dialog = gtk_file_chooser_dialog_new(_("Export Statistics"),
+      GTK_WINDOW(stats_window), GTK_FILE_CHOOSER_ACTION_SAVE,
+      GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+      GTK_STOCK_SAVE, GTK_RESPONSE_ACCEPT, NULL);
+  gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog),
+      TRUE);
+  gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog),
+      "statistics.txt");
+
+  if(gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT)
+  {
+    char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+    stats_export(filename);
+    g_free(filename);
+  }
+  gtk_widget_destroy(dialog);
+}
+
+
+static void on_stats_window_destroy(GtkWidget *widget, gpointer user_data)
+{
+  stats_window = NULL;
+  g_object_unref(stats_store);
+  stats_store = NULL;
+}
+
+
+static void on_statistics_activate(GtkMenuItem *menuitem, gpointer user_data)
+{
+  if(stats_window)
+  {
+    gtk_window_present(GTK_WINDOW(stats_window));
+    return;
+  }
+
+  stats_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_title(GTK_WINDOW(stats_window), _("Dictionary Statistics"));
+  gtk_window_set_transient_for(GTK_WINDOW(stats_window), GTK_WINDOW(app1));
+  gtk_window_set_default_size(GTK_WINDOW(stats_window), 350, 300);
+  g_signal_connect(stats_window, "destroy",
+      G_CALLBACK(on_stats_window_destroy), NULL);
+
+  GtkWidget *vbox = gtk_vbox_new(FALSE, 6);
+  gtk_container_set_border_width(GTK_CONTAINER(vbox), 6);
+  gtk_container_add(GTK_CONTAINER(stats_window), vbox);
+
+  stats_store = gtk_list_store_new(N_STATS_COLUMNS,
+      G_TYPE_STRING, G_TYPE_STRING);
+  GtkWidget *view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(stats_store));
+  GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+  gtk_tree_view_append_column(GTK_TREE_VIEW(view),
+      gtk_tree_view_column_new_with_attributes(_("Statistic"), renderer,
+	"text", STATS_NAME_COLUMN, NULL));
+  renderer = gtk_cell_renderer_text_new();
+  g_object_set(renderer, "xalign", 1.0, NULL);
+  gtk_tree_view_append_column(GTK_TREE_VIEW(view),
+      gtk_tree_view_column_new_with_attributes(_("Value"), renderer,
+	"text", STATS_VALUE_COLUMN, NULL));
+
+  GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+  gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+      GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+  gtk_container_add(GTK_CONTAINER(scrolled), view);
+  gtk_box_pack_start(GTK_BOX(vbox), scrolled, TRUE, TRUE, 0);
+
+  GtkWidget *buttons = gtk_hbutton_box_new();
+  gtk_button_box_set_layout(GTK_BUTTON_BOX(buttons), GTK_BUTTONBOX_END);
+  gtk_box_set_spacing(GTK_BOX(buttons), 6);
+  GtkWidget *export = gtk_button_new_with_mnemonic(_("_Export..."));
+  g_signal_connect(export, "clicked", G_CALLBACK(on_stats_export_clicked), NULL);
+  gtk_container_add(GTK_CONTAINER(buttons), export);
+  GtkWidget *close = gtk_button_new_from_stock(GTK_STOCK_CLOSE);
+  g_signal_connect_swapped(close, "clicked",
+      G_CALLBACK(gtk_widget_destroy), stats_window);
+  gtk_container_add(GTK_CONTAINER(buttons), close);
+  gtk_box_pack_start(GTK_BOX(vbox), buttons, FALSE, FALSE, 0);
+
+  stats_refresh(NULL);
+  gtk_widget_show_all(stats_window);
+}
+
+
+/// Add "Statistics" to the menu of @a after, behind it
+void stats_add_menu_item(GtkWidget *after)
+{
+  g_return_if_fail(after);
+  GtkWidget *menu = gtk_widget_get_parent(after);
+  g_return_if_fail(GTK_IS_MENU_SHELL(menu));
+
+  GList *children = gtk_container_get_children(GTK_CONTAINER(menu));
+  int pos = g_list_index(children, after);
+  g_list_free(children);
+
+  GtkWidget *item = gtk_menu_item_new_with_mnemonic(_("S_tatistics"));
+  g_signal_connect(item, "activate", G_CALLBACK(on_statistics_activate), NULL);
+  gtk_menu_shell_insert(GTK_MENU_SHELL(menu), item, pos + 1);
+  gtk_widget_show(item);
+}
@@ -0,0 +1,9 @@
+#include <libxml/tree.h>
+#include <gnome.h>
+
+// Dictionary statistics, kept up to date by deltas of single entries
+void stats_set_document(const xmlDocPtr doc);
+struct doc_edit;
+void stats_doc_edited(const struct doc_edit *edits, guint n,
+    gpointer user_data);
+void stats_add_menu_item(GtkWidget *after);
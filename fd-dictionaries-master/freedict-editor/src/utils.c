@@ -14,6 +14,12 @@ extern GladeXML *my_glade_xml;
 // for fill_form()
 #include "entryedit.h"
 
+#include "save.h"
+#include "xml.h"
+#include "watch.h"
+#include "stats.h"
+#include "xmlview.h"
+
 
 // remember to use "%%" in the format string to output a literal '%'
 void mystatus(const char *format, ...)
@@ -27,20 +33,22 @@ void mystatus(const char *format, ...)
 }
 
 
-// shows the XML dump of n in textview1
-void show_in_textview1(const xmlNodePtr n)
+/// Log how long after the start of the program @a what was reached
+/** The first call, at the top of main(), starts the clock.
+ */
+void startup_mark(const char *what)
 {
-  xmlBufferPtr buf = xmlBufferCreate();
-  int ret2 = xmlNodeDump(buf, teidoc, n, 0, 1);
-  g_assert(ret2 != -1);
+  static GTimer *startup_timer;
+  if(!startup_timer) startup_timer = g_timer_new();
+  g_debug("Startup: %s after %.1f ms", what,
+      g_timer_elapsed(startup_timer, NULL) * 1000.0);
+}
 
-  // XXX make textview1 global var to save lookups
-  GtkTextView *textview1 = GTK_TEXT_VIEW(glade_xml_get_widget(my_glade_xml, "textview1"));
 
-  GtkTextBuffer* b = gtk_text_view_get_buffer(textview1);
-  gtk_text_buffer_set_text(b, (char *) xmlBufferContent(buf), -1);
-  xmlBufferFree(buf);
-  gtk_text_buffer_set_modified(b, FALSE);
+// shows the XML dump of n in textview1, piecewise for large nodes
+void show_in_textview1(const xmlNodePtr n)
+{
+  xmlview_show(n);
 
   // XXX make sure notebook1 shows page 0 (XML view)
 }
@@ -71,6 +79,9 @@ void set_edited_node(const xmlNodePtr n)
   // doesn't disturb us
   edited_node = NULL;
 
+  // stop filling textview1 with the previous node
+  xmlview_forget();
+
   // en-/disable switching to Form View
   gtk_widget_set_sensitive(glade_xml_get_widget(my_glade_xml, "form_view_label"), is_entry);
  
@@ -134,21 +145,95 @@ void setTeidoc(const xmlDocPtr t)
   gtk_window_set_title(GTK_WINDOW(app1),
       (t && selected_filename) ? selected_filename : PACKAGE_NAME);
   teidoc = t;
+  xpath_cache_set_document(t);
+  watch_forget();
+  form_prepare_forget();
+  stats_set_document(t);
   set_edited_node(NULL);
 }
 
 
+/// Source id of on_save_progress_timeout(), 0 if not installed
+static guint save_progress_id;
+
+/// File that mysave() is writing
+static gchar *save_filename;
+
+
+/// Waits for the writer thread of mysave() and stops polling it
+/** @arg error set to a newly allocated message on failure, can be NULL
+ * @retval TRUE the file was saved
+ */
+gboolean mysave_join(gchar **error)
+{
+  g_return_val_if_fail(save_snapshot_running(), FALSE);
+  if(save_progress_id) g_source_remove(save_progress_id);
+  save_progress_id = 0;
+  gnome_appbar_set_progress_percentage(
+      GNOME_APPBAR(glade_xml_get_widget(my_glade_xml, "appbar1")), 0);
+
+  gboolean ok = save_snapshot_join(error);
+  if(ok) watch_saved(save_filename, teidoc);
+  // edits made after the snapshot have already set this
+  else if(!file_modified)
+  { file_modified = TRUE; on_file_modified_changed(); }
+  g_free(save_filename);
+  save_filename = NULL;
+  return ok;
+}
+
+
+/// Polls the writer thread of mysave()
+static gboolean on_save_progress_timeout(gpointer data)
+{
+  if(!save_snapshot_finished())
+  {
+    gnome_appbar_set_progress_percentage(
+	GNOME_APPBAR(glade_xml_get_widget(my_glade_xml, "appbar1")),
+	save_snapshot_progress());
+    return TRUE;
+  }
+
+  // we return FALSE, so mysave_join() must not remove us
+  save_progress_id = 0;
+  gchar *filename = g_strdup(save_filename);
+  gchar *error = NULL;
+  if(mysave_join(&error)) mystatus(_("Saved."));
+  else
+  {
+    mystatus(_("Saving to %s failed: %s"), filename, error);
+    g_free(error);
+  }
+  g_free(filename);
+  return FALSE;
+}
+
+
+/// Saves teidoc to selected_filename in the background
+/** The document is written from a snapshot, so the user can continue
+ * editing.  See save.c.
+ */
 void mysave(void)
 {
   g_return_if_fail(teidoc);
-  int ret = xmlSaveFile(selected_filename, teidoc);
-  if(ret==-1)
+  if(save_snapshot_running())
+  {
+    mystatus(_("Still saving. Please try again later."));
+    return;
+  }
+
+  gchar *error = NULL;
+  if(!save_snapshot_start(teidoc, selected_filename, &error))
   {
-    mystatus(_("Saving to %s failed."), selected_filename);
+    mystatus(_("Saving to %s failed: %s"), selected_filename, error);
+    g_free(error);
+    return;
   }
 
   if(file_modified)
   { file_modified = FALSE; on_file_modified_changed(); }
 
-  mystatus(_("Saved."));
+  mystatus(_("Saving..."));
+  save_filename = g_strdup(selected_filename);
+  save_progress_id = g_timeout_add(100, on_save_progress_timeout, NULL);
 }
@@ -10,8 +10,11 @@ extern gboolean file_modified;
 
 // GUI utility functions
 void mystatus(const char *format, ...);
+void startup_mark(const char *what);
+void form_values_load(void);
 void show_in_textview1(const xmlNodePtr n);
 void set_edited_node(const xmlNodePtr n);
 void setTeidoc(const xmlDocPtr t);
 void on_file_modified_changed();
 void mysave(void);
+gboolean mysave_join(gchar **error);
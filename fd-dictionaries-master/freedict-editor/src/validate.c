@@ -0,0 +1,433 @@
+/** @file
+ * @brief Validating many TEI files against a RelaxNG schema at once
+ *
+ * Usage: freedict-validate [-j THREADS] [-s schema.rng] dictionary.tei...
+ *
+ * Each file is mapped into memory and its body is cut at entry boundaries
+ * with one pass of memchr(), see load_split_entries().  Chunks of entries are
+ * wrapped into everything in front of and behind the body, so each one is
+ * a complete document, and are parsed and validated by a thread pool.  The
+ * chunks of all files share the pool, so the whole collection takes about
+ * as long as validating the largest file used to, given enough CPUs.  Only
+ * the chunks being validated exist as trees.
+ *
+ * The schema defaults to freedict-P5.rng next to each file.  Identical
+ * copies are compiled only once, see schemacache.c.
+ *
+ * Errors are reported with the byte offset and headword of the entry they
+ * were found in.  The header is validated with every chunk, but only the
+ * first one reports errors outside of body.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "xml.h"
+#include "load.h"
+#include "schemacache.h"
+
+#include <libxml/parserInternals.h>
+#include <libxml/relaxng.h>
+#include <libxml/uri.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Chunks end behind the first entry after this many bytes
+#define VALIDATE_CHUNK_SIZE (256 * 1024)
+
+/// Name of the schema that is looked for next to each file
+#define VALIDATE_DEFAULT_SCHEMA "freedict-P5.rng"
+
+struct validate_chunk;
+
+/// A file given on the command line
+struct validate_file
+{
+  const char *filename;
+  GMappedFile *map;
+  const char *buf;
+  gsize len;
+  xmlRelaxNGPtr schema;
+  /// FALSE if the file is validated as a whole, in a single chunk
+  gboolean split;
+  gsize body_start, body_end;
+  guint prologue_newlines;///< Newlines in front of body_start
+  guint body_newlines;///< Newlines between body_start and body_end
+  GArray *cuts;///< Offsets (gsize) behind every entry
+  struct validate_chunk *chunks;
+  guint nchunks;
+  guint pending;///< Chunks not validated yet
+};
+
+/// A range of entries of a file, validated as a document of its own
+struct validate_chunk
+{
+  struct validate_file *file;
+  guint index;
+  guint first, last;///< Indices of the entries in the chunk, last excluded
+  gsize start, end;///< Byte range of the body content
+  guint newlines_before;///< Newlines between body_start and start
+  guint newlines;///< Newlines between start and end
+  GString *errors;
+  guint nerrors;
+  xmlNodePtr body;///< body element of the parsed chunk
+};
+
+/// Protects the pending counts of the files
+static GMutex *validate_mutex;
+/// Signalled when a file has no pending chunks anymore
+static GCond *validate_cond;
+
+
+/////////////////////////////////////////////////////////////////////////
+// Locating errors
+/////////////////////////////////////////////////////////////////////////
+
+/// Whether line @a line of the document of @a c holds chunk content
+/** The first line of the content is also the line of the start tag of
+ * body, the last one that of its end tag.
+ */
+static gboolean validate_in_content(const struct validate_chunk *c, long line)
+{
+  long in_content = line - 1 - c->file->prologue_newlines;
+  return in_content >= 0 && in_content <= c->newlines;
+}
+
+
+/// Line in the file of @a line in the document made of chunk @a c
+static long validate_file_line(const struct validate_chunk *c, long line)
+{
+  const struct validate_file *f = c->file;
+  if(!f->split || line <= f->prologue_newlines) return line;
+  if(validate_in_content(c, line)) return line + c->newlines_before;
+  return line + f->body_newlines - c->newlines;
+}
+
+
+/// Offset in the file where entry number @a i starts
+static gsize validate_entry_offset(const struct validate_file *f, guint i)
+{
+  const char *p = f->buf + (i ? g_array_index(f->cuts, gsize, i - 1)
+      : f->body_start);
+  const char *end = f->buf + f->body_end;
+  // skip whitespace, comments and PIs
+  while((p = memchr(p, '<', end - p)))
+  {
+    if(end - p >= 4 && !memcmp(p, "<!--", 4))
+    {
+      p = g_strstr_len(p, end - p, "-->");
+      if(!p) break;
+    }
+    else if(end - p >= 2 && p[1] == '?')
+    {
+      p = g_strstr_len(p, end - p, "?>");
+      if(!p) break;
+    }
+    else return p - f->buf;
+  }
+  return i ? g_array_index(f->cuts, gsize, i - 1) : f->body_start;
+}
+
+
+/// Appends a report about an error at @a node and @a line to @a c
+/** Errors outside of the chunk content are only reported by the first
+ * chunk.
+ */
+static void validate_report(struct validate_chunk *c, xmlNodePtr node,
+    long line, const char *message)
+{
+  struct validate_file *f = c->file;
+
+  // the child of body that contains node
+  xmlNodePtr entry = NULL;
+  if(node && node->type != XML_NAMESPACE_DECL && c->body)
+    for(entry = node; entry && entry->parent != c->body;
+	entry = entry->parent);
+  if(entry && entry->type != XML_ELEMENT_NODE) entry = NULL;
+  if(f->split && c->index && !entry && node != c->body &&
+      (node || !validate_in_content(c, line)))
+    return;
+
+  gchar *msg = g_strchomp(g_strdup(message ? message : "?"));
+  c->nerrors++;
+  if(!entry)
+  {
+    g_string_append_printf(c->errors, "%s: line %li: %s\n", f->filename,
+	validate_file_line(c, line), msg);
+    g_free(msg);
+    return;
+  }
+
+  guint i = c->first;
+  xmlNodePtr n;
+  for(n = c->body->children; n && n != entry; n = n->next)
+    if(n->type == XML_ELEMENT_NODE) i++;
+
+  char hw[200];
+  if(!entry_orths_to_string(entry, sizeof(hw), hw)) g_strlcpy(hw, "?", 2);
+  if(line <= 0) line = xmlGetLineNo(entry);
+  g_string_append_printf(c->errors, "%s:%lu: line %li: entry \"%s\": %s\n",
+      f->filename, (unsigned long) validate_entry_offset(f, i),
+      validate_file_line(c, line), hw, msg);
+  g_free(msg);
+}
+
+
+/// Structured error handler for the parser
+static void validate_parse_error(void *userData, xmlErrorPtr error)
+{
+  xmlParserCtxtPtr ctxt = userData;
+  if(error->level < XML_ERR_ERROR) return;
+  validate_report(ctxt->_private, NULL, error->line, error->message);
+}
+
+
+/// Structured error handler for the RelaxNG validation
+static void validate_schema_error(void *userData, xmlErrorPtr error)
+{
+  validate_report(userData, error->node, error->line, error->message);
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+// Validating chunks
+/////////////////////////////////////////////////////////////////////////
+
+/// First element called "body" in document order
+static xmlNodePtr validate_find_body(xmlNodePtr n)
+{
+  for(; n; n = n->next)
+  {
+    if(n->type != XML_ELEMENT_NODE) continue;
+    if(!strcmp((char *) n->name, "body")) return n;
+    xmlNodePtr b = validate_find_body(n->children);
+    if(b) return b;
+  }
+  return NULL;
+}
+
+
+/// Thread pool function: parses and validates one chunk
+static void validate_chunk(gpointer data, gpointer user_data)
+{
+  struct validate_chunk *c = data;
+  struct validate_file *f = c->file;
+
+  GString *buf = NULL;
+  if(f->split)
+  {
+    buf = g_string_sized_new(f->body_start + c->end - c->start +
+	f->len - f->body_end);
+    g_string_append_len(buf, f->buf, f->body_start);
+    g_string_append_len(buf, f->buf + c->start, c->end - c->start);
+    g_string_append_len(buf, f->buf + f->body_end, f->len - f->body_end);
+  }
+
+  xmlParserCtxtPtr ctxt = buf ? xmlCreateMemoryParserCtxt(buf->str, buf->len)
+    : xmlCreateMemoryParserCtxt(f->buf, f->len);
+  xmlDocPtr doc = NULL;
+  if(ctxt)
+  {
+    // base for the DTD and line numbers beyond 65535
+    ctxt->input->filename = (char *) xmlCanonicPath((xmlChar *) f->filename);
+    xmlCtxtUseOptions(ctxt, XML_PARSE_NOENT | XML_PARSE_DTDLOAD |
+	XML_PARSE_NONET | XML_PARSE_BIG_LINES);
+    schema_cache_use(ctxt);
+    ctxt->_private = c;
+    ctxt->sax->serror = validate_parse_error;
+    xmlParseDocument(ctxt);
+    doc = ctxt->myDoc;
+    if(doc && !ctxt->wellFormed)
+    {
+      xmlFreeDoc(doc);
+      doc = NULL;
+    }
+    ctxt->myDoc = NULL;
+    xmlFreeParserCtxt(ctxt);
+  }
+  if(buf) g_string_free(buf, TRUE);
+
+  if(doc)
+  {
+    c->body = validate_find_body(doc->children);
+    xmlRelaxNGValidCtxtPtr vctxt = xmlRelaxNGNewValidCtxt(f->schema);
+    xmlRelaxNGSetValidStructuredErrors(vctxt, validate_schema_error, c);
+    xmlRelaxNGValidateDoc(vctxt, doc);
+    xmlRelaxNGFreeValidCtxt(vctxt);
+    c->body = NULL;
+    xmlFreeDoc(doc);
+  }
+
+  g_mutex_lock(validate_mutex);
+  if(!--f->pending) g_cond_broadcast(validate_cond);
+  g_mutex_unlock(validate_mutex);
+}
+
+
+/// Map @a f and cut it into chunks
+static gboolean validate_prepare_file(struct validate_file *f)
+{
+  f->map = g_mapped_file_new(f->filename, FALSE, NULL);
+  if(!f->map) return FALSE;
+  f->buf = g_mapped_file_get_contents(f->map);
+  f->len = g_mapped_file_get_length(f->map);
+
+  gsize root_start;
+  f->cuts = g_array_new(FALSE, FALSE, sizeof(gsize));
+  f->split = f->len && load_split_entries(f->buf, f->len, &root_start,
+      &f->body_start, &f->body_end, f->cuts, TRUE) && f->cuts->len;
+  if(!f->split)
+  {
+    f->nchunks = 1;
+    f->chunks = g_new0(struct validate_chunk, 1);
+    f->chunks[0].file = f;
+    f->chunks[0].errors = g_string_new(NULL);
+    return TRUE;
+  }
+
+  // the last chunk takes what follows the last entry as well
+  GArray *chunks = g_array_new(FALSE, TRUE, sizeof(struct validate_chunk));
+  struct validate_chunk c;
+  memset(&c, 0, sizeof(c));
+  c.file = f;
+  c.start = f->body_start;
+  guint i;
+  for(i = 0; i < f->cuts->len; i++)
+  {
+    gsize cut = g_array_index(f->cuts, gsize, i);
+    gboolean last = i + 1 == f->cuts->len;
+    if(!last && cut - c.start < VALIDATE_CHUNK_SIZE) continue;
+    c.end = last ? f->body_end : cut;
+    c.last = i + 1;
+    g_array_append_val(chunks, c);
+    c.index++;
+    c.first = c.last;
+    c.start = c.end;
+  }
+
+  const char *p;
+  for(p = f->buf; (p = memchr(p, '\n', f->buf + f->body_start - p)); p++)
+    f->prologue_newlines++;
+
+  // line numbers, counted from body_start
+  guint newlines = 0;
+  for(i = 0; i < chunks->len; i++)
+  {
+    struct validate_chunk *ch = &g_array_index(chunks, struct validate_chunk, i);
+    ch->newlines_before = newlines;
+    for(p = f->buf + ch->start; (p = memchr(p, '\n', f->buf + ch->end - p)); p++)
+      ch->newlines++;
+    newlines += ch->newlines;
+    ch->errors = g_string_new(NULL);
+  }
+  f->body_newlines = newlines;
+
+  f->nchunks = chunks->len;
+  f->chunks = (struct validate_chunk *) g_array_free(chunks, FALSE);
+  return TRUE;
+}
+
+
+static void validate_free_file(struct validate_file *f)
+{
+  guint i;
+  for(i = 0; i < f->nchunks; i++) g_string_free(f->chunks[i].errors, TRUE);
+  g_free(f->chunks);
+  if(f->cuts) g_array_free(f->cuts, TRUE);
+  if(f->map) g_mapped_file_free(f->map);
+}
+
+
+int main(int argc, char *argv[])
+{
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *schema = NULL;
+  int i = 1;
+  for(; i < argc && argv[i][0] == '-'; i++)
+  {
+    if(!strcmp(argv[i], "-j") && i + 1 < argc) threads = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-s") && i + 1 < argc) schema = argv[++i];
+    else break;
+  }
+  if(i >= argc || argv[i][0] == '-' || threads < 1)
+  {
+    g_printerr("Usage: %s [-j THREADS] [-s SCHEMA] dictionary.tei...\n"
+	"Validates TEI files against a RelaxNG schema, by default against\n"
+	VALIDATE_DEFAULT_SCHEMA " in the directory of each file.\n", argv[0]);
+    return 2;
+  }
+
+  LIBXML_TEST_VERSION
+  xmlInitParser();
+  if(!g_thread_supported()) g_thread_init(NULL);
+  find_nodeset_pcontext_mutex = g_mutex_new();
+  validate_mutex = g_mutex_new();
+  validate_cond = g_cond_new();
+
+  int nfiles = argc - i;
+  struct validate_file *files = g_new0(struct validate_file, nfiles);
+  GThreadPool *pool = g_thread_pool_new(validate_chunk, NULL, threads,
+      FALSE, NULL);
+
+  // all chunks of all files go into the pool right away
+  int f;
+  guint c;
+  for(f = 0; f < nfiles; f++)
+  {
+    struct validate_file *file = &files[f];
+    file->filename = argv[i + f];
+    if(schema) file->schema = schema_cache_relaxng(schema);
+    else
+    {
+      gchar *dir = g_path_get_dirname(file->filename);
+      gchar *rng = g_build_filename(dir, VALIDATE_DEFAULT_SCHEMA, NULL);
+      file->schema = schema_cache_relaxng(rng);
+      g_free(rng);
+      g_free(dir);
+    }
+    if(!file->schema || !validate_prepare_file(file)) continue;
+
+    file->pending = file->nchunks;
+    for(c = 0; c < file->nchunks; c++)
+      g_thread_pool_push(pool, &file->chunks[c], NULL);
+  }
+
+  // report in the order of the command line
+  int invalid = 0;
+  for(f = 0; f < nfiles; f++)
+  {
+    struct validate_file *file = &files[f];
+    if(!file->schema || !file->chunks)
+    {
+      g_printerr("%s: %s\n", file->filename, file->schema ?
+	  "could not be read" : "no schema");
+      invalid++;
+      validate_free_file(file);
+      continue;
+    }
+
+    g_mutex_lock(validate_mutex);
+    while(file->pending) g_cond_wait(validate_cond, validate_mutex);
+    g_mutex_unlock(validate_mutex);
+
+    guint nerrors = 0;
+    for(c = 0; c < file->nchunks; c++)
+    {
+      g_print("%s", file->chunks[c].errors->str);
+      nerrors += file->chunks[c].nerrors;
+    }
+    if(nerrors) invalid++;
+    g_print("%s: %s (%u entries, %u chunks)\n", file->filename,
+	nerrors ? "invalid" : "valid",
+	file->split ? file->cuts->len : 0, file->nchunks);
+    validate_free_file(file);
+  }
+
+  g_thread_pool_free(pool, FALSE, TRUE);
+  g_free(files);
+  xmlCleanupParser();
+  return invalid ? 1 : 0;
+}
@@ -0,0 +1,265 @@
+/** @file
+ * @brief Reading the document in other threads while the user edits it
+ *
+ * A reader (XPath evaluation, the sanity checks, the spell checker) pins
+ * the current version of the document before it starts walking it.  Edits
+ * never change a node that might be visible to a reader.  Instead the
+ * changed entry is copied, the copy is linked in place of the old node, and
+ * the old node is retired: it stays allocated, with its own sibling and
+ * parent pointers intact, until every reader that was pinned before the
+ * change has finished.  A reader therefore sees either the old or the new
+ * version of an entry, but never freed memory.
+ *
+ * Linking is done so that a reader walking the tree at the same time always
+ * finds a consistent chain: the new node is set up completely before the
+ * single pointer that makes it reachable is published.
+ *
+ * Edits, pinning and unpinning happen in the GUI thread.  A worker thread
+ * inherits the pin of the code that started it, so retired nodes are only
+ * ever freed in the GUI thread, where libxml2's dictionary is used.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "versions.h"
+
+/// A node that was replaced or removed, but may still be in use
+struct retired_node
+{
+  xmlNodePtr node;
+  guint version;///< first version of the document without @a node
+};
+
+static GStaticMutex versions_mutex = G_STATIC_MUTEX_INIT;
+
+/// Incremented for every change of the tree structure
+static guint current_version = 1;
+
+/// Versions held by readers, one list item per reader
+static GSList *pinned_versions;
+
+/// Retired nodes, oldest first
+static GSList *retired_nodes;
+
+
+/// Free the retired nodes that no pinned reader can reach anymore
+static void doc_reclaim(void)
+{
+  g_static_mutex_lock(&versions_mutex);
+  guint oldest = current_version;
+  GSList *l;
+  for(l = pinned_versions; l; l = l->next)
+    oldest = MIN(oldest, GPOINTER_TO_UINT(l->data));
+
+  GSList *reclaim = NULL;
+  while(retired_nodes &&
+      ((struct retired_node *) retired_nodes->data)->version <= oldest)
+  {
+    reclaim = g_slist_prepend(reclaim, retired_nodes->data);
+    retired_nodes = g_slist_delete_link(retired_nodes, retired_nodes);
+  }
+  g_static_mutex_unlock(&versions_mutex);
+
+  for(l = reclaim; l; l = l->next)
+  {
+    struct retired_node *r = l->data;
+    // the links of a retired node still point into the document,
+    // but xmlFreeNode() does not follow them
+    r->node->parent = r->node->prev = r->node->next = NULL;
+    xmlFreeNode(r->node);
+    g_slice_free(struct retired_node, r);
+  }
+  g_slist_free(reclaim);
+}
+
+
+/// Finish a change of the tree: new readers will not see @a n anymore
+static void doc_retire_node(xmlNodePtr n)
+{
+  struct retired_node *r = g_slice_new(struct retired_node);
+  r->node = n;
+
+  g_static_mutex_lock(&versions_mutex);
+  r->version = ++current_version;
+  retired_nodes = g_slist_append(retired_nodes, r);
+  g_static_mutex_unlock(&versions_mutex);
+
+  doc_reclaim();
+}
+
+
+/// Announce that the caller is going to read the document
+/**
+ * Until the matching doc_reader_unpin(), no node reachable from the
+ * document at this moment is freed.  The pin may be handed to a worker
+ * thread, but it has to be taken and released in the GUI thread.
+ *
+ * @return the pinned version, to be passed to doc_reader_unpin()
+ */
+guint doc_reader_pin(void)
+{
+  g_static_mutex_lock(&versions_mutex);
+  guint version = current_version;
+  pinned_versions = g_slist_prepend(pinned_versions,
+      GUINT_TO_POINTER(version));
+  g_static_mutex_unlock(&versions_mutex);
+  return version;
+}
+
+
+/// Release a pin of doc_reader_pin() and free what is not in use anymore
+void doc_reader_unpin(guint version)
+{
+  g_static_mutex_lock(&versions_mutex);
+  pinned_versions = g_slist_remove(pinned_versions,
+      GUINT_TO_POINTER(version));
+  g_static_mutex_unlock(&versions_mutex);
+  doc_reclaim();
+}
+
+
+/// Whether some reader holds a pin
+/**
+ * Changes that rearrange many nodes at once (like patching the document
+ * after the file changed on disk) cannot be done reader-safe and have to
+ * wait until this returns FALSE.
+ */
+gboolean doc_readers_active(void)
+{
+  g_static_mutex_lock(&versions_mutex);
+  gboolean active = pinned_versions != NULL;
+  g_static_mutex_unlock(&versions_mutex);
+  return active;
+}
+
+
+/// The current version of the document, it only ever grows
+guint doc_version(void)
+{
+  g_static_mutex_lock(&versions_mutex);
+  guint version = current_version;
+  g_static_mutex_unlock(&versions_mutex);
+  return version;
+}
+
+
+/// Whether the tree structure changed after doc_reader_pin() returned @a version
+gboolean doc_changed_since(guint version)
+{
+  g_static_mutex_lock(&versions_mutex);
+  gboolean changed = current_version != version;
+  g_static_mutex_unlock(&versions_mutex);
+  return changed;
+}
+
+
+/// Whether @a n is still part of its document
+/**
+ * A retired node keeps its links, but it is not the successor of its
+ * predecessor anymore (or the first child of its parent), and neither are
+ * the nodes below it.  Only valid while the caller holds a pin that is at
+ * least as old as @a n, otherwise @a n may be freed already.
+ */
+gboolean doc_node_is_live(xmlNodePtr n)
+{
+  // XPath node sets keep namespace nodes as copies that point to the element
+  if(n && n->type == XML_NAMESPACE_DECL) n = (xmlNodePtr) ((xmlNsPtr) n)->next;
+  for(; n && n->parent; n = n->parent)
+  {
+    if(n->prev) { if(n->prev->next != n) return FALSE; }
+    else if(n->type == XML_ATTRIBUTE_NODE)
+    { if((xmlNodePtr) n->parent->properties != n) return FALSE; }
+    else if(n->parent->children != n) return FALSE;
+  }
+  return n && n->type == XML_DOCUMENT_NODE;
+}
+
+
+/// Make @a n reachable from @a prev or @a parent
+static void doc_publish(xmlNodePtr parent, xmlNodePtr prev, xmlNodePtr n)
+{
+  if(prev) g_atomic_pointer_set((gpointer *) &prev->next, n);
+  else g_atomic_pointer_set((gpointer *) &parent->children, n);
+}
+
+
+/// Replace @a old with @a cur and retire @a old
+/**
+ * Unlike xmlReplaceNode(), @a old keeps its links, so a reader that is
+ * currently positioned on it continues with the right sibling.
+ * @a cur must not be part of the document yet.
+ */
+void doc_replace_node(xmlNodePtr old, xmlNodePtr cur)
+{
+  g_return_if_fail(old && old->parent);
+  g_return_if_fail(cur);
+
+  // not visible to readers yet, eg. the root of a scratch document
+  if(cur->parent) xmlUnlinkNode(cur);
+  xmlNodePtr parent = old->parent;
+  if(cur->doc != parent->doc) xmlSetTreeDoc(cur, parent->doc);
+  cur->parent = parent;
+  cur->prev = old->prev;
+  cur->next = old->next;
+
+  doc_publish(parent, old->prev, cur);
+  if(old->next) g_atomic_pointer_set((gpointer *) &old->next->prev, cur);
+  else g_atomic_pointer_set((gpointer *) &parent->last, cur);
+
+  doc_retire_node(old);
+}
+
+
+/// Unlink @a n from the document and retire it
+void doc_remove_node(xmlNodePtr n)
+{
+  g_return_if_fail(n && n->parent);
+
+  xmlNodePtr parent = n->parent;
+  if(n->prev) g_atomic_pointer_set((gpointer *) &n->prev->next, n->next);
+  else g_atomic_pointer_set((gpointer *) &parent->children, n->next);
+  if(n->next) g_atomic_pointer_set((gpointer *) &n->next->prev, n->prev);
+  else g_atomic_pointer_set((gpointer *) &parent->last, n->prev);
+
+  doc_retire_node(n);
+}
+
+
+/// Append @a n as last child of @a parent
+/**
+ * Unlike xmlAddChild(), adjacent text nodes are not merged, so @a n
+ * is always the node that was passed in.
+ */
+void doc_add_child(xmlNodePtr parent, xmlNodePtr n)
+{
+  g_return_if_fail(parent);
+  g_return_if_fail(n);
+
+  if(n->parent) xmlUnlinkNode(n);
+  if(n->doc != parent->doc) xmlSetTreeDoc(n, parent->doc);
+  n->parent = parent;
+  n->prev = parent->last;
+  n->next = NULL;
+
+  doc_publish(parent, parent->last, n);
+  g_atomic_pointer_set((gpointer *) &parent->last, n);
+
+  g_static_mutex_lock(&versions_mutex);
+  current_version++;
+  g_static_mutex_unlock(&versions_mutex);
+}
+
+
+/// Announce a change that was made without the functions above
+/** This is only allowed while doc_readers_active() is FALSE.  Freed nodes
+ * are not retired, so whoever remembers nodes of the document by version
+ * has to forget them.
+ */
+void doc_changed_unsafely(void)
+{
+  g_static_mutex_lock(&versions_mutex);
+  current_version++;
+  g_static_mutex_unlock(&versions_mutex);
+}
@@ -0,0 +1,14 @@
+#include <libxml/tree.h>
+#include <glib.h>
+
+// Readers that run concurrently with editing, and retiring replaced nodes
+guint    doc_reader_pin(void);
+void     doc_reader_unpin(guint version);
+gboolean doc_readers_active(void);
+guint    doc_version(void);
+gboolean doc_changed_since(guint version);
+gboolean doc_node_is_live(xmlNodePtr n);
+void     doc_replace_node(xmlNodePtr old, xmlNodePtr cur);
+void     doc_remove_node(xmlNodePtr n);
+void     doc_add_child(xmlNodePtr parent, xmlNodePtr n);
+void     doc_changed_unsafely(void);
@@ -0,0 +1,867 @@
+/** @file
+ * @brief Noticing changes of the opened file on disk and reloading them
+ *
+ * When a file is loaded or saved, we remember a fingerprint (a hash of the
+ * bytes in the file) of every element in body, together with the text and
+ * comments in front of it.  An inotify watch on the directory of the file
+ * tells us when the file is rewritten or replaced.  We then hash the entries
+ * of the new file and reparse only those whose fingerprint we don't know.
+ *
+ * Entries edited in the editor are remembered with the fingerprint they had
+ * on disk.  If that fingerprint is still in the file, the local version is
+ * kept without asking.  Only if an entry was changed both on disk and in the
+ * editor, the user has to decide.
+ *
+ * Changes outside of body, like in the header, make us reload the whole file
+ * (after asking, if there are local changes).
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gnome.h>
+
+#include "watch.h"
+#include "edits.h"
+#include "load.h"
+#include "save.h"
+#include "utils.h"
+#include "versions.h"
+#include "xml.h"
+
+#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+#  include <sys/inotify.h>
+#endif
+#include <unistd.h>
+
+extern gboolean form_modified;
+void myload(const char *filename);
+
+static void watch_entry_modified(const xmlNodePtr n);
+
+/// Time to wait for more events before looking at the file
+#define WATCH_SETTLE_MS 500
+
+/// Fingerprints of the entries on disk that were not edited locally
+/** Maps xmlNodePtr to guint64 *
+ */
+static GHashTable *clean_entries;
+
+/// Entries edited or added locally
+/** Maps xmlNodePtr to guint64 * with the fingerprint the entry had on disk,
+ * 0 for entries that were added locally.
+ */
+static GHashTable *dirty_entries;
+
+/// An entry deleted in the editor, but not yet on disk
+struct watch_deleted
+{
+  guint64 fp;
+  gchar *headwords;
+};
+static GSList *deleted_entries;
+
+/// Whether the tables above describe the file on disk
+static gboolean fingerprints_valid;
+static guint64 prologue_fp, epilogue_fp, tail_fp;
+static xmlNodePtr watched_body;
+static gchar *watched_filename;
+static guint settle_timeout_id;
+
+#ifdef __linux__
+static int inotify_fd = -1, inotify_wd = -1;
+#endif
+
+/// The new file split into entries
+struct watch_scan
+{
+  gchar *contents;
+  gsize len, root_start, body_start, body_end;
+  GArray *cuts;///< Offsets (gsize) behind each element in body
+  GArray *fps;///< Fingerprint (guint64) of the text up to each cut
+  guint64 prologue_fp, epilogue_fp, tail_fp;
+};
+
+/// Elements of body together with the nodes in front of them
+struct watch_unit
+{
+  xmlNodePtr first, entry;
+  guint64 fp;///< Fingerprint on disk
+  gboolean parsed;///< Taken from the new file
+  gboolean dirty;///< Edited locally
+  gboolean used;
+};
+
+
+/// 64 bit FNV-1a hash
+static guint64 watch_fingerprint(const char *p, gsize len)
+{
+  guint64 h = G_GUINT64_CONSTANT(14695981039346656037);
+  const char *end = p + len;
+  for(; p < end; p++)
+  {
+    h ^= (guchar) *p;
+    h *= G_GUINT64_CONSTANT(1099511628211);
+  }
+  return h;
+}
+
+
+static guint64 *watch_fp_new(guint64 fp)
+{
+  guint64 *p = g_new(guint64, 1);
+  *p = fp;
+  return p;
+}
+
+
+static void watch_deleted_free(struct watch_deleted *d)
+{
+  g_free(d->headwords);
+  g_free(d);
+}
+
+
+static gchar *watch_headwords(const xmlNodePtr n)
+{
+  char s[200];
+  entry_orths_to_string(n, sizeof(s), s);
+  return g_strdup(s);
+}
+
+
+static void watch_clear_entries(void)
+{
+  if(!clean_entries)
+  {
+    clean_entries = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+	NULL, g_free);
+    dirty_entries = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+	NULL, g_free);
+  }
+  g_hash_table_remove_all(clean_entries);
+  g_hash_table_remove_all(dirty_entries);
+  g_slist_foreach(deleted_entries, (GFunc) watch_deleted_free, NULL);
+  g_slist_free(deleted_entries);
+  deleted_entries = NULL;
+  fingerprints_valid = FALSE;
+}
+
+
+static void watch_scan_free(struct watch_scan *ws)
+{
+  g_free(ws->contents);
+  g_array_free(ws->cuts, TRUE);
+  g_array_free(ws->fps, TRUE);
+}
+
+
+/// Read @a filename and compute the fingerprints of its entries
+static gboolean watch_scan_file(const char *filename, struct watch_scan *ws)
+{
+  memset(ws, 0, sizeof(*ws));
+  ws->cuts = g_array_new(FALSE, FALSE, sizeof(gsize));
+  ws->fps = g_array_new(FALSE, FALSE, sizeof(guint64));
+  if(!g_file_get_contents(filename, &ws->contents, &ws->len, NULL) ||
+      !load_split_entries(ws->contents, ws->len, &ws->root_start,
+	&ws->body_start, &ws->body_end, ws->cuts, FALSE))
+  {
+    watch_scan_free(ws);
+    return FALSE;
+  }
+
+  gsize start = ws->body_start;
+  int i;
+  for(i = 0; i < ws->cuts->len; i++)
+  {
+    gsize end = g_array_index(ws->cuts, gsize, i);
+    guint64 fp = watch_fingerprint(ws->contents + start, end - start);
+    g_array_append_val(ws->fps, fp);
+    start = end;
+  }
+  ws->tail_fp = watch_fingerprint(ws->contents + start, ws->body_end - start);
+  ws->prologue_fp = watch_fingerprint(ws->contents, ws->body_start);
+  ws->epilogue_fp = watch_fingerprint(ws->contents + ws->body_end,
+      ws->len - ws->body_end);
+  return TRUE;
+}
+
+
+/// Offset of segment @a i of @a ws, the tail has index cuts->len
+static void watch_segment(const struct watch_scan *ws, guint i,
+    gsize *start, gsize *end)
+{
+  *start = i ? g_array_index(ws->cuts, gsize, i - 1) : ws->body_start;
+  *end = i < ws->cuts->len ? g_array_index(ws->cuts, gsize, i)
+    : ws->body_end;
+}
+
+
+/// Split the children of @a parent into units, returns the trailing nodes
+static xmlNodePtr watch_units(xmlNodePtr parent, GArray *units,
+    gboolean parsed)
+{
+  xmlNodePtr n, first = NULL;
+  for(n = parent->children; n; n = n->next)
+  {
+    if(!first) first = n;
+    if(n->type != XML_ELEMENT_NODE) continue;
+
+    struct watch_unit u;
+    memset(&u, 0, sizeof(u));
+    u.first = first;
+    u.entry = n;
+    u.parsed = parsed;
+    g_array_append_val(units, u);
+    first = NULL;
+  }
+  return first;
+}
+
+
+/// Remember the fingerprints of @a ws for the elements of body
+static void watch_set_fingerprints(const struct watch_scan *ws)
+{
+  watch_clear_entries();
+  GArray *units = g_array_new(FALSE, FALSE, sizeof(struct watch_unit));
+  watch_units(watched_body, units, FALSE);
+  if(units->len == ws->fps->len)
+  {
+    int i;
+    for(i = 0; i < units->len; i++)
+      g_hash_table_insert(clean_entries,
+	  g_array_index(units, struct watch_unit, i).entry,
+	  watch_fp_new(g_array_index(ws->fps, guint64, i)));
+    prologue_fp = ws->prologue_fp;
+    epilogue_fp = ws->epilogue_fp;
+    tail_fp = ws->tail_fp;
+    fingerprints_valid = TRUE;
+  }
+  else g_printerr("Entries in %s don't match the document\n",
+      watched_filename);
+  g_array_free(units, TRUE);
+}
+
+
+/// Ask the user a yes/no question about the entry with @a headwords
+static gboolean watch_ask(const char *format, const char *headwords)
+{
+  GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(app1),
+      GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+      GTK_MESSAGE_QUESTION, GTK_BUTTONS_YES_NO, format, headwords);
+  gint result = gtk_dialog_run(GTK_DIALOG(dialog));
+  gtk_widget_destroy(dialog);
+  return result == GTK_RESPONSE_YES;
+}
+
+
+/// The file changed in a way we can't patch, so offer to reload it
+static void watch_full_reload(void)
+{
+  if((file_modified || form_modified) &&
+      !watch_ask(_("%s was changed on disk. Reload it and lose your "
+	  "changes?"), watched_filename))
+    return;
+
+  gchar *filename = g_strdup(watched_filename);
+  myload(filename);
+  g_free(filename);
+  mystatus(_("Reloaded the file, it was changed on disk."));
+}
+
+
+/// Register the ID attributes below @a n with @a doc
+/** Moving @a n between documents resets the type of its attributes, so
+ * the DTD of @a doc is asked.
+ */
+static void watch_add_ids(const xmlDocPtr doc, xmlNodePtr n)
+{
+  for(; n; n = n->next)
+  {
+    if(n->type != XML_ELEMENT_NODE) continue;
+    xmlAttrPtr a;
+    for(a = n->properties; a; a = a->next)
+    {
+      if(!xmlIsID(doc, n, a)) continue;
+      xmlChar *id = xmlNodeListGetString(doc, a->children, 1);
+      if(id && !xmlGetID(doc, id)) xmlAddID(NULL, doc, id, a);
+      xmlFree(id);
+    }
+    watch_add_ids(doc, n->children);
+  }
+}
+
+
+/// Index of the parsed unit in @a result with @a headwords, -1 if none
+static int watch_find_parsed(GArray *result, const char *headwords)
+{
+  int i;
+  for(i = 0; i < result->len; i++)
+  {
+    struct watch_unit *u = &g_array_index(result, struct watch_unit, i);
+    if(!u->parsed || u->used) continue;
+    gchar *hw = watch_headwords(u->entry);
+    gboolean same = !strcmp(hw, headwords);
+    g_free(hw);
+    if(same) return i;
+  }
+  return -1;
+}
+
+
+/// Put the nodes of @a u into @a order
+static void watch_collect_nodes(const struct watch_unit *u, GPtrArray *order)
+{
+  xmlNodePtr n;
+  for(n = u->first; n != u->entry; n = n->next) g_ptr_array_add(order, n);
+  g_ptr_array_add(order, u->entry);
+}
+
+
+/// Bring the document in line with the file in @a ws, entry by entry
+/** @retval FALSE the new entries can't be parsed, the caller should reload
+ * the whole file
+ */
+static gboolean watch_patch(struct watch_scan *ws)
+{
+  // the form may contain changes that are not in the document yet
+  if(form_modified && edited_node) watch_entry_modified(edited_node);
+
+  GArray *olds = g_array_new(FALSE, FALSE, sizeof(struct watch_unit));
+  xmlNodePtr old_tail = watch_units(watched_body, olds, FALSE);
+
+  // fingerprint on disk -> queue of indices into olds
+  GHashTable *clean_by_fp = g_hash_table_new_full(g_int64_hash,
+      g_int64_equal, NULL, (GDestroyNotify) g_queue_free);
+  GHashTable *dirty_by_fp = g_hash_table_new_full(g_int64_hash,
+      g_int64_equal, NULL, (GDestroyNotify) g_queue_free);
+  int i;
+  for(i = 0; i < olds->len; i++)
+  {
+    struct watch_unit *u = &g_array_index(olds, struct watch_unit, i);
+    guint64 *fp = g_hash_table_lookup(clean_entries, u->entry);
+    GHashTable *by_fp = clean_by_fp;
+    if(!fp)
+    {
+      fp = g_hash_table_lookup(dirty_entries, u->entry);
+      u->dirty = TRUE;
+      by_fp = dirty_by_fp;
+    }
+    // locally added
+    if(!fp || !*fp) continue;
+    u->fp = *fp;
+    GQueue *q = g_hash_table_lookup(by_fp, &u->fp);
+    if(!q) g_hash_table_insert(by_fp, &u->fp, q = g_queue_new());
+    g_queue_push_tail(q, GINT_TO_POINTER(i));
+  }
+
+  // walk the new file, reuse what we know and collect the rest for parsing
+  GArray *result = g_array_new(FALSE, FALSE, sizeof(struct watch_unit));
+  GArray *to_parse = g_array_new(FALSE, FALSE, sizeof(guint));
+  GHashTable *new_fps = g_hash_table_new(g_int64_hash, g_int64_equal);
+  for(i = 0; i < ws->fps->len; i++)
+  {
+    guint64 *fp = &g_array_index(ws->fps, guint64, i);
+    g_hash_table_insert(new_fps, fp, fp);
+    GQueue *q = g_hash_table_lookup(clean_by_fp, fp);
+    if(!q || g_queue_is_empty(q)) q = g_hash_table_lookup(dirty_by_fp, fp);
+    if(q && !g_queue_is_empty(q))
+    {
+      int o = GPOINTER_TO_INT(g_queue_pop_head(q));
+      struct watch_unit *u = &g_array_index(olds, struct watch_unit, o);
+      u->used = TRUE;
+      g_array_append_val(result, *u);
+      continue;
+    }
+
+    // deleted in the editor, unchanged on disk
+    GSList *l;
+    for(l = deleted_entries; l; l = l->next)
+      if(((struct watch_deleted *) l->data)->fp == *fp) break;
+    if(l)
+    {
+      watch_deleted_free(l->data);
+      deleted_entries = g_slist_delete_link(deleted_entries, l);
+      continue;
+    }
+
+    struct watch_unit u;
+    memset(&u, 0, sizeof(u));
+    u.fp = *fp;
+    u.parsed = TRUE;
+    g_array_append_val(result, u);
+    guint seg = i;
+    g_array_append_val(to_parse, seg);
+  }
+  g_hash_table_destroy(clean_by_fp);
+  g_hash_table_destroy(dirty_by_fp);
+
+  // nothing changed on disk, for example after our own save
+  gboolean unchanged = !to_parse->len && ws->tail_fp == tail_fp &&
+    !deleted_entries && result->len == olds->len;
+  for(i = 0; unchanged && i < result->len; i++)
+    unchanged = g_array_index(result, struct watch_unit, i).entry ==
+      g_array_index(olds, struct watch_unit, i).entry;
+  if(unchanged)
+  {
+    g_hash_table_destroy(new_fps);
+    g_array_free(to_parse, TRUE);
+    g_array_free(result, TRUE);
+    g_array_free(olds, TRUE);
+    return TRUE;
+  }
+
+  // parse all new entries in one go, in the context of the DTD
+  gboolean new_tail = ws->tail_fp != tail_fp;
+  xmlDocPtr parsed = NULL;
+  xmlNodePtr parsed_tail = NULL;
+  if(to_parse->len || new_tail)
+  {
+    GString *content = g_string_new(NULL);
+    gsize start, end;
+    for(i = 0; i < to_parse->len; i++)
+    {
+      watch_segment(ws, g_array_index(to_parse, guint, i), &start, &end);
+      g_string_append_len(content, ws->contents + start, end - start);
+    }
+    if(new_tail)
+    {
+      watch_segment(ws, ws->cuts->len, &start, &end);
+      g_string_append_len(content, ws->contents + start, end - start);
+    }
+    parsed = load_parse_body_content(ws->contents, ws->root_start,
+	content->str, content->len, watched_filename, load_parser_options());
+    g_string_free(content, TRUE);
+
+    GArray *punits = g_array_new(FALSE, FALSE, sizeof(struct watch_unit));
+    xmlNodePtr root = parsed ? xmlDocGetRootElement(parsed) : NULL;
+    if(root) parsed_tail = watch_units(root, punits, TRUE);
+    if(!root || punits->len != to_parse->len)
+    {
+      g_array_free(punits, TRUE);
+      if(parsed) xmlFreeDoc(parsed);
+      g_hash_table_destroy(new_fps);
+      g_array_free(to_parse, TRUE);
+      g_array_free(result, TRUE);
+      g_array_free(olds, TRUE);
+      return FALSE;
+    }
+
+    int j = 0;
+    for(i = 0; i < result->len; i++)
+    {
+      struct watch_unit *u = &g_array_index(result, struct watch_unit, i);
+      if(!u->parsed) continue;
+      struct watch_unit *p = &g_array_index(punits, struct watch_unit, j++);
+      u->first = p->first;
+      u->entry = p->entry;
+    }
+    g_array_free(punits, TRUE);
+  }
+  guint nparsed = to_parse->len;
+  g_array_free(to_parse, TRUE);
+
+  // entries changed on disk and in the editor
+  int conflicts = 0;
+  for(i = 0; i < olds->len; i++)
+  {
+    struct watch_unit *d = &g_array_index(olds, struct watch_unit, i);
+    if(d->used || !d->dirty) continue;
+
+    gboolean keep = TRUE;
+    int pos;
+    if(d->fp)
+    {
+      gchar *hw = watch_headwords(d->entry);
+      int p = watch_find_parsed(result, hw);
+      conflicts++;
+      if(p >= 0)
+      {
+	struct watch_unit *pu = &g_array_index(result, struct watch_unit, p);
+	pu->used = TRUE;
+	if(watch_ask(_("The entry \"%s\" was changed on disk and in the "
+		"editor. Keep the version of the editor?"), hw))
+	{
+	  // the disk version stays in the wrapper doc and is freed with it
+	  d->used = TRUE;
+	  d->fp = pu->fp;
+	  *pu = *d;
+	}
+	g_free(hw);
+	continue;
+      }
+      keep = watch_ask(_("The entry \"%s\" was deleted on disk, but changed "
+	    "in the editor. Keep it?"), hw);
+      g_free(hw);
+    }
+    if(!keep) continue;
+
+    // keep it behind its old predecessor
+    d->used = TRUE;
+    d->fp = 0;
+    pos = 0;
+    int k, r;
+    for(k = i - 1; k >= 0 && !pos; k--)
+      for(r = 0; r < result->len; r++)
+	if(g_array_index(result, struct watch_unit, r).entry ==
+	    g_array_index(olds, struct watch_unit, k).entry)
+	{
+	  pos = r + 1;
+	  break;
+	}
+    g_array_insert_val(result, pos, *d);
+  }
+
+  // entries deleted in the editor and changed on disk
+  GSList *l;
+  for(l = deleted_entries; l; )
+  {
+    struct watch_deleted *del = l->data;
+    l = l->next;
+    if(g_hash_table_lookup(new_fps, &del->fp)) continue;
+
+    int p = watch_find_parsed(result, del->headwords);
+    if(p >= 0)
+    {
+      conflicts++;
+      g_array_index(result, struct watch_unit, p).used = TRUE;
+      if(watch_ask(_("The entry \"%s\" was changed on disk, but deleted in "
+	      "the editor. Delete it?"), del->headwords))
+      {
+	del->fp = g_array_index(result, struct watch_unit, p).fp;
+	g_array_remove_index(result, p);
+      }
+      else
+      {
+	deleted_entries = g_slist_remove(deleted_entries, del);
+	watch_deleted_free(del);
+      }
+    }
+    else
+    {
+      // deleted on both sides
+      deleted_entries = g_slist_remove(deleted_entries, del);
+      watch_deleted_free(del);
+    }
+  }
+  g_hash_table_destroy(new_fps);
+
+  // collect the new list of children of body
+  GPtrArray *order = g_ptr_array_new();
+  for(i = 0; i < result->len; i++)
+    watch_collect_nodes(&g_array_index(result, struct watch_unit, i), order);
+  xmlNodePtr n, tail = new_tail ? parsed_tail : old_tail;
+  for(n = tail; n; n = n->next) g_ptr_array_add(order, n);
+
+  GHashTable *keep = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for(i = 0; i < order->len; i++)
+    g_hash_table_insert(keep, order->pdata[i], order->pdata[i]);
+
+  // free the old children that are not needed anymore
+  doc_changed_unsafely();
+  doc_edit_begin();
+  xmlNodePtr next;
+  for(n = watched_body->children; n; n = next)
+  {
+    next = n->next;
+    if(g_hash_table_lookup(keep, n)) continue;
+    xmlUnlinkNode(n);
+    if(n->type == XML_ELEMENT_NODE)
+    {
+      g_hash_table_remove(clean_entries, n);
+      g_hash_table_remove(dirty_entries, n);
+      if(n == edited_node) set_edited_node(NULL);
+      doc_edit_removed_unsafely(n);
+    }
+    else xmlFreeNode(n);
+  }
+  g_hash_table_destroy(keep);
+
+  // whether children that stay change their order
+  gboolean reordered = FALSE;
+  xmlNodePtr stays = watched_body->children;
+  for(i = 0; i < order->len && !reordered; i++)
+  {
+    n = order->pdata[i];
+    if(n->doc != teidoc) continue;
+    if(n != stays) reordered = TRUE;
+    else stays = stays->next;
+  }
+
+  // relink in file order
+  watched_body->children = watched_body->last = NULL;
+  for(i = 0; i < order->len; i++)
+  {
+    n = order->pdata[i];
+    gboolean from_disk = n->doc != teidoc;
+    if(from_disk)
+    {
+      // the wrapper doc is freed below, with the namespace of xml:lang
+      xmlUnlinkNode(n);
+      xmlDOMWrapAdoptNode(NULL, n->doc, n, teidoc, watched_body, 0);
+      watch_add_ids(teidoc, n);
+    }
+    n->parent = watched_body;
+    n->prev = watched_body->last;
+    n->next = NULL;
+    if(watched_body->last) watched_body->last->next = n;
+    else watched_body->children = n;
+    watched_body->last = n;
+    if(from_disk && n->type == XML_ELEMENT_NODE) doc_edit_added_unsafely(n);
+  }
+  g_ptr_array_free(order, TRUE);
+  if(reordered) doc_edit_reordered_unsafely(watched_body);
+  doc_edit_end();
+
+  // the wrapper doc only holds rejected disk versions now
+  if(parsed) xmlFreeDoc(parsed);
+
+  // the new state on disk
+  for(i = 0; i < result->len; i++)
+  {
+    struct watch_unit *u = &g_array_index(result, struct watch_unit, i);
+    if(u->dirty)
+      g_hash_table_insert(dirty_entries, u->entry, watch_fp_new(u->fp));
+    else
+      g_hash_table_insert(clean_entries, u->entry, watch_fp_new(u->fp));
+  }
+  tail_fp = ws->tail_fp;
+  g_array_free(result, TRUE);
+  g_array_free(olds, TRUE);
+
+  if(!g_hash_table_size(dirty_entries) && !deleted_entries && !form_modified
+      && file_modified)
+  { file_modified = FALSE; on_file_modified_changed(); }
+
+  // update treeview1
+  on_select_entry_changed(NULL, NULL);
+
+  if(nparsed || conflicts)
+    mystatus(_("Reloaded %i entries that were changed on disk."), nparsed);
+  return TRUE;
+}
+
+
+/// Compare the file on disk to the document, after events have settled
+static gboolean watch_check(gpointer data)
+{
+  // our own save, look again when it is done
+  if(save_snapshot_running()) return TRUE;
+  // patching relinks all of body, which readers could not follow
+  if(doc_readers_active()) return TRUE;
+  settle_timeout_id = 0;
+  if(!watched_filename || !teidoc) return FALSE;
+
+  struct watch_scan ws;
+  if(!watch_scan_file(watched_filename, &ws))
+  {
+    if(!g_file_test(watched_filename, G_FILE_TEST_EXISTS))
+      mystatus(_("%s was removed from disk."), watched_filename);
+    else watch_full_reload();
+    return FALSE;
+  }
+
+  if(!fingerprints_valid || ws.prologue_fp != prologue_fp ||
+      ws.epilogue_fp != epilogue_fp || !watch_patch(&ws))
+    watch_full_reload();
+  watch_scan_free(&ws);
+  return FALSE;
+}
+
+
+#ifdef __linux__
+static gboolean on_watch_inotify_event(GIOChannel *source,
+    GIOCondition condition, gpointer data)
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  gchar *basename = g_path_get_basename(watched_filename);
+  gboolean changed = FALSE;
+  ssize_t len;
+  while((len = read(inotify_fd, buf, sizeof(buf))) > 0)
+  {
+    char *p;
+    for(p = buf; p < buf + len; )
+    {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      if(ev->wd == inotify_wd && ev->len && !strcmp(ev->name, basename))
+	changed = TRUE;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+  g_free(basename);
+
+  if(changed && !settle_timeout_id)
+    settle_timeout_id = g_timeout_add(WATCH_SETTLE_MS, watch_check, NULL);
+  return TRUE;
+}
+
+
+/// Watch the directory, since saving replaces the file by rename()
+static void watch_inotify_add(const char *filename)
+{
+  if(inotify_fd == -1)
+  {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(inotify_fd == -1)
+    {
+      g_printerr("inotify_init1: %s\n", g_strerror(errno));
+      return;
+    }
+    GIOChannel *ch = g_io_channel_unix_new(inotify_fd);
+    g_io_add_watch(ch, G_IO_IN, on_watch_inotify_event, NULL);
+    g_io_channel_unref(ch);
+  }
+
+  if(inotify_wd != -1) inotify_rm_watch(inotify_fd, inotify_wd);
+  gchar *dir = g_path_get_dirname(filename);
+  inotify_wd = inotify_add_watch(inotify_fd, dir,
+      IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+  if(inotify_wd == -1)
+    g_printerr("Can't watch %s: %s\n", dir, g_strerror(errno));
+  g_free(dir);
+}
+#endif
+
+
+/// Start watching @a filename, that @a doc was just loaded from
+void watch_file(const char *filename, const xmlDocPtr doc)
+{
+  g_return_if_fail(filename && doc);
+  watch_forget();
+  watched_filename = g_strdup(filename);
+  watched_body = find_single_node("/TEI.2/text/body[1]", doc);
+#ifdef __linux__
+  watch_inotify_add(filename);
+#endif
+
+  struct watch_scan ws;
+  if(!watched_body || !watch_scan_file(filename, &ws)) return;
+  watch_set_fingerprints(&ws);
+  watch_scan_free(&ws);
+}
+
+
+/// To be called when @a doc was saved as @a filename
+/** If there were edits while the save ran, the fingerprints don't
+ * correspond to the document, and external changes will lead to a reload
+ * of the whole file.
+ */
+void watch_saved(const char *filename, const xmlDocPtr doc)
+{
+  if(!file_modified)
+  {
+    watch_file(filename, doc);
+    return;
+  }
+  watch_forget();
+  watched_filename = g_strdup(filename);
+  watched_body = find_single_node("/TEI.2/text/body[1]", doc);
+#ifdef __linux__
+  watch_inotify_add(filename);
+#endif
+}
+
+
+/// Stop watching, for example when the document is closed
+void watch_forget(void)
+{
+  watch_clear_entries();
+  g_free(watched_filename);
+  watched_filename = NULL;
+  watched_body = NULL;
+  if(settle_timeout_id) g_source_remove(settle_timeout_id);
+  settle_timeout_id = 0;
+#ifdef __linux__
+  if(inotify_wd != -1) inotify_rm_watch(inotify_fd, inotify_wd);
+  inotify_wd = -1;
+#endif
+}
+
+
+/// Fingerprint on disk of entry @a n, 0 if it was added locally
+/** @a n is removed from the tables.
+ */
+static guint64 watch_take_fp(const xmlNodePtr n)
+{
+  guint64 fp = 0, *p = g_hash_table_lookup(clean_entries, n);
+  if(!p) p = g_hash_table_lookup(dirty_entries, n);
+  if(p) fp = *p;
+  g_hash_table_remove(clean_entries, n);
+  g_hash_table_remove(dirty_entries, n);
+  return fp;
+}
+
+
+/// @a new replaces the entry @a old
+static void watch_entry_replaced(const xmlNodePtr old, const xmlNodePtr new)
+{
+  if(!watched_body || !old || old->parent != watched_body) return;
+  g_hash_table_insert(dirty_entries, new, watch_fp_new(watch_take_fp(old)));
+}
+
+
+/// @a n or a descendant of it was changed
+static void watch_entry_modified(const xmlNodePtr n)
+{
+  if(!watched_body) return;
+  xmlNodePtr e;
+  for(e = n; e && e->parent != watched_body; e = e->parent);
+  if(!e || !g_hash_table_lookup(clean_entries, e)) return;
+  g_hash_table_insert(dirty_entries, e, watch_fp_new(watch_take_fp(e)));
+}
+
+
+/// The entry @a n was deleted
+static void watch_entry_removed(const xmlNodePtr n)
+{
+  if(!watched_body || !n || n->parent != watched_body) return;
+  guint64 fp = watch_take_fp(n);
+  if(!fp) return;
+  struct watch_deleted *d = g_new(struct watch_deleted, 1);
+  d->fp = fp;
+  d->headwords = watch_headwords(n);
+  deleted_entries = g_slist_prepend(deleted_entries, d);
+}
+
+
+/// The entry @a n was added to body
+static void watch_entry_added(const xmlNodePtr n)
+{
+  if(!watched_body || !n || n->parent != watched_body) return;
+  g_hash_table_insert(dirty_entries, n, watch_fp_new(0));
+}
+
+
+/// Remember local changes, subscribed with doc_edit_subscribe()
+/** Replaced and removed nodes keep their parent, so the entries they
+ * belonged to are still found.
+ */
+void watch_doc_edited(const struct doc_edit *edits, guint n,
+    gpointer user_data)
+{
+  guint i;
+  for(i = 0; i < n; i++)
+  {
+    const struct doc_edit *e = &edits[i];
+    if(!e->local) continue;// watch_patch() did the bookkeeping
+    switch(e->type)
+    {
+      case DOC_EDIT_ADDED:
+	watch_entry_added(e->new_node);
+	break;
+      case DOC_EDIT_REMOVED:
+	watch_entry_removed(e->old_node);
+	break;
+      case DOC_EDIT_REPLACED:
+	if(e->old_node->parent == watched_body)
+	  watch_entry_replaced(e->old_node, e->new_node);
+	else watch_entry_modified(e->old_node);
+	break;
+      case DOC_EDIT_REORDERED:// only watch_patch() reorders
+	break;
+    }
+  }
+}
@@ -0,0 +1,12 @@
+#include <libxml/tree.h>
+#include <glib.h>
+
+// Noticing changes of the opened file on disk
+void watch_file(const char *filename, const xmlDocPtr doc);
+void watch_saved(const char *filename, const xmlDocPtr doc);
+void watch_forget(void);
+
+// Bookkeeping of local changes
+struct doc_edit;
+void watch_doc_edited(const struct doc_edit *edits, guint n,
+    gpointer user_data);
@@ -2,9 +2,15 @@
  * @brief XML/XPath/XSLT Utility functions
  */
 
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
 #include "xml.h"
-#include <gnome.h>
+#include <glib/gi18n.h>
 #include <libxml/xpathInternals.h>
+#include <stdlib.h>
+#include <string.h>
 
 /////////////////////////////////////////////////////////////////////////
 // libxslt/XPath extension functions
@@ -34,11 +40,10 @@ static void freedict_xpath_extension_unbalanced_braces(
   }
 
   // function that does the actual parsing
-  // returns TRUE if a brace of the string in c does not have
+  // returns TRUE if a brace of the text content of n does not have
   // a corresponding brace
-  gboolean contains_unbalanced_braces(xmlChar *c)
+  gboolean contains_unbalanced_braces(const xmlNodePtr n)
   {
-    if(!c) return FALSE;
     char stack[100];
     int stackend = sizeof(stack);
 
@@ -56,29 +61,34 @@ static void freedict_xpath_extension_unbalanced_braces(
 
     gchar cub_pop()
     {
-      // stack is empty
       if(stackend>=sizeof(stack)) return 'E';
 
       return stack[stackend++];
     }
 
-    do
+    // the braces may be spread over several text nodes
+    struct text_runs runs;
+    const xmlChar *c, *end;
+    int len;
+    text_runs_init(&runs, n);
+    while(text_runs_next(&runs, &c, &len))
     {
-      switch(*c)
+      for(end = c + len; c < end; c++)
       {
-        case '(': if(!cub_push('(')) return TRUE; break;
-        case '[': if(!cub_push('[')) return TRUE; break;
-        case '{': if(!cub_push('{')) return TRUE; break;
+        switch(*c)
+        {
+          case '(': if(!cub_push('(')) return TRUE; break;
+          case '[': if(!cub_push('[')) return TRUE; break;
+          case '{': if(!cub_push('{')) return TRUE; break;
 
-        case ')': if(cub_pop()!='(') return TRUE;break;
-        case ']': if(cub_pop()!='[') return TRUE;break;
-        case '}': if(cub_pop()!='{') return TRUE;break;
+          case ')': if(cub_pop()!='(') return TRUE;break;
+          case ']': if(cub_pop()!='[') return TRUE;break;
+          case '}': if(cub_pop()!='{') return TRUE;break;
 
-        // all other characters are skipped
+          // all other characters are skipped
+        }
       }
-      c++;
     }
-    while(*c);
 
     // braces left open?
     if(cub_pop()!='E') return TRUE;
@@ -91,11 +101,7 @@ static void freedict_xpath_extension_unbalanced_braces(
   int i;
   for(i=0; i < xmlXPathNodeSetGetLength(ns); i++)
   {
-    xmlNodePtr n = xmlXPathNodeSetItem(ns, i);
-    xmlChar* c = xmlNodeGetContent(n);
-    if(!c) continue;
-    result = contains_unbalanced_braces(c);
-    xmlFree(c);
+    result = contains_unbalanced_braces(xmlXPathNodeSetItem(ns, i));
     if(result) break;
   }
 
@@ -162,7 +168,12 @@ xmlDocPtr copy_node_to_doc(const xmlNodePtr node)
         return(NULL);                                                   \
     }
 
-extern GMutex *find_nodeset_pcontext_mutex;
+/// Guards allocation and freeing of the parser contexts of running queries
+/** Has to be created with g_mutex_new() before find_node_set() is used.
+ * Holding it, other threads may set the error of a parser context to stop
+ * an evaluation.
+ */
+GMutex *find_nodeset_pcontext_mutex = NULL;
 
 /**
  * @arg str the XPath expression
@@ -226,14 +237,10 @@ my_xmlXPathEvalExpression(const xmlChar *str, xmlXPathContextPtr ctxt, xmlXPathP
 }
 
 
-/// Evaluate an XPath expression
-/**
- * @arg xpath XPath expression to evaluate
- * @doc document over which to evaluate
- * @arg pctxt can be NULL
- * @return list of matching nodes. The caller will have to free it using xmlXPathFreeNodeSet().
+/// New XPath context on @a doc that knows the fd: extension functions
+/** @arg doc can be NULL to compile expressions
  */
-xmlNodeSetPtr find_node_set(const char *xpath, const xmlDocPtr doc, xmlXPathParserContextPtr *pctxt)
+static xmlXPathContextPtr new_freedict_xpath_context(const xmlDocPtr doc)
 {
   xmlXPathContextPtr ctxt = xmlXPathNewContext(doc);
   if(!ctxt)
@@ -253,21 +260,19 @@ xmlNodeSetPtr find_node_set(const char *xpath, const xmlDocPtr doc, xmlXPathPars
     g_printerr("Warning: Unable to register XPath extension function "
 	"\"unbalanced-braces\" for URI \"%s\"\n", FREEDICT_EDITOR_NAMESPACE);
 
-  xmlXPathParserContextPtr pctxt2;
-  if(!pctxt) pctxt = &pctxt2;
-  xmlXPathObjectPtr xpobj = my_xmlXPathEvalExpression((xmlChar *) xpath, ctxt, pctxt);
-  if(!xpobj)
-  {
-    g_printerr(G_STRLOC ": No XPathObject!\n");
-    xmlXPathFreeContext(ctxt);
-    return NULL;
-  }
+  return ctxt;
+}
 
+
+/// Takes the node set out of the result of an evaluation and frees the rest
+/** @return NULL if @a xpobj is no node set or if it is empty
+ */
+static xmlNodeSetPtr take_node_set(xmlXPathObjectPtr xpobj)
+{
   if(!(xpobj->nodesetval))
   {
     g_printerr(G_STRLOC ": No nodeset!\n");
     xmlXPathFreeObject(xpobj);
-    xmlXPathFreeContext(ctxt);
     return NULL;
   }
 
@@ -275,12 +280,9 @@ xmlNodeSetPtr find_node_set(const char *xpath, const xmlDocPtr doc, xmlXPathPars
   {
     //g_printerr("0 nodes!\n");
     xmlXPathFreeObject(xpobj);
-    xmlXPathFreeContext(ctxt);
     return NULL;
   }
 
-  xmlXPathFreeContext(ctxt);
-
   xmlNodeSetPtr nodes = xmlMalloc(sizeof(xmlNodeSet));
   // XXX copying is slow...
   memcpy(nodes, xpobj->nodesetval, sizeof(xmlNodeSet));
@@ -294,6 +296,118 @@ xmlNodeSetPtr find_node_set(const char *xpath, const xmlDocPtr doc, xmlXPathPars
 }
 
 
+/// Evaluate an XPath expression
+/**
+ * @arg xpath XPath expression to evaluate
+ * @doc document over which to evaluate
+ * @arg pctxt can be NULL
+ * @return list of matching nodes. The caller will have to free it using xmlXPathFreeNodeSet().
+ */
+xmlNodeSetPtr find_node_set(const char *xpath, const xmlDocPtr doc, xmlXPathParserContextPtr *pctxt)
+{
+  return find_node_set_budget(xpath, doc, pctxt, NULL, NULL);
+}
+
+
+/// Evaluate an XPath expression within the limits of @a budget
+/** Like find_node_set(), but the evaluation is stopped when it visits more
+ * than budget->nodes nodes.  This limit needs libxml2 2.9.11; with older
+ * versions it is not enforced.  Of a result larger than budget->results,
+ * only the first budget->results nodes are kept.  The wall time is not
+ * watched here, since the evaluation is stopped from another thread, see
+ * find_node_set_threaded().
+ *
+ * @arg budget can be NULL for no limits
+ * @arg exceeded set to the limit that stopped the evaluation, can be NULL
+ * @return NULL if the evaluation was stopped, the truncated result if it
+ *         found too many nodes
+ */
+xmlNodeSetPtr find_node_set_budget(const char *xpath, const xmlDocPtr doc,
+    xmlXPathParserContextPtr *pctxt, const struct xpath_budget *budget,
+    enum xpath_budget_exceeded *exceeded)
+{
+  if(exceeded) *exceeded = XPATH_BUDGET_KEPT;
+  xmlXPathContextPtr ctxt = new_freedict_xpath_context(doc);
+  if(!ctxt) return NULL;
+#if LIBXML_VERSION >= 20911
+  if(budget) ctxt->opLimit = budget->nodes;
+#endif
+
+  xmlXPathParserContextPtr pctxt2;
+  if(!pctxt) pctxt = &pctxt2;
+  xmlXPathObjectPtr xpobj = my_xmlXPathEvalExpression((xmlChar *) xpath, ctxt, pctxt);
+#if LIBXML_VERSION >= 20911
+  // libxml2 sets the count to the limit when stopping
+  gboolean too_many_nodes = ctxt->opLimit && ctxt->opCount >= ctxt->opLimit;
+#else
+  gboolean too_many_nodes = FALSE;
+#endif
+  xmlXPathFreeContext(ctxt);
+  if(too_many_nodes)
+  {
+    if(exceeded) *exceeded = XPATH_BUDGET_NODES;
+    if(xpobj) xmlXPathFreeObject(xpobj);
+    return NULL;
+  }
+  if(!xpobj)
+  {
+    g_printerr(G_STRLOC ": No XPathObject!\n");
+    return NULL;
+  }
+
+  xmlNodeSetPtr nodes = take_node_set(xpobj);
+  if(nodes && budget && budget->results && nodes->nodeNr > budget->results)
+  {
+    if(exceeded) *exceeded = XPATH_BUDGET_RESULTS;
+    // frees the copies of namespace nodes, too
+    while(nodes->nodeNr > budget->results)
+      xmlXPathNodeSetRemove(nodes, nodes->nodeNr - 1);
+  }
+  return nodes;
+}
+
+
+/// Compile an XPath expression for repeated use with find_node_set_compiled()
+/** The expression may use the fd: extension functions.
+ *
+ * @return the compiled expression, to be freed with xmlXPathFreeCompExpr(),
+ *         or NULL on syntax errors
+ */
+xmlXPathCompExprPtr compile_xpath(const char *xpath)
+{
+  g_return_val_if_fail(xpath, NULL);
+  xmlXPathContextPtr ctxt = new_freedict_xpath_context(NULL);
+  if(!ctxt) return NULL;
+  xmlXPathCompExprPtr comp = xmlXPathCtxtCompile(ctxt, (xmlChar *) xpath);
+  xmlXPathFreeContext(ctxt);
+  return comp;
+}
+
+
+/// Evaluate an expression from compile_xpath(), see find_node_set()
+/** Several threads may evaluate on different documents at the same time,
+ * but a compiled expression should be used by one thread at a time.
+ * Evaluations of compiled expressions cannot be stopped.
+ */
+xmlNodeSetPtr find_node_set_compiled(const xmlXPathCompExprPtr comp,
+    const xmlDocPtr doc)
+{
+  g_return_val_if_fail(comp && doc, NULL);
+  xmlXPathContextPtr ctxt = new_freedict_xpath_context(doc);
+  if(!ctxt) return NULL;
+
+  xmlXPathObjectPtr xpobj = xmlXPathCompiledEval(comp, ctxt);
+  xmlXPathFreeContext(ctxt);
+  if(!xpobj)
+  {
+    g_printerr(G_STRLOC ": No XPathObject!\n");
+    return NULL;
+  }
+
+  return take_node_set(xpobj);
+}
+
+
 xmlNodePtr find_single_node(const char *xpath, const xmlDocPtr doc)
 {
   xmlNodeSetPtr nodes = find_node_set(xpath, doc, NULL);
@@ -342,22 +456,20 @@ gboolean has_only_text_children_and_allowed_attrs(const xmlNodePtr n,
         gboolean allowed = FALSE;
         const char **attr = attrs;
         const char **attr_content = attr_contents;
-	xmlChar *attr_value = xmlNodeGetContent(nattrs->children);
-        g_debug("element attr '%s': value='%s'", nattrs->name, attr_value);
+        g_debug("element attr '%s'", nattrs->name);
         while(*attr)
         {
 	  // if allowed node exists
           g_debug("checking allowed attr '%s': attr_content='%s' ", *attr,
-	      *attr_content);
+	      attr_content ? *attr_content : NULL);
 	  if(!strcmp((char *) nattrs->name, (char *) *attr) &&
 	      (!attr_content ||
-	     !strcmp((char *) attr_value, (char *) *attr_content)))
+	     node_text_equals((xmlNodePtr) nattrs, *attr_content)))
 	  { allowed = TRUE; break; }
           attr++;
           if(attr_content) attr_content++;
 	}
         g_debug("%i ", allowed);
-	xmlFree(attr_value);
 	if(!allowed) return FALSE;
 	nattrs = nattrs->next;
       }
@@ -435,44 +547,623 @@ gboolean entry_orths_to_string(xmlNodePtr n, int len, char *s)
   g_return_val_if_fail(s, FALSE);
   g_return_val_if_fail(len>0, FALSE);
 
-  xmlDocPtr doc = copy_node_to_doc(n);
+  // alloc temporary buffer
+  // if glib offered g_utf8_strlcat(), we would not need
+  // this buffer
+  char *e = (char *) g_malloc(len);
+  int elen = 0;
 
-  // find the orth children of the current entry
-  xmlNodeSetPtr set = find_node_set("/entry/form/orth", doc, NULL);
+  // the orth children of the current entry, like "/entry/form/orth"
+  int count = 0;
+  xmlNodePtr form, orth;
+  if(!xmlStrcmp(n->name, (xmlChar *) "entry"))
+    for(form = n->children; form; form = form->next)
+    {
+      if(form->type != XML_ELEMENT_NODE ||
+	  xmlStrcmp(form->name, (xmlChar *) "form")) continue;
+      for(orth = form->children; orth; orth = orth->next)
+      {
+	if(orth->type != XML_ELEMENT_NODE ||
+	    xmlStrcmp(orth->name, (xmlChar *) "orth")) continue;
+	if(count++) elen = text_append(e, len, elen, (xmlChar *) ", ", 2);
+
+	struct text_runs runs;
+	const xmlChar *run;
+	int rlen;
+	text_runs_init(&runs, orth);
+	while(text_runs_next(&runs, &run, &rlen))
+	  elen = text_append(e, len, elen, run, rlen);
+      }
+    }
+  e[elen] = '\0';
 
-  if(!set || !set->nodeNr)
+  if(!count)
   {
     g_strlcpy(s, _("No nodes (form/orth)!"), len);
-    if(set) xmlXPathFreeNodeSet(set);
-    xmlFreeDoc(doc);
+    g_free(e);
     return FALSE;
   }
 
-  // alloc temporary buffer
-  // if glib offered g_utf8_strlcat(), we would not need
-  // this buffer
-  char *e = (char *) g_malloc(len);
-  e[0] = '\0';
+  // copy again, caring for utf8 chars longer than 1 byte
+  g_utf8_strncpy(s, e, len/2);
+
+  g_free(e);
+  return TRUE;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+// Zero-copy access to text content
+/////////////////////////////////////////////////////////////////////////
+
+/// Whether @a n holds text itself, rather than in children
+static gboolean is_text_leaf(const xmlNodePtr n)
+{
+  return n->type == XML_TEXT_NODE || n->type == XML_CDATA_SECTION_NODE ||
+    n->type == XML_COMMENT_NODE || n->type == XML_PI_NODE;
+}
+
+
+/// The text content of @a n, if it is held by a single node
+/** This is the common case of a text node, or an element or attribute with
+ * one text child.  Nothing is copied: the result points into the document
+ * and is valid as long as the node is not changed.
+ *
+ * @retval NULL if the content is spread over several nodes
+ */
+const xmlChar *node_single_text(const xmlNodePtr n)
+{
+  g_return_val_if_fail(n, NULL);
+
+  if(is_text_leaf(n)) return n->content ? n->content : (xmlChar *) "";
+  if(n->type != XML_ELEMENT_NODE && n->type != XML_ATTRIBUTE_NODE)
+    return NULL;
+
+  xmlNodePtr c = n->children;
+  if(!c) return (xmlChar *) "";
+  if(c->next) return NULL;
+  if(c->type != XML_TEXT_NODE && c->type != XML_CDATA_SECTION_NODE)
+    return NULL;
+  return c->content ? c->content : (xmlChar *) "";
+}
+
+
+/// The text content of @a n, copied only if it is spread over several nodes
+/** @arg copy set to the string to free with xmlFree() after use, or NULL
+ * @return the content, like xmlNodeGetContent() would, or NULL
+ */
+const xmlChar *node_text(const xmlNodePtr n, xmlChar **copy)
+{
+  g_return_val_if_fail(copy, NULL);
+  *copy = NULL;
+  if(!n) return NULL;
+
+  const xmlChar *t = node_single_text(n);
+  if(t) return t;
+  *copy = xmlNodeGetContent(n);
+  return *copy;
+}
+
+
+/// Start iterating the text content of @a n in pieces
+/** Use text_runs_next() to get the pieces.  Together they make up what
+ * xmlNodeGetContent() would return, but nothing is allocated.
+ */
+void text_runs_init(struct text_runs *runs, const xmlNodePtr n)
+{
+  g_return_if_fail(runs);
+  runs->top = n;
+  runs->nrefs = 0;
+  if(!n) runs->cur = NULL;
+  else if(is_text_leaf(n)) runs->cur = n;
+  else if(n->type == XML_ELEMENT_NODE || n->type == XML_ATTRIBUTE_NODE ||
+      n->type == XML_DOCUMENT_FRAG_NODE)
+    runs->cur = n->children;
+  else runs->cur = NULL;
+}
+
+
+/// The node following @a n in document order, without descending
+static xmlNodePtr text_runs_after(struct text_runs *runs, xmlNodePtr n)
+{
+  while(n)
+  {
+    if(n->next) return n->next;
+
+    // leaving the content of an entity goes back to its reference
+    if(runs->nrefs &&
+	n->parent == runs->refs[runs->nrefs-1]->children)
+      n = runs->refs[--runs->nrefs];
+    else n = n->parent;
+
+    if(n == runs->top) return NULL;
+  }
+  return NULL;
+}
+
+
+/// Get the next piece of text content
+/** @arg s set to the start of the piece, which is not NUL-terminated
+ * @arg len set to the length of the piece in bytes
+ * @retval FALSE if there are no more pieces
+ */
+gboolean text_runs_next(struct text_runs *runs, const xmlChar **s, int *len)
+{
+  g_return_val_if_fail(runs && s && len, FALSE);
+
+  while(runs->cur)
+  {
+    xmlNodePtr n = runs->cur;
+    const xmlChar *t = NULL;
+
+    if(n == runs->top)
+    {
+      // a text node was passed to text_runs_init()
+      runs->cur = NULL;
+      t = n->content;
+    }
+    else if(n->type == XML_TEXT_NODE || n->type == XML_CDATA_SECTION_NODE)
+    {
+      t = n->content;
+      runs->cur = text_runs_after(runs, n);
+    }
+    else if(n->type == XML_ELEMENT_NODE && n->children)
+      runs->cur = n->children;
+    // n->children of a reference is the entity declaration
+    else if(n->type == XML_ENTITY_REF_NODE && n->children &&
+	n->children->children && runs->nrefs < G_N_ELEMENTS(runs->refs))
+    {
+      runs->refs[runs->nrefs++] = n;
+      runs->cur = n->children->children;
+    }
+    else runs->cur = text_runs_after(runs, n);
+
+    if(t && *t)
+    {
+      *s = t;
+      *len = xmlStrlen(t);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+
+/// Compare the text content of @a n to @a s without copying it
+gboolean node_text_equals(const xmlNodePtr n, const char *s)
+{
+  g_return_val_if_fail(s, FALSE);
+
+  const xmlChar *t = node_single_text(n);
+  if(t) return !strcmp((char *) t, s);
+
+  struct text_runs runs;
+  const xmlChar *run;
+  int len;
+  text_runs_init(&runs, n);
+  while(text_runs_next(&runs, &run, &len))
+  {
+    if(strncmp((char *) run, s, len)) return FALSE;
+    s += len;
+  }
+  return !*s;
+}
 
+
+/// Append @a len bytes of @a t to @a buf of size @a size at @a pos
+/** As much is copied as fits, leaving room for the terminating NUL.
+ * @return the new position
+ */
+int text_append(char *buf, int size, int pos, const xmlChar *t, int len)
+{
+  len = MIN(len, size - 1 - pos);
+  if(len <= 0) return pos;
+  memcpy(buf + pos, t, len);
+  return pos + len;
+}
+
+
+/////////////////////////////////////////////////////////////////////////
+// Memoization of XPath results
+/////////////////////////////////////////////////////////////////////////
+
+/// Maximum number of node sets kept in xpath_cache
+#define XPATH_CACHE_MAX_ITEMS 64
+
+/// Incremented on every change of xpath_cache_doc
+static guint xpath_cache_generation;
+
+/// The document whose query results are memoized
+static xmlDocPtr xpath_cache_doc;
+
+/// Result of a query, valid while @a generation is xpath_cache_generation
+/**
+ * Most queries select entries by what is inside of them, like the sanity
+ * checks "//entry[...]".  Their results are kept up to date when an entry
+ * changes: the nodes of the old entry are dropped from @a set and the entry
+ * is remembered in @a pending, so the query is evaluated for it alone, the
+ * next time the result is asked for.  Any other change of the document
+ * makes such a result stale, like all results of other queries.
+ */
+struct xpath_cache_item
+{
+  guint generation;
+  xmlNodeSetPtr set;///< in document order, empty if nothing matched
+  /// The query relative to one entry, NULL if it is not entry local
+  gchar *local;
+  /// Entries that were changed since @a set was complete
+  GPtrArray *pending;
+};
+
+/// Maps XPath expressions to struct xpath_cache_item
+static GHashTable *xpath_cache;
+
+/// Maps entry nodes of xpath_cache_doc to their headwords
+/** Entries stay valid across changes of other entries.
+ */
+static GHashTable *headwords_cache;
+
+
+static void xpath_cache_item_free(struct xpath_cache_item *item)
+{
+  xmlXPathFreeNodeSet(item->set);
+  g_free(item->local);
+  if(item->pending) g_ptr_array_free(item->pending, TRUE);
+  g_free(item);
+}
+
+
+static gboolean xpath_cache_item_is_stale(gpointer key, gpointer value,
+    gpointer user_data)
+{
+  return ((struct xpath_cache_item *) value)->generation !=
+    xpath_cache_generation;
+}
+
+
+/// Whether the part of @a xpath from @a p on only looks into the entry
+/** We are conservative: axes that leave the context node, functions about
+ * other nodes or the position, and paths that start at the root are not
+ * allowed.  String literals are skipped.
+ */
+static gboolean xpath_rest_is_local(const char *xpath, const char *p)
+{
+  const char *forbidden[] = { "ancestor", "parent", "preceding", "following",
+    "namespace", "..", "id(", "key(", "document(", "position(", "last(", "$",
+    NULL };
+  const char **f;
+  for(f = forbidden; *f; f++)
+    if(strstr(p, *f)) return FALSE;
+
+  // "//entry[3]" selects by position among the entries
+  const char *q = p;
+  while(*q == ' ') q++;
+  if(*q == '[')
+  {
+    for(q++; *q == ' '; q++);
+    if(g_ascii_isdigit(*q)) return FALSE;
+  }
+
+  char quote = 0;
+  for(q = p; *q; q++)
+  {
+    if(quote) { if(*q == quote) quote = 0; continue; }
+    if(*q == '"' || *q == '\'') { quote = *q; continue; }
+    if(*q != '/') continue;
+
+    // a step continues a path if there is a step in front of it
+    const char *b = q - 1;
+    if(b >= p && *b == '/') b--;
+    if(b < xpath || strchr(" \t\n[(,|=<>!+", *b)) return FALSE;
+    if(q[1] == '/') q++;
+  }
+  return !quote;
+}
+
+
+/// The query that gives the part of the result of @a xpath within one entry
+/** Evaluated with the outermost entry as context node.
+ * @return newly allocated, NULL if the result of @a xpath can depend on
+ * more than the entries themselves
+ */
+static gchar *xpath_entry_local(const char *xpath)
+{
+  const struct { const char *prefix, *local; } forms[] = {
+    // entries below other entries are found as well
+    { "//entry", "descendant-or-self::entry" },
+    { "/TEI.2/text/body/entry", "self::entry[parent::body/parent::text/"
+	"parent::TEI.2[not(parent::*)]]" },
+    { NULL, NULL } };
   int i;
-  xmlNodePtr *n2;
-  for(i=0, n2 = set->nodeTab; *n2 && i<set->nodeNr; n2++, i++)
+  for(i = 0; forms[i].prefix; i++)
   {
-    xmlChar* content = xmlNodeGetContent(*n2);
-    int l = strlen(e);
-    if(l) g_strlcat(e, ", ", len);
-    if(!content) g_strlcat(e, "(null)", len);
-    else g_strlcat(e, (gchar *) content, len);
-    if(content) xmlFree(content);
+    gsize l = strlen(forms[i].prefix);
+    if(strncmp(xpath, forms[i].prefix, l)) continue;
+    const char *rest = xpath + l;
+    if(*rest && !strchr(" [/", *rest)) return NULL;
+    if(!xpath_rest_is_local(xpath, rest)) return NULL;
+    return g_strconcat(forms[i].local, rest, NULL);
   }
+  return NULL;
+}
 
-  xmlXPathFreeNodeSet(set);
 
-  // copy again, caring for utf8 chars longer than 1 byte
-  g_utf8_strncpy(s, e, len/2);
+/// The outermost entry that @a n is part of, NULL if none
+static xmlNodePtr xpath_cache_entry_of(xmlNodePtr n)
+{
+  // XPath node sets keep namespace nodes as copies that point to the element
+  if(n && n->type == XML_NAMESPACE_DECL) n = (xmlNodePtr) ((xmlNsPtr) n)->next;
+  xmlNodePtr entry = NULL;
+  for(; n; n = n->parent)
+    if(n->type == XML_ELEMENT_NODE && !xmlStrcmp(n->name, (xmlChar *) "entry"))
+      entry = n;
+  return entry;
+}
 
-  g_free(e);
-  xmlFreeDoc(doc);
+
+/// Drop the nodes of @a entry from the result of @a item
+static void xpath_cache_item_drop(struct xpath_cache_item *item,
+    xmlNodePtr entry)
+{
+  g_ptr_array_remove(item->pending, entry);
+  xmlNodeSetPtr set = item->set;
+  int i, j = 0;
+  for(i = 0; i < set->nodeNr; i++)
+  {
+    xmlNodePtr n = set->nodeTab[i];
+    if(xpath_cache_entry_of(n) != entry) set->nodeTab[j++] = n;
+    else if(n->type == XML_NAMESPACE_DECL) xmlXPathNodeSetFreeNs((xmlNsPtr) n);
+  }
+  set->nodeNr = j;
+}
+
+
+/// Number the outermost entries below @a n in document order
+static void xpath_cache_number_entries(xmlNodePtr n, GHashTable *numbers,
+    guint *next)
+{
+  for(; n; n = n->next)
+  {
+    if(n->type != XML_ELEMENT_NODE) continue;
+    if(!xmlStrcmp(n->name, (xmlChar *) "entry"))
+      g_hash_table_insert(numbers, n, GUINT_TO_POINTER(++*next));
+    else xpath_cache_number_entries(n->children, numbers, next);
+  }
+}
+
+
+struct xpath_cache_sorted
+{
+  guint entry;///< number of the entry, see xpath_cache_number_entries()
+  guint index;///< nodes of one entry are already in document order
+  xmlNodePtr node;
+};
+
+
+static int xpath_cache_sorted_compare(const void *a, const void *b)
+{
+  const struct xpath_cache_sorted *x = a, *y = b;
+  if(x->entry != y->entry) return x->entry < y->entry ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+
+/// Evaluate the query of @a item for its pending entries
+/** @retval FALSE the result could not be completed
+ */
+static gboolean xpath_cache_item_complete(struct xpath_cache_item *item)
+{
+  if(!item->pending->len) return TRUE;
+
+  xmlXPathContextPtr ctxt = new_freedict_xpath_context(xpath_cache_doc);
+  if(!ctxt) return FALSE;
+  xmlXPathCompExprPtr comp = xmlXPathCtxtCompile(ctxt, (xmlChar *) item->local);
+  if(!comp)
+  {
+    xmlXPathFreeContext(ctxt);
+    return FALSE;
+  }
+
+  GArray *nodes = g_array_new(FALSE, FALSE, sizeof(struct xpath_cache_sorted));
+  int i, j;
+  for(i = 0; i < item->set->nodeNr; i++)
+  {
+    struct xpath_cache_sorted s = { 0, nodes->len, item->set->nodeTab[i] };
+    g_array_append_val(nodes, s);
+  }
+  gboolean ok = TRUE;
+  for(i = 0; ok && i < item->pending->len; i++)
+  {
+    ctxt->node = g_ptr_array_index(item->pending, i);
+    xmlXPathObjectPtr xpobj = xmlXPathCompiledEval(comp, ctxt);
+    if(!xpobj || xpobj->type != XPATH_NODESET) ok = FALSE;
+    else if(xpobj->nodesetval)
+      for(j = 0; j < xpobj->nodesetval->nodeNr; j++)
+      {
+	struct xpath_cache_sorted s =
+	  { 0, nodes->len, xpobj->nodesetval->nodeTab[j] };
+	// xpath_entry_local() excludes the namespace axis, whose nodes would
+	// be freed with xpobj
+	if(s.node->type == XML_NAMESPACE_DECL) ok = FALSE;
+	g_array_append_val(nodes, s);
+      }
+    if(xpobj) xmlXPathFreeObject(xpobj);
+  }
+  xmlXPathFreeCompExpr(comp);
+  xmlXPathFreeContext(ctxt);
+
+  if(ok)
+  {
+    // sort by the position of the entries in the document
+    GHashTable *numbers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    guint next = 0;
+    xpath_cache_number_entries(xpath_cache_doc->children, numbers, &next);
+    for(i = 0; i < nodes->len; i++)
+    {
+      struct xpath_cache_sorted *s =
+	&g_array_index(nodes, struct xpath_cache_sorted, i);
+      s->entry = GPOINTER_TO_UINT(g_hash_table_lookup(numbers,
+	    xpath_cache_entry_of(s->node)));
+    }
+    g_hash_table_destroy(numbers);
+    qsort(nodes->data, nodes->len, sizeof(struct xpath_cache_sorted),
+	xpath_cache_sorted_compare);
+
+    item->set->nodeNr = 0;
+    for(i = 0; i < nodes->len; i++)
+      xmlXPathNodeSetAddUnique(item->set,
+	  g_array_index(nodes, struct xpath_cache_sorted, i).node);
+    g_ptr_array_set_size(item->pending, 0);
+  }
+  g_array_free(nodes, TRUE);
+  return ok;
+}
+
+
+/// Forget all results and memoize queries on @a doc from now on
+/** Has to be called whenever another document is opened, since its
+ * nodes may have the addresses of nodes of the old one.
+ */
+void xpath_cache_set_document(const xmlDocPtr doc)
+{
+  if(!xpath_cache)
+  {
+    xpath_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	(GDestroyNotify) xpath_cache_item_free);
+    headwords_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+	NULL, g_free);
+  }
+  g_hash_table_remove_all(xpath_cache);
+  g_hash_table_remove_all(headwords_cache);
+  xpath_cache_doc = doc;
+  xpath_cache_generation++;
+}
+
+
+/// What changed, for xpath_cache_item_edited()
+struct xpath_cache_edit
+{
+  guint generation;///< before the change
+  xmlNodePtr dropped, changed;///< entries
+  gboolean outside;///< an element outside of the entries changed
+};
+
+
+static void xpath_cache_item_edited(gpointer key, gpointer value,
+    gpointer user_data)
+{
+  struct xpath_cache_item *item = value;
+  const struct xpath_cache_edit *e = user_data;
+  // stale already, or becoming stale now
+  if(item->generation != e->generation || !item->local || e->outside) return;
+
+  if(e->dropped) xpath_cache_item_drop(item, e->dropped);
+  if(e->changed)
+  {
+    if(e->changed != e->dropped) xpath_cache_item_drop(item, e->changed);
+    g_ptr_array_add(item->pending, e->changed);
+  }
+  item->generation = xpath_cache_generation;
+}
+
+
+/// To be called after @a old_node was replaced by @a new_node
+/** @a old_node can be NULL for added nodes, @a new_node for removed ones.
+ * The old node and its ancestors are read, so it must not be freed yet.
+ * The results of entry local queries are kept up to date, all other
+ * results become invalid.  Memoized headwords of the entries that contain
+ * the nodes are dropped.
+ */
+void xpath_cache_document_changed(const xmlNodePtr old_node,
+    const xmlNodePtr new_node)
+{
+  struct xpath_cache_edit e;
+  e.generation = xpath_cache_generation++;
+  e.dropped = xpath_cache_entry_of(old_node);
+  e.changed = xpath_cache_entry_of(new_node);
+  // the entry the removed node was part of stays
+  if(!e.changed && e.dropped != old_node) e.changed = e.dropped;
+  if(e.dropped == e.changed) e.dropped = NULL;
+  e.outside = (old_node && !xpath_cache_entry_of(old_node) &&
+      old_node->type == XML_ELEMENT_NODE) ||
+    (new_node && !e.changed && new_node->type == XML_ELEMENT_NODE);
+
+  if(xpath_cache) g_hash_table_foreach(xpath_cache, xpath_cache_item_edited, &e);
+
+  if(!headwords_cache) return;
+  xmlNodePtr a;
+  for(a = old_node; a; a = a->parent) g_hash_table_remove(headwords_cache, a);
+  for(a = new_node; a; a = a->parent) g_hash_table_remove(headwords_cache, a);
+}
+
+
+/// Memoized result of @a xpath on @a doc
+/** @arg set set to a copy of the node set that the caller has to free, NULL
+ * if nothing matched
+ * @return FALSE if the result is not known for the current state of @a doc
+ */
+gboolean xpath_cache_find_node_set(const char *xpath, const xmlDocPtr doc,
+    xmlNodeSetPtr *set)
+{
+  *set = NULL;
+  if(!xpath_cache || doc != xpath_cache_doc) return FALSE;
+  struct xpath_cache_item *item = g_hash_table_lookup(xpath_cache, xpath);
+  if(!item || item->generation != xpath_cache_generation) return FALSE;
+  if(item->local && !xpath_cache_item_complete(item))
+  {
+    g_hash_table_remove(xpath_cache, xpath);
+    return FALSE;
+  }
+  g_debug("Memoized result for %s", xpath);
+  if(item->set->nodeNr) *set = xmlXPathNodeSetMerge(NULL, item->set);
   return TRUE;
 }
 
+
+/// Remember a copy of @a set as result of @a xpath on @a doc
+/** @arg set NULL if nothing matched
+ */
+void xpath_cache_store(const char *xpath, const xmlDocPtr doc,
+    const xmlNodeSetPtr set)
+{
+  if(!xpath_cache || doc != xpath_cache_doc) return;
+  if(g_hash_table_size(xpath_cache) >= XPATH_CACHE_MAX_ITEMS)
+    g_hash_table_foreach_remove(xpath_cache, xpath_cache_item_is_stale, NULL);
+  if(g_hash_table_size(xpath_cache) >= XPATH_CACHE_MAX_ITEMS)
+    g_hash_table_remove_all(xpath_cache);
+
+  struct xpath_cache_item *item = g_new(struct xpath_cache_item, 1);
+  item->generation = xpath_cache_generation;
+  item->set = set ? xmlXPathNodeSetMerge(NULL, set) :
+    xmlXPathNodeSetCreate(NULL);
+  item->local = xpath_entry_local(xpath);
+  item->pending = item->local ? g_ptr_array_new() : NULL;
+  g_hash_table_replace(xpath_cache, g_strdup(xpath), item);
+}
+
+
+/// Like entry_orths_to_string(), memoized for entries of the cached document
+gboolean entry_orths_to_string_cached(xmlNodePtr n, int len, char *s)
+{
+  g_return_val_if_fail(n, FALSE);
+  g_return_val_if_fail(s, FALSE);
+  g_return_val_if_fail(len>0, FALSE);
+  if(!headwords_cache || n->doc != xpath_cache_doc)
+    return entry_orths_to_string(n, len, s);
+
+  gchar *hw = g_hash_table_lookup(headwords_cache, n);
+  if(!hw)
+  {
+    // long enough for all callers, shortened below like the original
+    char buf[400];
+    if(!entry_orths_to_string(n, sizeof(buf), buf))
+    {
+      g_strlcpy(s, buf, len);
+      return FALSE;
+    }
+    hw = g_strdup(buf);
+    g_hash_table_insert(headwords_cache, n, hw);
+  }
+  g_utf8_strncpy(s, hw, len/2);
+  return TRUE;
+}
@@ -5,11 +5,15 @@
 // For XPath extension function(s)
 #define FREEDICT_EDITOR_NAMESPACE "http://freedict.org/freedict-editor"
 #define FREEDICT_EDITOR_NAMESPACE_PREFIX "fd"
+extern GMutex *find_nodeset_pcontext_mutex;
 
 // General XML/XPath utility functions
 xmlDocPtr copy_node_to_doc(const xmlNodePtr node);
 xmlNodePtr find_single_node(const char *xpath, const xmlDocPtr doc);
 xmlNodeSetPtr find_node_set(const char *xpath, const xmlDocPtr doc, xmlXPathParserContextPtr *pctxt);
+xmlXPathCompExprPtr compile_xpath(const char *xpath);
+xmlNodeSetPtr find_node_set_compiled(const xmlXPathCompExprPtr comp,
+    const xmlDocPtr doc);
 xmlNodePtr unlink_leaf_node_with_attr(const char *xpath,
     const char **attrs, const char **attr_contents,
     const xmlDocPtr doc, gboolean *can);
@@ -17,3 +21,51 @@ xmlNodePtr string2xmlNode(const xmlNodePtr parent, const char *before,
     const char *name, const char *content, const char *after);
 gboolean entry_orths_to_string(xmlNodePtr n, int len, char *s);
 
+
+// Resource limits of XPath evaluations
+/// Limits of one XPath evaluation, 0 meaning no limit
+struct xpath_budget
+{
+  gdouble seconds;///< wall time, only watched by find_node_set_threaded()
+  gulong nodes;///< nodes visited and operations performed
+  int results;///< nodes in the result
+};
+/// Which limit of a struct xpath_budget stopped an evaluation
+enum xpath_budget_exceeded
+{
+  XPATH_BUDGET_KEPT,
+  XPATH_BUDGET_SECONDS,
+  XPATH_BUDGET_NODES,
+  XPATH_BUDGET_RESULTS
+};
+xmlNodeSetPtr find_node_set_budget(const char *xpath, const xmlDocPtr doc,
+    xmlXPathParserContextPtr *pctxt, const struct xpath_budget *budget,
+    enum xpath_budget_exceeded *exceeded);
+
+
+// Zero-copy access to text content
+/// Iterator over the text content of a node, see text_runs_init()
+struct text_runs
+{
+  xmlNodePtr top;///< node whose content is iterated
+  xmlNodePtr cur;///< node to look at next
+  xmlNodePtr refs[8];///< entity references whose content is being walked
+  int nrefs;
+};
+void text_runs_init(struct text_runs *runs, const xmlNodePtr n);
+gboolean text_runs_next(struct text_runs *runs, const xmlChar **s, int *len);
+const xmlChar *node_single_text(const xmlNodePtr n);
+const xmlChar *node_text(const xmlNodePtr n, xmlChar **copy);
+gboolean node_text_equals(const xmlNodePtr n, const char *s);
+int text_append(char *buf, int size, int pos, const xmlChar *t, int len);
+
+
+// Memoization of XPath results on the edited document
+void xpath_cache_set_document(const xmlDocPtr doc);
+void xpath_cache_document_changed(const xmlNodePtr old_node,
+    const xmlNodePtr new_node);
+gboolean xpath_cache_find_node_set(const char *xpath, const xmlDocPtr doc,
+    xmlNodeSetPtr *set);
+void xpath_cache_store(const char *xpath, const xmlDocPtr doc,
+    const xmlNodeSetPtr set);
+gboolean entry_orths_to_string_cached(xmlNodePtr n, int len, char *s);
@@ -0,0 +1,512 @@
+/** @file
+ * @brief Showing large nodes in the XML view piece by piece
+ *
+ * Putting the dump of body or of a big teiHeader into textview1 at once
+ * blocks the GUI for a long time.  So for nodes above the entry level, only
+ * the start tag is shown at first.  The children are serialized and appended
+ * a chunk at a time from an idle callback.  The view is read-only until the
+ * end tag is there.
+ *
+ * The start of every child element is remembered with a text mark, and the
+ * range of text changed by the user is tracked.  On apply, only the children
+ * in that range are parsed again and replace their old versions, see
+ * xmlview_apply_region().  Everything else, like a changed start tag or a
+ * child that was split in two, makes the caller parse the whole text as
+ * before.
+ *
+ * The marks point to the children of the shown node, so edits of the
+ * document that replace, remove or reorder them make the view show the node
+ * again, see xmlview_doc_edited().
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gnome.h>
+#include <glade/glade.h>
+
+#include "xmlview.h"
+#include "utils.h"
+#include "edits.h"
+#include "versions.h"
+
+#include <libxml/valid.h>
+#include <string.h>
+
+extern GladeXML *my_glade_xml;
+
+/// Bytes of XML appended to the view per idle callback
+#define XMLVIEW_CHUNK (64 * 1024)
+
+/// A child element of the shown node and where its text starts
+struct xmlview_child
+{
+  xmlNodePtr node;
+  GtkTextMark *mark;
+};
+
+/// The node shown piecewise, NULL if the view was filled at once
+static xmlNodePtr xmlview_node;
+/// TRUE if the children of xmlview_node are indented, one per line
+static gboolean xmlview_formatted;
+/// Next child to append while the view is being filled
+static xmlNodePtr xmlview_next;
+static gchar *xmlview_end_tag;
+static guint xmlview_idle_id;
+/// struct xmlview_child of all child elements shown so far
+static GArray *xmlview_children;
+/// After the last child, before the end tag of xmlview_node
+static GtkTextMark *xmlview_content_end;
+/// Range of text changed by the user, NULL if nothing changed
+static GtkTextMark *xmlview_dirty_start, *xmlview_dirty_end;
+/// TRUE while we change the text ourselves
+static gboolean xmlview_busy;
+/// TRUE while xmlview_apply_region() replaces children of xmlview_node
+static gboolean xmlview_applying;
+
+
+static GtkTextBuffer *xmlview_buffer(void)
+{
+  return gtk_text_view_get_buffer(GTK_TEXT_VIEW(
+	glade_xml_get_widget(my_glade_xml, "textview1")));
+}
+
+
+static gint xmlview_mark_offset(GtkTextBuffer *b, GtkTextMark *m)
+{
+  GtkTextIter i;
+  gtk_text_buffer_get_iter_at_mark(b, &i, m);
+  return gtk_text_iter_get_offset(&i);
+}
+
+
+static void xmlview_delete_mark(GtkTextBuffer *b, GtkTextMark **m)
+{
+  if(!*m) return;
+  gtk_text_buffer_delete_mark(b, *m);
+  *m = NULL;
+}
+
+
+/// Extend the changed range by @a start to @a end
+static void xmlview_mark_dirty(GtkTextBuffer *b, const GtkTextIter *start,
+    const GtkTextIter *end)
+{
+  if(!xmlview_node || xmlview_busy) return;
+  if(!xmlview_dirty_start)
+  {
+    xmlview_dirty_start = gtk_text_buffer_create_mark(b, NULL, start, TRUE);
+    xmlview_dirty_end = gtk_text_buffer_create_mark(b, NULL, end, FALSE);
+    return;
+  }
+  GtkTextIter i;
+  gtk_text_buffer_get_iter_at_mark(b, &i, xmlview_dirty_start);
+  if(gtk_text_iter_compare(start, &i) < 0)
+    gtk_text_buffer_move_mark(b, xmlview_dirty_start, start);
+  gtk_text_buffer_get_iter_at_mark(b, &i, xmlview_dirty_end);
+  if(gtk_text_iter_compare(end, &i) > 0)
+    gtk_text_buffer_move_mark(b, xmlview_dirty_end, end);
+}
+
+
+static void xmlview_text_inserted(GtkTextBuffer *b, GtkTextIter *location,
+    gchar *text, gint len, gpointer user_data)
+{
+  // the default handler has moved location behind the new text
+  GtkTextIter start = *location;
+  gtk_text_iter_backward_chars(&start, g_utf8_strlen(text, len));
+  xmlview_mark_dirty(b, &start, location);
+}
+
+
+static void xmlview_range_deleted(GtkTextBuffer *b, GtkTextIter *start,
+    GtkTextIter *end, gpointer user_data)
+{
+  xmlview_mark_dirty(b, start, end);
+}
+
+
+/// Stop filling the view and forget the marks of a piecewise shown node
+void xmlview_forget(void)
+{
+  if(xmlview_idle_id) g_source_remove(xmlview_idle_id);
+  xmlview_idle_id = 0;
+
+  GtkTextBuffer *b = xmlview_buffer();
+  guint i;
+  for(i = 0; xmlview_children && i < xmlview_children->len; i++)
+    gtk_text_buffer_delete_mark(b,
+	g_array_index(xmlview_children, struct xmlview_child, i).mark);
+  if(xmlview_children) g_array_set_size(xmlview_children, 0);
+  xmlview_delete_mark(b, &xmlview_content_end);
+  xmlview_delete_mark(b, &xmlview_dirty_start);
+  xmlview_delete_mark(b, &xmlview_dirty_end);
+
+  g_free(xmlview_end_tag);
+  xmlview_end_tag = NULL;
+  xmlview_node = xmlview_next = NULL;
+  gtk_text_view_set_editable(GTK_TEXT_VIEW(
+	glade_xml_get_widget(my_glade_xml, "textview1")), TRUE);
+}
+
+
+/// Insert the children of the shown node from @a from up to @a to at @a iter
+/**
+ * The marks of the child elements are stored in xmlview_children from
+ * @a index on.  @a iter is moved behind the inserted text.
+ *
+ * @arg to the child to stop at, or NULL
+ * @arg max stop after this many bytes, 0 for no limit
+ * @return the child that was not inserted anymore, or @a to
+ */
+static xmlNodePtr xmlview_insert_children(GtkTextBuffer *b, GtkTextIter *iter,
+    xmlNodePtr from, xmlNodePtr to, guint index, int max)
+{
+  xmlBufferPtr buf = xmlBufferCreate();
+  GArray *starts = g_array_new(FALSE, FALSE, sizeof(int));
+  GPtrArray *elements = g_ptr_array_new();
+  xmlNodePtr c;
+  for(c = from; c != to && (!max || xmlBufferLength(buf) < max); c = c->next)
+  {
+    if(xmlview_formatted) xmlBufferCCat(buf, "  ");
+    if(c->type == XML_ELEMENT_NODE)
+    {
+      int pos = xmlBufferLength(buf);
+      g_array_append_val(starts, pos);
+      g_ptr_array_add(elements, c);
+    }
+    xmlNodeDump(buf, teidoc, c, xmlview_formatted, xmlview_formatted);
+    if(xmlview_formatted) xmlBufferCCat(buf, "\n");
+  }
+
+  const char *text = (const char *) xmlBufferContent(buf);
+  gint base = gtk_text_iter_get_offset(iter);
+  xmlview_busy = TRUE;
+  gtk_text_buffer_insert(b, iter, text, xmlBufferLength(buf));
+  xmlview_busy = FALSE;
+
+  glong chars = 0;
+  int prev = 0;
+  guint i;
+  for(i = 0; i < starts->len; i++)
+  {
+    int pos = g_array_index(starts, int, i);
+    chars += g_utf8_strlen(text + prev, pos - prev);
+    prev = pos;
+    GtkTextIter start;
+    gtk_text_buffer_get_iter_at_offset(b, &start, base + chars);
+    struct xmlview_child child =
+      { g_ptr_array_index(elements, i),
+	gtk_text_buffer_create_mark(b, NULL, &start, TRUE) };
+    if(index + i < xmlview_children->len)
+      g_array_index(xmlview_children, struct xmlview_child, index + i) = child;
+    else g_array_append_val(xmlview_children, child);
+  }
+
+  g_array_free(starts, TRUE);
+  g_ptr_array_free(elements, TRUE);
+  xmlBufferFree(buf);
+  return c;
+}
+
+
+/// Idle callback appending the next chunk of children to the view
+static gboolean xmlview_append_chunk(gpointer data)
+{
+  GtkTextBuffer *b = xmlview_buffer();
+  GtkTextIter end;
+  gtk_text_buffer_get_end_iter(b, &end);
+  xmlview_next = xmlview_insert_children(b, &end, xmlview_next, NULL,
+      xmlview_children->len, XMLVIEW_CHUNK);
+
+  if(xmlview_next)
+  {
+    gtk_text_buffer_set_modified(b, FALSE);
+    return TRUE;
+  }
+
+  xmlview_busy = TRUE;
+  gtk_text_buffer_insert(b, &end, xmlview_end_tag, -1);
+  xmlview_busy = FALSE;
+  gtk_text_iter_backward_chars(&end, g_utf8_strlen(xmlview_end_tag, -1));
+  xmlview_content_end = gtk_text_buffer_create_mark(b, NULL, &end, FALSE);
+
+  gtk_text_buffer_set_modified(b, FALSE);
+  gtk_text_view_set_editable(GTK_TEXT_VIEW(
+	glade_xml_get_widget(my_glade_xml, "textview1")), TRUE);
+  xmlview_idle_id = 0;
+  mystatus(_("%i child elements shown."), xmlview_children->len);
+  return FALSE;
+}
+
+
+/// Whether @a n is shown piecewise: an element above the entries
+static gboolean xmlview_is_large(const xmlNodePtr n)
+{
+  if(n->type != XML_ELEMENT_NODE) return FALSE;
+  xmlNodePtr a;
+  for(a = n; a && a->type == XML_ELEMENT_NODE; a = a->parent)
+    if(!xmlStrcmp(a->name, (xmlChar *) "entry")) return FALSE;
+  int elements = 0;
+  for(a = n->children; a && elements < 2; a = a->next)
+    if(a->type == XML_ELEMENT_NODE) elements++;
+  return elements >= 2;
+}
+
+
+/// Show the XML dump of @a n in textview1
+/** Large nodes are shown piecewise, see the description of this file.
+ */
+void xmlview_show(const xmlNodePtr n)
+{
+  xmlview_forget();
+  GtkTextBuffer *b = xmlview_buffer();
+  if(!xmlview_children)
+  {
+    xmlview_children = g_array_new(FALSE, FALSE, sizeof(struct xmlview_child));
+    g_signal_connect_after((gpointer) b, "insert-text",
+	G_CALLBACK(xmlview_text_inserted), NULL);
+    g_signal_connect_after((gpointer) b, "delete-range",
+	G_CALLBACK(xmlview_range_deleted), NULL);
+  }
+
+  if(!xmlview_is_large(n))
+  {
+    xmlBufferPtr buf = xmlBufferCreate();
+    int ret2 = xmlNodeDump(buf, teidoc, n, 0, 1);
+    g_assert(ret2 != -1);
+    gtk_text_buffer_set_text(b, (char *) xmlBufferContent(buf), -1);
+    xmlBufferFree(buf);
+    gtk_text_buffer_set_modified(b, FALSE);
+    return;
+  }
+
+  // like xmlNodeDump(), which indents only if there is no text between the
+  // children
+  xmlview_formatted = TRUE;
+  xmlNodePtr c;
+  for(c = n->children; c; c = c->next)
+    if(c->type == XML_TEXT_NODE || c->type == XML_CDATA_SECTION_NODE ||
+	c->type == XML_ENTITY_REF_NODE) xmlview_formatted = FALSE;
+
+  // the tags of n: dump it with empty content
+  xmlNodePtr shallow = xmlDocCopyNode(n, teidoc, 2);
+  xmlAddChild(shallow, xmlNewDocText(teidoc, (xmlChar *) ""));
+  xmlBufferPtr buf = xmlBufferCreate();
+  xmlNodeDump(buf, teidoc, shallow, 0, 0);
+  xmlFreeNode(shallow);
+  xmlview_end_tag = g_strdup_printf("</%s%s%s>", n->ns && n->ns->prefix ? (char *) n->ns->prefix : "",
+      n->ns && n->ns->prefix ? ":" : "", (char *) n->name);
+  int start_len = xmlBufferLength(buf) - strlen(xmlview_end_tag);
+  gchar *start_tag = g_strndup((char *) xmlBufferContent(buf), start_len);
+  xmlBufferFree(buf);
+
+  xmlview_busy = TRUE;
+  gtk_text_buffer_set_text(b, start_tag, -1);
+  if(xmlview_formatted)
+  {
+    GtkTextIter end;
+    gtk_text_buffer_get_end_iter(b, &end);
+    gtk_text_buffer_insert(b, &end, "\n", 1);
+  }
+  xmlview_busy = FALSE;
+  g_free(start_tag);
+  gtk_text_buffer_set_modified(b, FALSE);
+
+  gtk_text_view_set_editable(GTK_TEXT_VIEW(
+	glade_xml_get_widget(my_glade_xml, "textview1")), FALSE);
+  xmlview_node = n;
+  xmlview_next = n->children;
+  xmlview_idle_id = g_idle_add(xmlview_append_chunk, NULL);
+}
+
+
+/// Index of the last child whose text starts before @a offset, or -1
+static int xmlview_child_before(GtkTextBuffer *b, gint offset)
+{
+  int lo = 0, hi = xmlview_children->len;
+  while(lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if(xmlview_mark_offset(b, g_array_index(xmlview_children,
+	    struct xmlview_child, mid).mark) < offset) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+
+/// Whether @a n may be dropped when the text around it is parsed again
+static gboolean xmlview_is_blank(const xmlNodePtr n)
+{
+  return n->type == XML_TEXT_NODE && xmlIsBlankNode(n);
+}
+
+
+/// Parse and replace only the children of the shown node that were changed
+/**
+ * The children whose text the user changed are parsed in the context of
+ * the shown node.  They replace the old ones if they are as many elements
+ * with the same names and if they are valid.  The changed part of the view
+ * is then shown as libxml2 writes it, like after a complete apply.
+ *
+ * @return XMLVIEW_APPLY_WHOLE if the changes cannot be applied this way
+ */
+enum xmlview_apply xmlview_apply_region(void)
+{
+  if(!xmlview_node || xmlview_idle_id || !xmlview_dirty_start ||
+      xmlview_node != edited_node || !xmlview_children->len)
+    return XMLVIEW_APPLY_WHOLE;
+
+  GtkTextBuffer *b = xmlview_buffer();
+  gint ds = xmlview_mark_offset(b, xmlview_dirty_start);
+  gint de = xmlview_mark_offset(b, xmlview_dirty_end);
+  struct xmlview_child *children = (struct xmlview_child *)
+    xmlview_children->data;
+  guint n = xmlview_children->len;
+  // changes at the tags of the shown node itself
+  if(ds <= xmlview_mark_offset(b, children[0].mark) ||
+      de > xmlview_mark_offset(b, xmlview_content_end))
+    return XMLVIEW_APPLY_WHOLE;
+
+  // text deleted up to the start of a child may have belonged to the one
+  // before, so i is the child before the change
+  int i = xmlview_child_before(b, ds);
+  int j = xmlview_child_before(b, de + 1);
+  if(i < 0 || j < i) return XMLVIEW_APPLY_WHOLE;
+  GtkTextMark *region_end = j + 1 < n ? children[j + 1].mark :
+    xmlview_content_end;
+  xmlNodePtr stop = j + 1 < n ? children[j + 1].node : NULL;
+
+  // the old children, with nothing but whitespace between them
+  xmlNodePtr c;
+  for(c = children[i].node; c != stop; c = c->next)
+    if(!c || !doc_node_is_live(c) || c->parent != xmlview_node ||
+	(c->type != XML_ELEMENT_NODE && !xmlview_is_blank(c)))
+      return XMLVIEW_APPLY_WHOLE;
+
+  GtkTextIter start, end;
+  gtk_text_buffer_get_iter_at_mark(b, &start, children[i].mark);
+  gtk_text_buffer_get_iter_at_mark(b, &end, region_end);
+  gchar *text = gtk_text_buffer_get_text(b, &start, &end, FALSE);
+  // xmlParseInNodeContext() links its results into the context node for a
+  // while, so it gets a copy, which sees the namespaces of the ancestors
+  // without being one of their children
+  xmlNodePtr context = xmlDocCopyNode(xmlview_node, teidoc, 2);
+  context->parent = xmlview_node->parent;
+  xmlNodePtr list = NULL;
+  xmlParserErrors err = xmlParseInNodeContext(context, text,
+      strlen(text), 0, &list);
+  context->parent = NULL;
+  xmlFreeNode(context);
+  g_free(text);
+  if(err != XML_ERR_OK)
+  {
+    if(list) xmlFreeNodeList(list);
+    mystatus(_("Edited XML is not well formed! Can't save it!"));
+    return XMLVIEW_APPLY_FAILED;
+  }
+
+  // the new children must match the old ones
+  GPtrArray *parsed = g_ptr_array_new();
+  enum xmlview_apply ret = XMLVIEW_APPLY_DONE;
+  for(c = list; c; c = c->next)
+  {
+    if(c->type == XML_ELEMENT_NODE) g_ptr_array_add(parsed, c);
+    else if(!xmlview_is_blank(c)) ret = XMLVIEW_APPLY_WHOLE;
+  }
+  guint k;
+  if(parsed->len != j - i + 1) ret = XMLVIEW_APPLY_WHOLE;
+  for(k = 0; ret == XMLVIEW_APPLY_DONE && k < parsed->len; k++)
+    if(xmlStrcmp(((xmlNodePtr) g_ptr_array_index(parsed, k))->name,
+	  children[i + k].node->name)) ret = XMLVIEW_APPLY_WHOLE;
+
+  // validate
+  xmlValidCtxtPtr ctx = xmlNewValidCtxt();
+  for(k = 0; ret == XMLVIEW_APPLY_DONE && k < parsed->len; k++)
+    if(!xmlValidateElement(ctx, teidoc, g_ptr_array_index(parsed, k)))
+    {
+      mystatus(_("Edited XML is not valid! Won't save it!"));
+      ret = XMLVIEW_APPLY_FAILED;
+    }
+  xmlFreeValidCtxt(ctx);
+
+  if(ret != XMLVIEW_APPLY_DONE)
+  {
+    xmlFreeNodeList(list);
+    g_ptr_array_free(parsed, TRUE);
+    return ret;
+  }
+
+  // the whitespace between the children stays as it was
+  xmlNodePtr next;
+  for(c = list; c; c = next)
+  {
+    next = c->next;
+    c->prev = c->next = NULL;
+    if(c->type != XML_ELEMENT_NODE) xmlFreeNode(c);
+  }
+  xmlview_applying = TRUE;
+  doc_edit_begin();
+  for(k = 0; k < parsed->len; k++)
+  {
+    doc_edit_replace(children[i + k].node, g_ptr_array_index(parsed, k));
+    children[i + k].node = g_ptr_array_index(parsed, k);
+  }
+  doc_edit_end();
+  xmlview_applying = FALSE;
+  g_ptr_array_free(parsed, TRUE);
+
+  // show the new children, in front of the old text
+  gint offset = gtk_text_iter_get_offset(&start);
+  for(k = i; k <= j; k++)
+    gtk_text_buffer_delete_mark(b, children[k].mark);
+  gtk_text_buffer_get_iter_at_offset(b, &start, offset);
+  xmlview_insert_children(b, &start, children[i].node, stop, i, 0);
+  gtk_text_buffer_get_iter_at_mark(b, &end, region_end);
+  xmlview_busy = TRUE;
+  gtk_text_buffer_delete(b, &start, &end);
+  xmlview_busy = FALSE;
+
+  xmlview_delete_mark(b, &xmlview_dirty_start);
+  xmlview_delete_mark(b, &xmlview_dirty_end);
+  gtk_text_buffer_set_modified(b, FALSE);
+  return XMLVIEW_APPLY_DONE;
+}
+
+
+/// Whether @a e touches the children of xmlview_node or one of its ancestors
+static gboolean xmlview_edit_touches(const struct doc_edit *e)
+{
+  if(e->type == DOC_EDIT_REORDERED) return e->new_node == xmlview_node;
+  // removed and replaced nodes still point to their old parent
+  if(e->old_node && e->old_node->parent == xmlview_node) return TRUE;
+  if(e->new_node && e->new_node->parent == xmlview_node) return TRUE;
+  xmlNodePtr a;
+  for(a = xmlview_node; e->old_node && a; a = a->parent)
+    if(a == e->old_node) return TRUE;
+  return FALSE;
+}
+
+
+/// Drop the pointers to children of the shown node that were edited
+/** Subscribed with doc_edit_subscribe().  Old nodes are still readable
+ * while subscribers run, but watch_patch() frees them afterwards.  If the
+ * user did not change the text, the node is shown again, else the text
+ * stays and is parsed as a whole on apply.
+ */
+void xmlview_doc_edited(const struct doc_edit *edits, guint n,
+    gpointer user_data)
+{
+  if(!xmlview_node || xmlview_applying) return;
+  guint i;
+  for(i = 0; i < n && !xmlview_edit_touches(&edits[i]); i++);
+  if(i == n) return;
+
+  xmlNodePtr shown = xmlview_node;
+  gboolean user_changed = xmlview_dirty_start != NULL;
+  xmlview_forget();
+  if(user_changed || !doc_node_is_live(shown)) return;
+  xmlview_show(shown);
+}
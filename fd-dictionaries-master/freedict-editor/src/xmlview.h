@@ -0,0 +1,18 @@
+#include <libxml/tree.h>
+#include <glib.h>
+
+/// Result of xmlview_apply_region()
+enum xmlview_apply
+{
+  XMLVIEW_APPLY_WHOLE,///< the whole text has to be parsed again
+  XMLVIEW_APPLY_DONE,
+  XMLVIEW_APPLY_FAILED///< the changed part is not well formed or not valid
+};
+
+// The XML view, filled piecewise for large nodes
+void xmlview_show(const xmlNodePtr n);
+void xmlview_forget(void);
+enum xmlview_apply xmlview_apply_region(void);
+struct doc_edit;
+void xmlview_doc_edited(const struct doc_edit *edits, guint n,
+    gpointer user_data);
@@ -0,0 +1,270 @@
+/** @file
+ * @brief Evaluating an XPath expression over many TEI files from the shell
+ *
+ * Answers questions like "how many entries of all eng-* dictionaries lack
+ * gramGrp/pos" without opening each file in the editor:
+ *
+ *   freedict-xpath '//entry[not(.//gramGrp/pos)]' eng-*\/eng-*.tei
+ *
+ * The files are loaded and searched by a pool of threads.  Since a parsed
+ * dictionary takes several times the size of its file, a thread only loads
+ * a file when the estimated size of all loaded documents stays within a
+ * memory budget.  Each thread compiles the expression once and uses it for
+ * all files it searches.  The fd: extension functions of the editor are
+ * available, see find_node_set_compiled().
+ *
+ * The DTD that all dictionaries share is parsed only once, see
+ * schemacache.c.
+ *
+ * Results are printed in the order of the files on the command line: the
+ * number of matches, or with --headwords the headwords of the entries
+ * containing them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "xml.h"
+#include "schemacache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/// Estimated size of a parsed document relative to the size of its file
+#define XPATHQUERY_DOM_FACTOR 8
+
+/// Default memory budget for loaded documents in megabytes
+#define XPATHQUERY_DEFAULT_BUDGET 512
+
+/// Default number of threads loading and searching files
+#define XPATHQUERY_DEFAULT_THREADS 4
+
+/// One file given on the command line and the outcome of its search
+struct xpathquery_file
+{
+  const char *filename;
+  gsize reserved;///< Bytes of the budget taken while the file is loaded
+  int count;///< Number of matching nodes, -1 if the file was not loaded
+  GString *headwords;///< One line per matching entry, with --headwords
+  gboolean done;
+};
+
+static const char *xpathquery_xpath;
+static gboolean xpathquery_headwords;
+
+/// Protects all following variables and the done flags of the files
+static GMutex *xpathquery_mutex;
+/// Signalled when a file is done or memory is released
+static GCond *xpathquery_cond;
+static gsize xpathquery_budget, xpathquery_in_use;
+
+/// The compiled expression of the current worker thread
+static GPrivate *xpathquery_comp;
+
+
+/////////////////////////////////////////////////////////////////////////
+// Searching the files
+/////////////////////////////////////////////////////////////////////////
+
+/// Blocks until @a bytes fit into the memory budget and takes them
+/** A single file larger than the whole budget is loaded when nothing else
+ * is, so every file gets its turn.
+ */
+static void xpathquery_reserve(gsize bytes)
+{
+  g_mutex_lock(xpathquery_mutex);
+  while(xpathquery_in_use && xpathquery_in_use + bytes > xpathquery_budget)
+    g_cond_wait(xpathquery_cond, xpathquery_mutex);
+  xpathquery_in_use += bytes;
+  g_mutex_unlock(xpathquery_mutex);
+}
+
+
+/// The nearest entry element containing @a n, or NULL
+static xmlNodePtr xpathquery_entry_of(xmlNodePtr n)
+{
+  // namespace nodes in a node set are no real xmlNodes
+  if(n->type == XML_NAMESPACE_DECL) return NULL;
+  for(; n; n = n->parent)
+    if(n->type == XML_ELEMENT_NODE && !xmlStrcmp(n->name, (xmlChar *) "entry"))
+      return n;
+  return NULL;
+}
+
+
+/// Appends a line for each entry containing nodes of @a nodes
+/** The lines start with @a filename, like those of grep.  Matches outside of
+ * entries are listed by their path.
+ */
+static void xpathquery_list_headwords(GString *out, const char *filename,
+    const xmlNodeSetPtr nodes)
+{
+  xmlNodePtr last = NULL;
+  char hw[400];
+  int i;
+  for(i = 0; i < nodes->nodeNr; i++)
+  {
+    xmlNodePtr n = nodes->nodeTab[i];
+    xmlNodePtr entry = xpathquery_entry_of(n);
+    // node sets are in document order, so matches in one entry are adjacent
+    if(entry && entry == last) continue;
+    last = entry;
+
+    if(entry)
+    {
+      entry_orths_to_string(entry, sizeof(hw), hw);
+      g_string_append_printf(out, "%s\t%s\n", filename, hw);
+      continue;
+    }
+    xmlChar *path = n->type == XML_NAMESPACE_DECL ? NULL : xmlGetNodePath(n);
+    g_string_append_printf(out, "%s\t%s\n", filename,
+	path ? (char *) path : "(namespace)");
+    xmlFree(path);
+  }
+}
+
+
+/// Thread pool function: load, search and free one file
+static void xpathquery_search_file(gpointer data, gpointer user_data)
+{
+  struct xpathquery_file *f = data;
+
+  xmlXPathCompExprPtr comp = g_private_get(xpathquery_comp);
+  if(!comp)
+  {
+    // the expression was checked in main(), so this does not fail
+    comp = compile_xpath(xpathquery_xpath);
+    g_private_set(xpathquery_comp, comp);
+  }
+
+  struct stat st;
+  f->reserved = stat(f->filename, &st) ? 0 :
+    (gsize) st.st_size * XPATHQUERY_DOM_FACTOR;
+  xpathquery_reserve(f->reserved);
+
+  xmlParserCtxtPtr ctxt = xmlNewParserCtxt();
+  xmlDocPtr doc = NULL;
+  if(ctxt)
+  {
+    schema_cache_use(ctxt);
+    doc = xmlCtxtReadFile(ctxt, f->filename, NULL, XML_PARSE_NOENT |
+	XML_PARSE_DTDLOAD | XML_PARSE_NONET | XML_PARSE_COMPACT);
+    xmlFreeParserCtxt(ctxt);
+  }
+  if(doc && comp)
+  {
+    xmlNodeSetPtr nodes = find_node_set_compiled(comp, doc);
+    f->count = nodes ? nodes->nodeNr : 0;
+    if(nodes && xpathquery_headwords)
+    {
+      f->headwords = g_string_new(NULL);
+      xpathquery_list_headwords(f->headwords, f->filename, nodes);
+    }
+    xmlXPathFreeNodeSet(nodes);
+  }
+  if(doc) xmlFreeDoc(doc);
+
+  g_mutex_lock(xpathquery_mutex);
+  xpathquery_in_use -= f->reserved;
+  f->done = TRUE;
+  g_cond_broadcast(xpathquery_cond);
+  g_mutex_unlock(xpathquery_mutex);
+}
+
+
+static void xpathquery_usage(const char *name)
+{
+  g_printerr("Usage: %s [-j THREADS] [-m MEGABYTES] [--headwords] "
+      "XPATH FILE...\n"
+      "Prints the number of nodes matching XPATH in each TEI FILE, or with\n"
+      "--headwords the headwords of the entries containing them.  The\n"
+      "extension functions of the editor can be used with the prefix "
+      FREEDICT_EDITOR_NAMESPACE_PREFIX ":.\n"
+      "  -j  number of files searched at the same time (default %i)\n"
+      "  -m  memory budget for loaded documents (default %i MB)\n",
+      name, XPATHQUERY_DEFAULT_THREADS, XPATHQUERY_DEFAULT_BUDGET);
+}
+
+
+int main(int argc, char *argv[])
+{
+  int threads = XPATHQUERY_DEFAULT_THREADS;
+  int budget = XPATHQUERY_DEFAULT_BUDGET;
+  int i = 1;
+  for(; i < argc && argv[i][0] == '-'; i++)
+  {
+    if(!strcmp(argv[i], "--headwords")) xpathquery_headwords = TRUE;
+    else if(!strcmp(argv[i], "-j") && i + 1 < argc) threads = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-m") && i + 1 < argc) budget = atoi(argv[++i]);
+    else break;
+  }
+  if(argc - i < 2 || threads < 1 || budget < 1)
+  {
+    xpathquery_usage(argv[0]);
+    return 2;
+  }
+  xpathquery_xpath = argv[i++];
+
+  LIBXML_TEST_VERSION
+  xmlInitParser();
+  if(!g_thread_supported()) g_thread_init(NULL);
+
+  xmlXPathCompExprPtr comp = compile_xpath(xpathquery_xpath);
+  if(!comp)
+  {
+    g_printerr("Invalid XPath expression: %s\n", xpathquery_xpath);
+    return 2;
+  }
+  xmlXPathFreeCompExpr(comp);
+
+  find_nodeset_pcontext_mutex = g_mutex_new();
+  xpathquery_mutex = g_mutex_new();
+  xpathquery_cond = g_cond_new();
+  xpathquery_budget = (gsize) budget * 1024 * 1024;
+  xpathquery_comp = g_private_new((GDestroyNotify) xmlXPathFreeCompExpr);
+
+  int nfiles = argc - i;
+  struct xpathquery_file *files = g_new0(struct xpathquery_file, nfiles);
+  GThreadPool *pool = g_thread_pool_new(xpathquery_search_file, NULL,
+      threads, FALSE, NULL);
+  int f;
+  for(f = 0; f < nfiles; f++)
+  {
+    files[f].filename = argv[i + f];
+    files[f].count = -1;
+    g_thread_pool_push(pool, &files[f], NULL);
+  }
+
+  // print in the order of the command line, as soon as possible
+  int total = 0, failed = 0;
+  for(f = 0; f < nfiles; f++)
+  {
+    struct xpathquery_file *file = &files[f];
+    g_mutex_lock(xpathquery_mutex);
+    while(!file->done) g_cond_wait(xpathquery_cond, xpathquery_mutex);
+    g_mutex_unlock(xpathquery_mutex);
+
+    if(file->count < 0)
+    {
+      g_printerr("%s: could not be loaded\n", file->filename);
+      failed++;
+      continue;
+    }
+    total += file->count;
+    if(!xpathquery_headwords)
+      g_print("%s\t%i\n", file->filename, file->count);
+    else if(file->headwords)
+    {
+      g_print("%s", file->headwords->str);
+      g_string_free(file->headwords, TRUE);
+    }
+  }
+  if(nfiles > 1 && !xpathquery_headwords) g_print("total\t%i\n", total);
+
+  g_thread_pool_free(pool, FALSE, TRUE);
+  g_free(files);
+  xmlCleanupParser();
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,329 @@
+/** @file
+ * @brief Profiling the stylesheet of the HTML preview
+ *
+ * When profiling is switched on, the preview is transformed with libxslt's
+ * profiler enabled.  libxslt adds the calls of every template and the time
+ * spent in it (without the templates it calls in turn) to the template
+ * itself, so the numbers accumulate over all previews until they are reset
+ * or another stylesheet is loaded.  The profile window lists the templates
+ * that took most of the time, next to the time of the whole transformation.
+ * If the templates account for only a small part of it, the time is spent
+ * in the engine rather than in the stylesheet.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <gnome.h>
+
+#include "xsltprof.h"
+#include "utils.h"
+
+#include <libxslt/imports.h>
+#include <libxslt/transform.h>
+#include <libxslt/xsltutils.h>
+
+extern GtkWidget *app1;
+
+/// How many templates the profile window lists
+#define XSLTPROF_MAX_ROWS 50
+
+static gboolean xsltprof_on;
+
+/// The stylesheet that the totals below belong to
+static xsltStylesheetPtr profiled_style;
+static int profiled_previews;
+/// Time of all profiled transformations, including the engine's own work
+static gdouble profiled_seconds;
+
+static GtkWidget *xsltprof_window;
+static GtkListStore *xsltprof_store;
+static GtkWidget *xsltprof_summary;
+static guint xsltprof_refresh_id;
+
+enum
+{
+  XSLTPROF_TEMPLATE_COLUMN,
+  XSLTPROF_CALLS_COLUMN,
+  XSLTPROF_TIME_COLUMN,
+  XSLTPROF_AVERAGE_COLUMN,
+  XSLTPROF_SHARE_COLUMN,
+  N_XSLTPROF_COLUMNS
+};
+
+
+static gdouble xsltprof_ms(long tics)
+{
+  return tics / (XSLT_TIMESTAMP_TICS_PER_SEC / 1000.0);
+}
+
+
+/// GCompareFunc for g_ptr_array_sort(), most time first
+static gint xsltprof_compare_time(gconstpointer a, gconstpointer b)
+{
+  long ta = (*(xsltTemplatePtr *) a)->time;
+  long tb = (*(xsltTemplatePtr *) b)->time;
+  return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+
+/// Templates of @a style and its imports that were called, most time first
+static GPtrArray *xsltprof_templates(xsltStylesheetPtr style)
+{
+  GPtrArray *a = g_ptr_array_new();
+  xsltStylesheetPtr st;
+  xsltTemplatePtr t;
+  for(st = style; st; st = xsltNextImport(st))
+    for(t = st->templates; t; t = t->next)
+      if(t->nbCalls) g_ptr_array_add(a, t);
+  g_ptr_array_sort(a, xsltprof_compare_time);
+  return a;
+}
+
+
+/// The attributes that identify @a t in the stylesheet
+static gchar *xsltprof_template_label(xsltTemplatePtr t)
+{
+  GString *s = g_string_new(NULL);
+  if(t->match) g_string_append_printf(s, "match=\"%s\"", (char *) t->match);
+  if(t->name) g_string_append_printf(s, "%sname=\"%s\"",
+      s->len ? " " : "", (char *) t->name);
+  if(t->mode) g_string_append_printf(s, "%smode=\"%s\"",
+      s->len ? " " : "", (char *) t->mode);
+  return g_string_free(s, FALSE);
+}
+
+
+/// Fill the window from the counters of the templates
+static gboolean xsltprof_refresh(gpointer data)
+{
+  xsltprof_refresh_id = 0;
+  if(!xsltprof_store) return FALSE;
+
+  gtk_list_store_clear(xsltprof_store);
+  GPtrArray *a = profiled_style ? xsltprof_templates(profiled_style) :
+    g_ptr_array_new();
+
+  long total = 0;
+  guint i;
+  for(i = 0; i < a->len; i++)
+    total += ((xsltTemplatePtr) g_ptr_array_index(a, i))->time;
+
+  for(i = 0; i < a->len && i < XSLTPROF_MAX_ROWS; i++)
+  {
+    xsltTemplatePtr t = g_ptr_array_index(a, i);
+    gchar *label = xsltprof_template_label(t);
+    char time[20], average[20], share[20];
+    g_snprintf(time, sizeof(time), "%.1f", xsltprof_ms(t->time));
+    g_snprintf(average, sizeof(average), "%.3f",
+	xsltprof_ms(t->time) / t->nbCalls);
+    g_snprintf(share, sizeof(share), "%.1f%%",
+	total ? 100.0 * t->time / total : 0.0);
+
+    GtkTreeIter iter;
+    gtk_list_store_append(xsltprof_store, &iter);
+    gtk_list_store_set(xsltprof_store, &iter,
+	XSLTPROF_TEMPLATE_COLUMN, label,
+	XSLTPROF_CALLS_COLUMN, t->nbCalls,
+	XSLTPROF_TIME_COLUMN, time,
+	XSLTPROF_AVERAGE_COLUMN, average,
+	XSLTPROF_SHARE_COLUMN, share, -1);
+    g_free(label);
+  }
+  g_ptr_array_free(a, TRUE);
+
+  gchar *summary;
+  if(!xsltprof_on && !profiled_previews)
+    summary = g_strdup(_("Profiling is off.  Switch it on in the View menu "
+	  "and show some entries."));
+  else summary = g_strdup_printf(
+      _("%s\n%i previews took %.1f ms to transform, %.1f ms of it in templates."),
+      profiled_style && profiled_style->doc && profiled_style->doc->URL ?
+      (char *) profiled_style->doc->URL : "",
+      profiled_previews, profiled_seconds * 1000.0, xsltprof_ms(total));
+  gtk_label_set_text(GTK_LABEL(xsltprof_summary), summary);
+  g_free(summary);
+  return FALSE;
+}
+
+
+static void xsltprof_changed(void)
+{
+  if(xsltprof_window && !xsltprof_refresh_id)
+    xsltprof_refresh_id = g_idle_add(xsltprof_refresh, NULL);
+}
+
+
+/// Start counting from zero
+static void xsltprof_reset(void)
+{
+  xsltStylesheetPtr st;
+  xsltTemplatePtr t;
+  for(st = profiled_style; st; st = xsltNextImport(st))
+    for(t = st->templates; t; t = t->next)
+    {
+      t->nbCalls = 0;
+      t->time = 0;
+    }
+  profiled_previews = 0;
+  profiled_seconds = 0;
+  xsltprof_changed();
+}
+
+
+/// Apply @a style to @a doc, like xsltApplyStylesheet()
+/** If profiling is switched on, the time of the transformation and of its
+ * templates is added to the profile.
+ */
+xmlDocPtr xsltprof_apply(xsltStylesheetPtr style, xmlDocPtr doc,
+    const char **params)
+{
+  if(!xsltprof_on) return xsltApplyStylesheet(style, doc, params);
+
+  // the counters of a newly loaded stylesheet start at zero
+  if(style != profiled_style)
+  {
+    profiled_style = style;
+    profiled_previews = 0;
+    profiled_seconds = 0;
+  }
+
+  xsltTransformContextPtr ctxt = xsltNewTransformContext(style, doc);
+  if(!ctxt) return NULL;
+  ctxt->profile = 1;
+
+  GTimer *timer = g_timer_new();
+  xmlDocPtr res = xsltApplyStylesheetUser(style, doc, params, NULL, NULL, ctxt);
+  profiled_seconds += g_timer_elapsed(timer, NULL);
+  g_timer_destroy(timer);
+  profiled_previews++;
+
+  xsltFreeTransformContext(ctxt);
+  xsltprof_changed();
+  return res;
+}
+
+
+static void on_xsltprof_reset_clicked(GtkButton *button, gpointer user_data)
+{
+  xsltprof_reset();
+}
+
+
+static void on_xsltprof_window_destroy(GtkWidget *widget, gpointer user_data)
+{
+  xsltprof_window = NULL;
+  g_object_unref(xsltprof_store);
+  xsltprof_store = NULL;
+}
+
+
+static void on_profile_preview_toggled(GtkCheckMenuItem *item,
+    gpointer user_data)
+{
+  xsltprof_on = gtk_check_menu_item_get_active(item);
+  if(xsltprof_on) mystatus(_("Profiling the stylesheet of the HTML preview."));
+  xsltprof_changed();
+}
+
+
+static void on_preview_profile_activate(GtkMenuItem *menuitem,
+    gpointer user_data)
+{
+  if(xsltprof_window)
+  {
+    gtk_window_present(GTK_WINDOW(xsltprof_window));
+    return;
+  }
+
+  xsltprof_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_title(GTK_WINDOW(xsltprof_window),
+      _("HTML Preview Profile"));
+  gtk_window_set_transient_for(GTK_WINDOW(xsltprof_window), GTK_WINDOW(app1));
+  gtk_window_set_default_size(GTK_WINDOW(xsltprof_window), 600, 400);
+  g_signal_connect(xsltprof_window, "destroy",
+      G_CALLBACK(on_xsltprof_window_destroy), NULL);
+
+  GtkWidget *vbox = gtk_vbox_new(FALSE, 6);
+  gtk_container_set_border_width(GTK_CONTAINER(vbox), 6);
+  gtk_container_add(GTK_CONTAINER(xsltprof_window), vbox);
+
+  xsltprof_summary = gtk_label_new(NULL);
+  gtk_misc_set_alignment(GTK_MISC(xsltprof_summary), 0, 0.5);
+  gtk_box_pack_start(GTK_BOX(vbox), xsltprof_summary, FALSE, FALSE, 0);
+
+  xsltprof_store = gtk_list_store_new(N_XSLTPROF_COLUMNS, G_TYPE_STRING,
+      G_TYPE_INT, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+  GtkWidget *view = gtk_tree_view_new_with_model(
+      GTK_TREE_MODEL(xsltprof_store));
+  GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
+  gtk_tree_view_append_column(GTK_TREE_VIEW(view),
+      gtk_tree_view_column_new_with_attributes(_("Template"), renderer,
+	"text", XSLTPROF_TEMPLATE_COLUMN, NULL));
+
+  const struct { const char *title; int column; } numbers[] = {
+    { N_("Calls"), XSLTPROF_CALLS_COLUMN },
+    { N_("Time (ms)"), XSLTPROF_TIME_COLUMN },
+    { N_("Average (ms)"), XSLTPROF_AVERAGE_COLUMN },
+    { N_("Share"), XSLTPROF_SHARE_COLUMN }
+  };
+  int i;
+  for(i = 0; i < G_N_ELEMENTS(numbers); i++)
+  {
+    renderer = gtk_cell_renderer_text_new();
+    g_object_set(renderer, "xalign", 1.0, NULL);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(view),
+	gtk_tree_view_column_new_with_attributes(_(numbers[i].title), renderer,
+	  "text", numbers[i].column, NULL));
+  }
+
+  GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+  gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled),
+      GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+  gtk_container_add(GTK_CONTAINER(scrolled), view);
+  gtk_box_pack_start(GTK_BOX(vbox), scrolled, TRUE, TRUE, 0);
+
+  GtkWidget *buttons = gtk_hbutton_box_new();
+  gtk_button_box_set_layout(GTK_BUTTON_BOX(buttons), GTK_BUTTONBOX_END);
+  gtk_box_set_spacing(GTK_BOX(buttons), 6);
+  GtkWidget *reset = gtk_button_new_with_mnemonic(_("_Reset"));
+  g_signal_connect(reset, "clicked", G_CALLBACK(on_xsltprof_reset_clicked),
+      NULL);
+  gtk_container_add(GTK_CONTAINER(buttons), reset);
+  GtkWidget *close = gtk_button_new_from_stock(GTK_STOCK_CLOSE);
+  g_signal_connect_swapped(close, "clicked",
+      G_CALLBACK(gtk_widget_destroy), xsltprof_window);
+  gtk_container_add(GTK_CONTAINER(buttons), close);
+  gtk_box_pack_start(GTK_BOX(vbox), buttons, FALSE, FALSE, 0);
+
+  xsltprof_refresh(NULL);
+  gtk_widget_show_all(xsltprof_window);
+}
+
+
+/// Add the profiling switch and the profile window to the menu of @a after
+void xsltprof_add_menu_items(GtkWidget *after)
+{
+  g_return_if_fail(after);
+  GtkWidget *menu = gtk_widget_get_parent(after);
+  g_return_if_fail(GTK_IS_MENU_SHELL(menu));
+
+  GList *children = gtk_container_get_children(GTK_CONTAINER(menu));
+  int pos = g_list_index(children, after);
+  g_list_free(children);
+
+  GtkWidget *item = gtk_check_menu_item_new_with_mnemonic(
+      _("Profile HTML _Preview"));
+  gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(item), xsltprof_on);
+  g_signal_connect(item, "toggled", G_CALLBACK(on_profile_preview_toggled),
+      NULL);
+  gtk_menu_shell_insert(GTK_MENU_SHELL(menu), item, pos + 1);
+  gtk_widget_show(item);
+
+  item = gtk_menu_item_new_with_mnemonic(_("HTML Preview Pro_file"));
+  g_signal_connect(item, "activate", G_CALLBACK(on_preview_profile_activate),
+      NULL);
+  gtk_menu_shell_insert(GTK_MENU_SHELL(menu), item, pos + 2);
+  gtk_widget_show(item);
+}
@@ -0,0 +1,7 @@
+#include <libxslt/xsltInternals.h>
+#include <gnome.h>
+
+// Profiling the stylesheet of the HTML preview
+xmlDocPtr xsltprof_apply(xsltStylesheetPtr style, xmlDocPtr doc,
+    const char **params);
+void xsltprof_add_menu_items(GtkWidget *after);